@@ -35,6 +35,24 @@ class AddressIndexTest(BitcoinTestFramework):
         self.is_network_split = False
         self.sync_all()
 
+    def get_pages(self, method, query, key):
+        # Follow the cursor from the first page to the last, returns the pages' entries
+        pages = []
+        page = method(query)
+        pages.append(page[key])
+        while "cursor" in page:
+            page = method(dict(query, cursor=page["cursor"]))
+            pages.append(page[key])
+        return pages
+
+    def assert_rpc_error(self, message, method, *args):
+        try:
+            method(*args)
+        except JSONRPCException as e:
+            assert_equal(e.error["message"], message)
+        else:
+            raise AssertionError("Expected error: " + message)
+
     def run_test(self):
         print "Mining blocks..."
         self.nodes[0].generate(105)
@@ -129,6 +147,43 @@ class AddressIndexTest(BitcoinTestFramework):
         assert_equal(len(txidsmany), 4)
         assert_equal(txidsmany[3], sent_txid)
 
+        # Check that txids can be paged through, keeping a transaction on one page
+        print "Testing paging..."
+        addressb = "93bVhahvUKmQu8gu9g3QnPPa2cxFK98pMB"
+        addressy = "yMNJePdcKvXtWWQnFYHNeJ5u8TF2v1dfK4"
+        pages = self.get_pages(self.nodes[1].getaddresstxids, {"addresses": [addressb], "limit": 1}, "txids")
+        assert_equal(pages, [[txidb0], [txidb1], [txidb2], [sent_txid]])
+
+        # the last transaction's second output is read past the limit instead of starting another page
+        pages = self.get_pages(self.nodes[1].getaddresstxids, {"addresses": [addressb], "limit": 4}, "txids")
+        assert_equal(pages, [txidsmany])
+
+        # several addresses continue one after the other across pages
+        pages = self.get_pages(self.nodes[1].getaddresstxids, {"addresses": [addressb, addressy], "limit": 2}, "txids")
+        assert_equal(pages, [[txidb0, txidb1], [txidb2, sent_txid], [txid0, txid1], [txid2]])
+
+        # paged utxos come in index order, the same outputs as without a limit
+        utxosAll = self.nodes[1].getaddressutxos({"addresses": [addressb, addressy]})
+        assert_equal(len(utxosAll), 8)
+        pages = self.get_pages(self.nodes[1].getaddressutxos, {"addresses": [addressb, addressy], "limit": 3}, "utxos")
+        assert_equal([len(page) for page in pages], [3, 3, 2])
+        utxosPaged = [utxo for page in pages for utxo in page]
+        assert_equal([utxo["address"] for utxo in utxosPaged], [addressb] * 5 + [addressy] * 3)
+        utxoKey = lambda utxo: (utxo["txid"], utxo["outputIndex"])
+        assert_equal(sorted(utxosPaged, key=utxoKey), sorted(utxosAll, key=utxoKey))
+
+        # cursors only continue the query they came from
+        page = self.nodes[1].getaddresstxids({"addresses": [addressb], "limit": 1})
+        self.assert_rpc_error("Cursor does not belong to the given addresses", self.nodes[1].getaddresstxids,
+                              {"addresses": [addressy], "limit": 1, "cursor": page["cursor"]})
+        page = self.nodes[1].getaddressutxos({"addresses": [addressb], "limit": 1})
+        self.assert_rpc_error("Cursor does not belong to the given addresses", self.nodes[1].getaddressutxos,
+                              {"addresses": [addressy], "limit": 1, "cursor": page["cursor"]})
+        self.assert_rpc_error("Invalid cursor", self.nodes[1].getaddresstxids,
+                              {"addresses": [addressb], "limit": 1, "cursor": "not a cursor"})
+        self.assert_rpc_error("Invalid cursor", self.nodes[1].getaddressutxos,
+                              {"addresses": [addressb], "limit": 1, "cursor": page["cursor"][:10]})
+
         # Check that balances are correct
         print "Testing balances..."
         balance0 = self.nodes[1].getaddressbalance("93bVhahvUKmQu8gu9g3QnPPa2cxFK98pMB")
@@ -154,6 +209,7 @@ class AddressIndexTest(BitcoinTestFramework):
         self.sync_all()
         balance1 = self.nodes[1].getaddressbalance(address2)
         assert_equal(balance1["balance"], amount)
+        assert_equal(balance1["txcount"], 1)
 
         tx = CTransaction()
         tx.vin = [CTxIn(COutPoint(int(spending_txid, 16), 0))]
@@ -169,6 +225,8 @@ class AddressIndexTest(BitcoinTestFramework):
 
         balance2 = self.nodes[1].getaddressbalance(address2)
         assert_equal(balance2["balance"], change_amount)
+        assert_equal(balance2["received"], amount + change_amount)
+        assert_equal(balance2["txcount"], 2)
 
         # Check that deltas are returned correctly
         deltas = self.nodes[1].getaddressdeltas({"addresses": [address2], "start": 0, "end": 200})
@@ -183,6 +241,15 @@ class AddressIndexTest(BitcoinTestFramework):
         deltasAll = self.nodes[1].getaddressdeltas({"addresses": [address2]})
         assert_equal(len(deltasAll), len(deltas))
 
+        # Check that deltas can be paged through with a cursor
+        deltasPaged = []
+        page = self.nodes[1].getaddressdeltas({"addresses": [address2], "limit": 1})
+        deltasPaged += page["deltas"]
+        while "cursor" in page:
+            page = self.nodes[1].getaddressdeltas({"addresses": [address2], "limit": 1, "cursor": page["cursor"]})
+            deltasPaged += page["deltas"]
+        assert_equal(deltasPaged, deltasAll)
+
         # Check that deltas can be returned from range of block heights
         deltas = self.nodes[1].getaddressdeltas({"addresses": [address2], "start": 113, "end": 113})
         assert_equal(len(deltas), 1)
@@ -323,6 +390,19 @@ class AddressIndexTest(BitcoinTestFramework):
         mempool_deltas = self.nodes[2].getaddressmempool({"addresses": [address1]})
         assert_equal(len(mempool_deltas), 2)
 
+        # Verifying blocks at startup reconnects them, which must not count them twice
+        print "Testing restart with -checklevel=4..."
+        self.nodes[0].generate(1)
+        self.sync_all()
+        balance_addresses = [address1, address2, address3, "yMNJePdcKvXtWWQnFYHNeJ5u8TF2v1dfK4"]
+        balances = [self.nodes[1].getaddressbalance(address) for address in balance_addresses]
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir, ["-debug", "-addressindex", "-checklevel=4", "-checkblocks=200"])
+        connect_nodes(self.nodes[0], 1)
+        sync_blocks(self.nodes)
+        for address, balance in zip(balance_addresses, balances):
+            assert_equal(self.nodes[1].getaddressbalance(address), balance)
+
         print "Passed\n"
 
 
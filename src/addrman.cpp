@@ -71,29 +71,48 @@ double CAddrInfo::GetChance(int64_t nNow) const
     return fChance;
 }
 
+CAddrManHasher::CAddrManHasher() :
+    k0(GetRand(std::numeric_limits<uint64_t>::max())),
+    k1(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+}
+
+size_t CAddrManHasher::operator()(const CNetAddr& addr) const
+{
+    unsigned char vch[16];
+    for (int i = 0; i < 16; i++)
+        vch[i] = addr.GetByte(15 - i);
+    return CSipHasher(k0, k1).Write(vch, sizeof(vch)).Finalize();
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    boost::unordered_map<CNetAddr, int, CAddrManHasher>::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
-    return NULL;
+    return &vInfo[(*it).second];
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, int* pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    int nId;
+    if (!vFreeIds.empty()) {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    } else {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    }
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
+    nChanges++;
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -106,28 +125,56 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
-
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
 }
 
+// Keep the list of occupied positions of a bucket table in step with the table itself,
+// removal swaps the last occupied position into the hole.
+static void SetSlot(int* pTable, int* pSlotPos, std::vector<int>& vSlots, int nSlot, int nId)
+{
+    if (pTable[nSlot] == -1 && nId != -1) {
+        pSlotPos[nSlot] = vSlots.size();
+        vSlots.push_back(nSlot);
+    } else if (pTable[nSlot] != -1 && nId == -1) {
+        int nLast = vSlots.back();
+        vSlots[pSlotPos[nSlot]] = nLast;
+        pSlotPos[nLast] = pSlotPos[nSlot];
+        vSlots.pop_back();
+        pSlotPos[nSlot] = -1;
+    }
+    pTable[nSlot] = nId;
+}
+
+void CAddrMan::SetTried(int nKBucket, int nKBucketPos, int nId)
+{
+    SetSlot(&vvTried[0][0], vTriedSlotPos, vTriedSlots, nKBucket * ADDRMAN_BUCKET_SIZE + nKBucketPos, nId);
+    nChanges++;
+}
+
+void CAddrMan::SetNew(int nUBucket, int nUBucketPos, int nId)
+{
+    SetSlot(&vvNew[0][0], vNewSlotPos, vNewSlots, nUBucket * ADDRMAN_BUCKET_SIZE + nUBucketPos, nId);
+    nChanges++;
+}
+
 void CAddrMan::Delete(int nId)
 {
-    assert(mapInfo.count(nId) != 0);
-    CAddrInfo& info = mapInfo[nId];
+    assert(nId >= 0 && (size_t)nId < vInfo.size() && vInfo[nId].nRandomPos != -1);
+    CAddrInfo& info = vInfo[nId];
     assert(!info.fInTried);
     assert(info.nRefCount == 0);
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
     mapAddr.erase(info);
-    mapInfo.erase(nId);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
     nNew--;
+    nChanges++;
 }
 
 void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
@@ -135,10 +182,10 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
     // if there is an entry in the specified bucket, delete it.
     if (vvNew[nUBucket][nUBucketPos] != -1) {
         int nIdDelete = vvNew[nUBucket][nUBucketPos];
-        CAddrInfo& infoDelete = mapInfo[nIdDelete];
+        CAddrInfo& infoDelete = vInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
+        SetNew(nUBucket, nUBucketPos, -1);
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
         }
@@ -151,7 +198,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
         int pos = info.GetBucketPosition(nKey, true, bucket);
         if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
+            SetNew(bucket, pos, -1);
             info.nRefCount--;
         }
     }
@@ -167,12 +214,11 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     if (vvTried[nKBucket][nKBucketPos] != -1) {
         // find an item to evict
         int nIdEvict = vvTried[nKBucket][nKBucketPos];
-        assert(mapInfo.count(nIdEvict) == 1);
-        CAddrInfo& infoOld = mapInfo[nIdEvict];
+        CAddrInfo& infoOld = vInfo[nIdEvict];
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
-        vvTried[nKBucket][nKBucketPos] = -1;
+        SetTried(nKBucket, nKBucketPos, -1);
         nTried--;
 
         // find which new bucket it belongs to
@@ -183,12 +229,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Enter it into the new set again.
         infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        SetNew(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
-    vvTried[nKBucket][nKBucketPos] = nId;
+    SetTried(nKBucket, nKBucketPos, nId);
     nTried++;
     info.fInTried = true;
 }
@@ -212,6 +258,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nLastSuccess = nTime;
     info.nLastTry = nTime;
     info.nAttempts = 0;
+    nChanges++;
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
 
@@ -255,11 +302,16 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         // periodically update nTime
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty)) {
             pinfo->nTime = std::max((int64_t)0, addr.nTime - nTimePenalty);
+            nChanges++;
+        }
 
         // add services
-        pinfo->nServices |= addr.nServices;
+        if ((pinfo->nServices | addr.nServices) != pinfo->nServices) {
+            pinfo->nServices |= addr.nServices;
+            nChanges++;
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -291,7 +343,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
     if (vvNew[nUBucket][nUBucketPos] != nId) {
         bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
         if (!fInsert) {
-            CAddrInfo& infoExisting = mapInfo[vvNew[nUBucket][nUBucketPos]];
+            CAddrInfo& infoExisting = vInfo[vvNew[nUBucket][nUBucketPos]];
             if (infoExisting.IsTerrible() || (infoExisting.nRefCount > 1 && pinfo->nRefCount == 0)) {
                 // Overwrite the existing new table entry.
                 fInsert = true;
@@ -300,7 +352,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            SetNew(nUBucket, nUBucketPos, nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -327,6 +379,7 @@ void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+    nChanges++;
 }
 
 CAddrInfo CAddrMan::Select_(bool newOnly)
@@ -340,18 +393,12 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
     // Use a 50% chance for choosing between tried and new table entries.
     if (!newOnly &&
        (nTried > 0 && (nNew == 0 || GetRandInt(2) == 0))) { 
-        // use a tried node
+        // use a tried node, picked from the occupied positions so sparse tables don't need probing
         double fChanceFactor = 1.0;
         while (1) {
-            int nKBucket = GetRandInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            while (vvTried[nKBucket][nKBucketPos] == -1) {
-                nKBucket = (nKBucket + insecure_rand()) % ADDRMAN_TRIED_BUCKET_COUNT;
-                nKBucketPos = (nKBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
+            int nSlot = vTriedSlots[GetRandInt(vTriedSlots.size())];
+            int nId = vvTried[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE];
+            CAddrInfo& info = vInfo[nId];
             if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
@@ -360,15 +407,9 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
         // use a new node
         double fChanceFactor = 1.0;
         while (1) {
-            int nUBucket = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            while (vvNew[nUBucket][nUBucketPos] == -1) {
-                nUBucket = (nUBucket + insecure_rand()) % ADDRMAN_NEW_BUCKET_COUNT;
-                nUBucketPos = (nUBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
+            int nSlot = vNewSlots[GetRandInt(vNewSlots.size())];
+            int nId = vvNew[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE];
+            CAddrInfo& info = vInfo[nId];
             if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
@@ -381,13 +422,15 @@ int CAddrMan::Check_()
 {
     std::set<int> setTried;
     std::map<int, int> mapNew;
+    size_t nNewSlots = 0;
 
     if (vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-        int n = (*it).first;
-        CAddrInfo& info = (*it).second;
+    for (size_t n = 0; n < vInfo.size(); n++) {
+        CAddrInfo& info = vInfo[n];
+        if (info.nRandomPos == -1)
+            continue;
         if (info.fInTried) {
             if (!info.nLastSuccess)
                 return -1;
@@ -401,9 +444,9 @@ int CAddrMan::Check_()
                 return -4;
             mapNew[n] = info.nRefCount;
         }
-        if (mapAddr[info] != n)
+        if (mapAddr[info] != (int)n)
             return -5;
-        if (info.nRandomPos < 0 || info.nRandomPos >= vRandom.size() || vRandom[info.nRandomPos] != n)
+        if (info.nRandomPos < 0 || info.nRandomPos >= vRandom.size() || vRandom[info.nRandomPos] != (int)n)
             return -14;
         if (info.nLastTry < 0)
             return -6;
@@ -421,10 +464,13 @@ int CAddrMan::Check_()
              if (vvTried[n][i] != -1) {
                  if (!setTried.count(vvTried[n][i]))
                      return -11;
-                 if (mapInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
+                 if (vInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
                      return -17;
-                 if (mapInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
+                 if (vInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
                      return -18;
+                 int nSlotPos = vTriedSlotPos[n * ADDRMAN_BUCKET_SIZE + i];
+                 if (nSlotPos < 0 || nSlotPos >= (int)vTriedSlots.size() || vTriedSlots[nSlotPos] != n * ADDRMAN_BUCKET_SIZE + i)
+                     return -20;
                  setTried.erase(vvTried[n][i]);
              }
         }
@@ -435,8 +481,12 @@ int CAddrMan::Check_()
             if (vvNew[n][i] != -1) {
                 if (!mapNew.count(vvNew[n][i]))
                     return -12;
-                if (mapInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
+                if (vInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
                     return -19;
+                int nSlotPos = vNewSlotPos[n * ADDRMAN_BUCKET_SIZE + i];
+                if (nSlotPos < 0 || nSlotPos >= (int)vNewSlots.size() || vNewSlots[nSlotPos] != n * ADDRMAN_BUCKET_SIZE + i)
+                    return -21;
+                nNewSlots++;
                 if (--mapNew[vvNew[n][i]] == 0)
                     mapNew.erase(vvNew[n][i]);
             }
@@ -445,6 +495,8 @@ int CAddrMan::Check_()
 
     if (setTried.size())
         return -13;
+    if (vTriedSlots.size() != (size_t)nTried || vNewSlots.size() != nNewSlots)
+        return -22;
     if (mapNew.size())
         return -15;
     if (nKey.IsNull())
@@ -467,9 +519,7 @@ void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
 
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-
-        const CAddrInfo& ai = mapInfo[vRandom[n]];
+        const CAddrInfo& ai = vInfo[vRandom[n]];
         if (!ai.IsTerrible())
             vAddr.push_back(ai);
     }
@@ -491,6 +541,8 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
-    if (nTime - info.nTime > nUpdateInterval)
+    if (nTime - info.nTime > nUpdateInterval) {
         info.nTime = nTime;
+        nChanges++;
+    }
 }
@@ -17,6 +17,8 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 /**
  * Extended statistics about a CAddress
  */
@@ -104,6 +106,17 @@ public:
 
 };
 
+/** Salted hasher for the address index; CNetAddr::GetHash() is a double SHA256 and far too slow for that */
+class CAddrManHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CAddrManHasher();
+    size_t operator()(const CNetAddr& addr) const;
+};
+
 /** Stochastic address manager
  *
  * Design goals:
@@ -128,6 +141,8 @@ public:
  *      be observable by adversaries.
  *    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
  *      consistency checks for the entire data structure.
+ *    * Entries live in a flat vector indexed by their id, found by address through a hash index. The occupied
+ *      positions of both tables are listed as well, so picking a random entry doesn't have to probe empty ones.
  */
 
 //! total number of buckets for tried addresses
@@ -171,6 +186,8 @@ public:
  */
 class CAddrMan
 {
+    friend class CAddrManTest;
+
 private:
     //! critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -178,14 +195,14 @@ private:
     //! secret key to randomize bucket select with
     uint256 nKey;
 
-    //! last used nId
-    int nIdCount;
+    //! information about all nIds, indexed by nId; unused ids have nRandomPos == -1
+    std::vector<CAddrInfo> vInfo;
 
-    //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    //! unused ids in vInfo, handed out again before vInfo grows
+    std::vector<int> vFreeIds;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    boost::unordered_map<CNetAddr, int, CAddrManHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -202,6 +219,17 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! occupied positions (bucket * ADDRMAN_BUCKET_SIZE + position) of vvTried and vvNew
+    std::vector<int> vTriedSlots;
+    std::vector<int> vNewSlots;
+
+    //! index of every position of vvTried and vvNew in vTriedSlots and vNewSlots, -1 if empty
+    int vTriedSlotPos[ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE];
+    int vNewSlotPos[ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE];
+
+    //! incremented on every change to the persisted state
+    uint64_t nChanges;
+
 protected:
 
     //! Find an entry.
@@ -214,6 +242,10 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    //! Set a position in a "tried" or "new" bucket (-1 to clear it), keeping vTriedSlots and vNewSlots in step.
+    void SetTried(int nKBucket, int nKBucketPos, int nId);
+    void SetNew(int nUBucket, int nUBucketPos, int nId);
+
     //! Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
@@ -264,7 +296,7 @@ public:
      * as incompatible. This is necessary because it did not check the version number on
      * deserialization.
      *
-     * Notice that vvTried, mapAddr and vVector are never encoded explicitly;
+     * Notice that vvTried, mapAddr and vRandom are never encoded explicitly;
      * they are instead reconstructed from the other information.
      *
      * vvNew is serialized, but only used if ADDRMAN_UNKNOWN_BUCKET_COUNT didn't change,
@@ -290,20 +322,20 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::vector<int> vUnkIds(vInfo.size(), -1);
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            mapUnkIds[(*it).first] = nIds;
-            const CAddrInfo &info = (*it).second;
+        for (size_t n = 0; n < vInfo.size(); n++) {
+            const CAddrInfo &info = vInfo[n];
             if (info.nRefCount) {
                 assert(nIds != nNew); // this means nNew was wrong, oh ow
+                vUnkIds[n] = nIds;
                 s << info;
                 nIds++;
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            const CAddrInfo &info = (*it).second;
+        for (size_t n = 0; n < vInfo.size(); n++) {
+            const CAddrInfo &info = vInfo[n];
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
                 s << info;
@@ -319,7 +351,7 @@ public:
             s << nSize;
             for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
                 if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
+                    int nIndex = vUnkIds[vvNew[bucket][i]];
                     s << nIndex;
                 }
             }
@@ -349,7 +381,8 @@ public:
 
         // Deserialize entries from the new table.
         for (int n = 0; n < nNew; n++) {
-            CAddrInfo &info = mapInfo[n];
+            vInfo.push_back(CAddrInfo());
+            CAddrInfo &info = vInfo.back();
             s >> info;
             mapAddr[info] = n;
             info.nRandomPos = vRandom.size();
@@ -360,12 +393,11 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                    SetNew(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
         }
-        nIdCount = nNew;
 
         // Deserialize entries from the tried table.
         int nLost = 0;
@@ -375,13 +407,13 @@ public:
             int nKBucket = info.GetTriedBucket(nKey);
             int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
             if (vvTried[nKBucket][nKBucketPos] == -1) {
+                int nId = vInfo.size();
                 info.nRandomPos = vRandom.size();
                 info.fInTried = true;
-                vRandom.push_back(nIdCount);
-                mapInfo[nIdCount] = info;
-                mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
-                nIdCount++;
+                vRandom.push_back(nId);
+                vInfo.push_back(info);
+                mapAddr[info] = nId;
+                SetTried(nKBucket, nKBucketPos, nId);
             } else {
                 nLost++;
             }
@@ -396,11 +428,11 @@ public:
                 int nIndex = 0;
                 s >> nIndex;
                 if (nIndex >= 0 && nIndex < nNew) {
-                    CAddrInfo &info = mapInfo[nIndex];
+                    CAddrInfo &info = vInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNew(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -408,13 +440,10 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
-            if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
-                Delete(itCopy->first);
+        for (size_t n = 0; n < vInfo.size(); n++) {
+            if (vInfo[n].nRandomPos != -1 && vInfo[n].fInTried == false && vInfo[n].nRefCount == 0) {
+                Delete(n);
                 nLostUnk++;
-            } else {
-                it++;
             }
         }
         if (nLost + nLostUnk > 0) {
@@ -432,24 +461,31 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        std::vector<CAddrInfo>().swap(vInfo);
+        std::vector<int>().swap(vFreeIds);
+        mapAddr.clear();
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvNew[bucket][entry] = -1;
+                vNewSlotPos[bucket * ADDRMAN_BUCKET_SIZE + entry] = -1;
             }
         }
         for (size_t bucket = 0; bucket < ADDRMAN_TRIED_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvTried[bucket][entry] = -1;
+                vTriedSlotPos[bucket * ADDRMAN_BUCKET_SIZE + entry] = -1;
             }
         }
+        std::vector<int>().swap(vNewSlots);
+        std::vector<int>().swap(vTriedSlots);
 
-        nIdCount = 0;
         nTried = 0;
         nNew = 0;
+        nChanges++;
     }
 
-    CAddrMan()
+    CAddrMan() : nChanges(0)
     {
         Clear();
     }
@@ -465,6 +501,13 @@ public:
         return vRandom.size();
     }
 
+    //! Number of changes so far, lets the caller skip writing out an unchanged table
+    uint64_t GetChangeCount() const
+    {
+        LOCK(cs);
+        return nChanges;
+    }
+
     //! Consistency check
     void Check()
     {
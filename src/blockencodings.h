@@ -0,0 +1,205 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2017-2018 The Growth Coin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCK_ENCODINGS_H
+#define BITCOIN_BLOCK_ENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <vector>
+
+class CTxMemPool;
+
+/** Request for the transactions of a compact block the requester could not find in its mempool */
+class BlockTransactionsRequest {
+public:
+    // A BlockTransactionsRequest message
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        unsigned int nSize = ::GetSerializeSize(blockhash, nType, nVersion) + GetSizeOfCompactSize(indexes.size());
+        for (size_t i = 0; i < indexes.size(); i++) {
+            uint64_t nIndex = indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1));
+            nSize += GetSizeOfCompactSize(nIndex);
+        }
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteCompactSize(s, indexes.size());
+        // indexes are ascending, each one is sent relative to the previous one
+        for (size_t i = 0; i < indexes.size(); i++)
+            WriteCompactSize(s, indexes[i] - (i == 0 ? 0 : (indexes[i - 1] + 1)));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        indexes.clear();
+        uint64_t nOffset = 0;
+        while (indexes.size() < nCount) {
+            // don't trust nCount for the allocation, grow in steps like vectors do
+            indexes.reserve(std::min((uint64_t)indexes.size() + 1000, nCount));
+            for (size_t i = indexes.size(); i < indexes.capacity(); i++) {
+                uint64_t nIndex = ReadCompactSize(s) + nOffset;
+                if (nIndex > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("index overflowed 16 bits");
+                indexes.push_back(nIndex);
+                nOffset = nIndex + 1;
+            }
+        }
+    }
+};
+
+/** The transactions answering a BlockTransactionsRequest, in the order they were requested */
+class BlockTransactions {
+public:
+    // A BlockTransactions message
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) :
+        blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent along with a compact block because the receiver can't be expected to have it */
+struct PrefilledTransaction {
+    // Used as an offset since last prefilled tx in CBlockHeaderAndShortTxIDs,
+    // as a proper transaction-in-block-index in PartiallyDownloadedBlock
+    uint16_t index;
+    CTransaction tx;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return GetSizeOfCompactSize(index) + ::GetSerializeSize(tx, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        WriteCompactSize(s, index);
+        ::Serialize(s, tx, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        uint64_t nIndex = ReadCompactSize(s);
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = nIndex;
+        ::Unserialize(s, tx, nType, nVersion);
+    }
+};
+
+typedef enum ReadStatus_t
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // Invalid object, peer is sending bogus crap
+    READ_STATUS_FAILED, // Failed to process object, e.g. a short id collision
+} ReadStatus;
+
+/**
+ * A block announced as its header plus 6-byte short ids of its transactions.
+ * The short ids are SipHash-2-4 of the txid keyed with SHA256(header || nonce),
+ * so they differ per block and per sender and can't be ground for collisions.
+ */
+class CBlockHeaderAndShortTxIDs {
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return ::GetSerializeSize(header, nType, nVersion) + sizeof(nonce) +
+               GetSizeOfCompactSize(shorttxids.size()) + shorttxids.size() * SHORTTXIDS_LENGTH +
+               ::GetSerializeSize(prefilledtxn, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            ::Serialize(s, lsb, nType, nVersion);
+            ::Serialize(s, msb, nType, nVersion);
+        }
+        ::Serialize(s, prefilledtxn, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        shorttxids.clear();
+        while (shorttxids.size() < nCount) {
+            shorttxids.reserve(std::min((uint64_t)shorttxids.size() + 1000, nCount));
+            for (size_t i = shorttxids.size(); i < shorttxids.capacity(); i++) {
+                uint32_t lsb;
+                uint16_t msb;
+                ::Unserialize(s, lsb, nType, nVersion);
+                ::Unserialize(s, msb, nType, nVersion);
+                shorttxids.push_back((uint64_t(msb) << 32) | uint64_t(lsb));
+            }
+        }
+        ::Unserialize(s, prefilledtxn, nType, nVersion);
+        FillShortTxIDSelector();
+    }
+};
+
+/** Reassembles a compact block from the mempool and, if needed, a blocktxn message */
+class PartiallyDownloadedBlock {
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    size_t prefilled_count, mempool_count;
+    CTxMemPool* pool;
+public:
+    CBlockHeader header;
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), pool(poolIn) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // BITCOIN_BLOCK_ENCODINGS_H
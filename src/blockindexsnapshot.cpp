@@ -0,0 +1,285 @@
+// Copyright (c) 2017-2018 The Growth Coin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexsnapshot.h"
+
+#include "chainparams.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "main.h"
+#include "pow.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace {
+
+const unsigned char SNAPSHOT_MAGIC[4] = {'g', 'b', 'i', 'x'};
+const size_t SNAPSHOT_HEADER_SIZE = 64;
+const size_t SNAPSHOT_ENTRY_SIZE = 108;
+//! parent position of entries without a parent
+const uint32_t SNAPSHOT_NO_PREV = 0xffffffff;
+//! entries are written out whenever this much is buffered
+const size_t SNAPSHOT_WRITE_CHUNK_SIZE = 1 << 20;
+
+void EncodeEntry(unsigned char* p, const CBlockIndex& index, uint32_t nPrev)
+{
+    memcpy(p, index.phashBlock->begin(), 32);
+    WriteLE32(p + 32, nPrev);
+    WriteLE32(p + 36, index.nHeight);
+    WriteLE32(p + 40, index.nFile);
+    WriteLE32(p + 44, index.nDataPos);
+    WriteLE32(p + 48, index.nUndoPos);
+    WriteLE32(p + 52, index.nVersion);
+    memcpy(p + 56, index.hashMerkleRoot.begin(), 32);
+    WriteLE32(p + 88, index.nTime);
+    WriteLE32(p + 92, index.nBits);
+    WriteLE32(p + 96, index.nNonce);
+    WriteLE32(p + 100, index.nStatus);
+    WriteLE32(p + 104, index.nTx);
+}
+
+/** Fill in the persisted fields of index, returns the position of its parent */
+uint32_t DecodeEntry(const unsigned char* p, uint256& hashBlock, CBlockIndex& index)
+{
+    memcpy(hashBlock.begin(), p, 32);
+    index.nHeight  = ReadLE32(p + 36);
+    index.nFile    = ReadLE32(p + 40);
+    index.nDataPos = ReadLE32(p + 44);
+    index.nUndoPos = ReadLE32(p + 48);
+    index.nVersion = ReadLE32(p + 52);
+    memcpy(index.hashMerkleRoot.begin(), p + 56, 32);
+    index.nTime    = ReadLE32(p + 88);
+    index.nBits    = ReadLE32(p + 92);
+    index.nNonce   = ReadLE32(p + 96);
+    index.nStatus  = ReadLE32(p + 100);
+    index.nTx      = ReadLE32(p + 104);
+    return ReadLE32(p + 32);
+}
+
+bool WriteChunk(FILE* file, CSHA256& hasher, std::vector<unsigned char>& vch)
+{
+    if (vch.empty())
+        return true;
+    hasher.Write(&vch[0], vch.size());
+    bool fOk = fwrite(&vch[0], 1, vch.size(), file) == vch.size();
+    vch.clear();
+    return fOk;
+}
+
+/** Read-only view of a whole file, memory mapped where the platform allows it */
+class CMappedFile
+{
+private:
+    const unsigned char* pdata;
+    size_t nSize;
+#ifdef WIN32
+    std::vector<unsigned char> vch;
+#endif
+
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    CMappedFile() : pdata(NULL), nSize(0) {}
+    ~CMappedFile() { Close(); }
+
+    bool Open(const boost::filesystem::path& path)
+    {
+        Close();
+#ifndef WIN32
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        // read once front to back
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        pdata = (const unsigned char*)p;
+        nSize = st.st_size;
+#else
+        boost::system::error_code ec;
+        uintmax_t nFileSize = boost::filesystem::file_size(path, ec);
+        if (ec || nFileSize == 0)
+            return false;
+        FILE* file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return false;
+        vch.resize(nFileSize);
+        bool fOk = fread(&vch[0], 1, vch.size(), file) == vch.size();
+        fclose(file);
+        if (!fOk) {
+            vch.clear();
+            return false;
+        }
+        pdata = &vch[0];
+        nSize = vch.size();
+#endif
+        return true;
+    }
+
+    void Close()
+    {
+#ifndef WIN32
+        if (pdata)
+            munmap((void*)pdata, nSize);
+#else
+        std::vector<unsigned char>().swap(vch);
+#endif
+        pdata = NULL;
+        nSize = 0;
+    }
+
+    const unsigned char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+} // anon namespace
+
+CBlockIndex* CBlockIndexArena::Allocate(size_t nCount)
+{
+    Clear();
+    vIndex.resize(nCount);
+    return vIndex.empty() ? NULL : &vIndex[0];
+}
+
+bool CBlockIndexArena::Contains(const CBlockIndex* pindex) const
+{
+    return !vIndex.empty() && pindex >= &vIndex.front() && pindex <= &vIndex.back();
+}
+
+void CBlockIndexArena::Clear()
+{
+    std::vector<CBlockIndex>().swap(vIndex);
+}
+
+bool WriteBlockIndexSnapshot(const boost::filesystem::path& path, const std::vector<CBlockIndex*>& vSortedByHeight, const uint256& hashBestChain, uint256& hashChecksumRet)
+{
+    boost::filesystem::path pathTmp = path.string() + ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s: failed to open %s", __func__, pathTmp.string());
+
+    std::vector<unsigned char> vch(SNAPSHOT_HEADER_SIZE, 0);
+    memcpy(&vch[0], SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    WriteLE32(&vch[4], BLOCK_INDEX_SNAPSHOT_VERSION);
+    WriteLE64(&vch[8], vSortedByHeight.size());
+    memcpy(&vch[16], hashBestChain.begin(), 32);
+
+    CSHA256 hasher;
+    boost::unordered_map<const CBlockIndex*, uint32_t> mapPos;
+    mapPos.rehash(vSortedByHeight.size());
+    bool fOk = true;
+    for (size_t i = 0; fOk && i < vSortedByHeight.size(); i++) {
+        const CBlockIndex* pindex = vSortedByHeight[i];
+        uint32_t nPrev = SNAPSHOT_NO_PREV;
+        if (pindex->pprev) {
+            boost::unordered_map<const CBlockIndex*, uint32_t>::const_iterator it = mapPos.find(pindex->pprev);
+            if (it == mapPos.end()) {
+                LogPrintf("%s: block %s comes before its parent\n", __func__, pindex->GetBlockHash().ToString());
+                fOk = false;
+                break;
+            }
+            nPrev = it->second;
+        }
+        mapPos[pindex] = i;
+
+        size_t nOffset = vch.size();
+        vch.resize(nOffset + SNAPSHOT_ENTRY_SIZE);
+        EncodeEntry(&vch[nOffset], *pindex, nPrev);
+        if (vch.size() >= SNAPSHOT_WRITE_CHUNK_SIZE)
+            fOk = WriteChunk(file, hasher, vch);
+    }
+    if (fOk)
+        fOk = WriteChunk(file, hasher, vch);
+    if (fOk) {
+        hasher.Finalize(hashChecksumRet.begin());
+        fOk = fwrite(hashChecksumRet.begin(), 1, 32, file) == 32;
+    }
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathTmp, ec);
+        return error("%s: failed to write %s", __func__, path.string());
+    }
+    return true;
+}
+
+bool ReadBlockIndexSnapshot(const boost::filesystem::path& path, const uint256& hashChecksum, const uint256& hashBestChain, std::vector<CBlockIndex*>& vSortedByHeight)
+{
+    CMappedFile file;
+    if (!file.Open(path))
+        return error("%s: failed to open %s", __func__, path.string());
+    const unsigned char* p = file.data();
+    const size_t nSize = file.size();
+
+    if (nSize < SNAPSHOT_HEADER_SIZE + 32 || memcmp(p, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)))
+        return error("%s: %s is not a block index snapshot", __func__, path.string());
+    if (ReadLE32(p + 4) != BLOCK_INDEX_SNAPSHOT_VERSION)
+        return error("%s: unsupported snapshot version %u", __func__, ReadLE32(p + 4));
+    uint64_t nCount = ReadLE64(p + 8);
+    if (nCount > (nSize - SNAPSHOT_HEADER_SIZE - 32) / SNAPSHOT_ENTRY_SIZE || SNAPSHOT_HEADER_SIZE + nCount * SNAPSHOT_ENTRY_SIZE + 32 != nSize)
+        return error("%s: size does not match %u entries", __func__, nCount);
+
+    uint256 hash;
+    memcpy(hash.begin(), p + 16, 32);
+    if (hash != hashBestChain)
+        return error("%s: snapshot taken at %s, coins database is at %s", __func__, hash.ToString(), hashBestChain.ToString());
+    memcpy(hash.begin(), p + nSize - 32, 32);
+    if (hash != hashChecksum)
+        return error("%s: snapshot %s does not belong to this block index database", __func__, hash.ToString());
+    CSHA256().Write(p, nSize - 32).Finalize(hash.begin());
+    if (hash != hashChecksum)
+        return error("%s: checksum mismatch", __func__);
+
+    CBlockIndex* parena = blockindexarena.Allocate(nCount);
+    mapBlockIndex.rehash(nCount);
+    vSortedByHeight.reserve(nCount);
+    const unsigned char* pentry = p + SNAPSHOT_HEADER_SIZE;
+    for (uint64_t i = 0; i < nCount; i++, pentry += SNAPSHOT_ENTRY_SIZE) {
+        boost::this_thread::interruption_point();
+        CBlockIndex& index = parena[i];
+        uint256 hashBlock;
+        uint32_t nPrev = DecodeEntry(pentry, hashBlock, index);
+        if (nPrev != SNAPSHOT_NO_PREV) {
+            if (nPrev >= i)
+                return error("%s: block %s comes before its parent", __func__, hashBlock.ToString());
+            index.pprev = &parena[nPrev];
+            if (index.nHeight != index.pprev->nHeight + 1)
+                return error("%s: block %s at wrong height %d", __func__, hashBlock.ToString(), index.nHeight);
+        }
+
+        std::pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(std::make_pair(hashBlock, &index));
+        if (!ret.second)
+            return error("%s: duplicate block %s", __func__, hashBlock.ToString());
+        index.phashBlock = &ret.first->first;
+
+        if (!CheckProofOfWork(hashBlock, index.nBits, Params().GetConsensus()))
+            return error("%s: CheckProofOfWork failed: %s", __func__, index.ToString());
+        vSortedByHeight.push_back(&index);
+    }
+    return true;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2017-2018 The Growth Coin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BLOCKINDEXSNAPSHOT_H
+#define BLOCKINDEXSNAPSHOT_H
+
+#include "chain.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+//! version of the block index snapshot layout, snapshots of other versions are ignored
+static const uint32_t BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+
+/**
+ * Block index entries loaded from a snapshot, allocated in one piece instead
+ * of one heap allocation each. Entries created later are still allocated with
+ * new, so whoever frees mapBlockIndex must ask Contains() first.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex> vIndex;
+
+public:
+    /** Replace the arena by nCount default constructed entries */
+    CBlockIndex* Allocate(size_t nCount);
+    bool Contains(const CBlockIndex* pindex) const;
+    void Clear();
+};
+
+extern CBlockIndexArena blockindexarena;
+
+/**
+ * Write the persisted fields of vSortedByHeight, which must list parents before
+ * their children, to a snapshot file. hashBestChain is the block the coins
+ * database is at; the snapshot is only loaded while it still is.
+ * Returns the checksum identifying the snapshot.
+ *
+ * Layout, little endian: a 64 byte header (magic, version, entry count,
+ * hashBestChain), fixed size entries referring to their parent by position,
+ * and the SHA256 of everything before it.
+ */
+bool WriteBlockIndexSnapshot(const boost::filesystem::path& path, const std::vector<CBlockIndex*>& vSortedByHeight, const uint256& hashBestChain, uint256& hashChecksumRet);
+
+/**
+ * Map a snapshot and fill the empty mapBlockIndex from it with entries from
+ * blockindexarena, in height order into vSortedByHeight. Fails without
+ * touching mapBlockIndex if the snapshot is not the one with hashChecksum or
+ * was taken at another hashBestChain; on later failures the caller has to
+ * unload what was inserted.
+ */
+bool ReadBlockIndexSnapshot(const boost::filesystem::path& path, const uint256& hashChecksum, const uint256& hashBestChain, std::vector<CBlockIndex*>& vSortedByHeight);
+
+#endif // BLOCKINDEXSNAPSHOT_H
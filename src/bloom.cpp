@@ -5,6 +5,7 @@
 #include "bloom.h"
 
 #include "primitives/transaction.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "script/script.h"
 #include "script/standard.h"
@@ -52,67 +53,97 @@ CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+inline void CBloomFilter::HashLanes(unsigned int nHashNum, const unsigned char* pKey, size_t nKeySize, unsigned int* pIndexesOut) const
 {
+    uint32_t vSeeds[MURMURHASH3_LANES];
+    uint32_t vHashes[MURMURHASH3_LANES];
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    for (int j = 0; j < MURMURHASH3_LANES; j++)
+        vSeeds[j] = (nHashNum + j) * 0xFBA4C795 + nTweak;
+    MurmurHash3Lanes(vSeeds, pKey, nKeySize, vHashes);
+    for (int j = 0; j < MURMURHASH3_LANES; j++)
+        pIndexesOut[j] = vHashes[j] % (vData.size() * 8);
 }
 
-void CBloomFilter::insert(const vector<unsigned char>& vKey)
+// The outpoint as serialized for the network: txid followed by the little endian index
+static inline void SerializeOutPoint(const COutPoint& outpoint, unsigned char* pOut)
+{
+    memcpy(pOut, outpoint.hash.begin(), 32);
+    WriteLE32(pOut + 32, outpoint.n);
+}
+
+void CBloomFilter::insert(const unsigned char* pKey, size_t nKeySize)
 {
     if (isFull)
         return;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    unsigned int vIndexes[MURMURHASH3_LANES];
+    for (unsigned int i = 0; i < nHashFuncs; i += MURMURHASH3_LANES)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Sets bit nIndex of vData
-        vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        HashLanes(i, pKey, nKeySize, vIndexes);
+        for (unsigned int j = 0; j < MURMURHASH3_LANES && i + j < nHashFuncs; j++)
+        {
+            // Sets bit nIndex of vData
+            unsigned int nIndex = vIndexes[j];
+            vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        }
     }
     isEmpty = false;
 }
 
+void CBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    insert(data);
+    unsigned char data[36];
+    SerializeOutPoint(outpoint, data);
+    insert(data, sizeof(data));
 }
 
 void CBloomFilter::insert(const uint256& hash)
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    insert(hash.begin(), hash.size());
 }
 
-bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const unsigned char* pKey, size_t nKeySize) const
 {
     if (isFull)
         return true;
     if (isEmpty)
         return false;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    // Most keys miss on one of the first probes, so only hash one group of lanes at a time
+    unsigned int vIndexes[MURMURHASH3_LANES];
+    for (unsigned int i = 0; i < nHashFuncs; i += MURMURHASH3_LANES)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Checks bit nIndex of vData
-        if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
-            return false;
+        HashLanes(i, pKey, nKeySize, vIndexes);
+        for (unsigned int j = 0; j < MURMURHASH3_LANES && i + j < nHashFuncs; j++)
+        {
+            // Checks bit nIndex of vData
+            unsigned int nIndex = vIndexes[j];
+            if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
+                return false;
+        }
     }
     return true;
 }
 
+bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    return contains(data);
+    unsigned char data[36];
+    SerializeOutPoint(outpoint, data);
+    return contains(data, sizeof(data));
 }
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.size());
 }
 
 void CBloomFilter::clear()
@@ -160,7 +191,7 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
             opcodetype opcode;
             if (!txout.scriptPubKey.GetOp(pc, opcode, data))
                 break;
-            if (data.size() != 0 && contains(data))
+            if (data.size() != 0 && contains(&data[0], data.size()))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
@@ -184,7 +215,9 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
         // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        unsigned char prevout[36];
+        SerializeOutPoint(txin.prevout, prevout);
+        if (contains(prevout, sizeof(prevout)))
             return true;
 
         // Match if the filter contains any arbitrary script data element in any scriptSig in tx
@@ -195,7 +228,7 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
             opcodetype opcode;
             if (!txin.scriptSig.GetOp(pc, opcode, data))
                 break;
-            if (data.size() != 0 && contains(data))
+            if (data.size() != 0 && contains(&data[0], data.size()))
                 return true;
         }
     }
@@ -229,38 +262,46 @@ CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
     reset();
 }
 
-void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+void CRollingBloomFilter::insert(const unsigned char* pKey, size_t nKeySize)
 {
     if (nInsertions == 0) {
         b1.clear();
     } else if (nInsertions == nBloomSize / 2) {
         b2.clear();
     }
-    b1.insert(vKey);
-    b2.insert(vKey);
+    b1.insert(pKey, nKeySize);
+    b2.insert(pKey, nKeySize);
     if (++nInsertions == nBloomSize) {
         nInsertions = 0;
     }
 }
 
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 void CRollingBloomFilter::insert(const uint256& hash)
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    insert(hash.begin(), hash.size());
 }
 
-bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+bool CRollingBloomFilter::contains(const unsigned char* pKey, size_t nKeySize) const
 {
     if (nInsertions < nBloomSize / 2) {
-        return b2.contains(vKey);
+        return b2.contains(pKey, nKeySize);
     }
-    return b1.contains(vKey);
+    return b1.contains(pKey, nKeySize);
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
 }
 
 bool CRollingBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.size());
 }
 
 void CRollingBloomFilter::reset()
@@ -51,7 +51,12 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    //! Hashes for nHashNum .. nHashNum + MURMURHASH3_LANES - 1, as bit positions in vData
+    void HashLanes(unsigned int nHashNum, const unsigned char* pKey, size_t nKeySize, unsigned int* pIndexesOut) const;
+
+    // Work on the raw key, so hashes and outpoints don't need a temporary vector
+    void insert(const unsigned char* pKey, size_t nKeySize);
+    bool contains(const unsigned char* pKey, size_t nKeySize) const;
 
     // Private constructor for CRollingBloomFilter, no restrictions on size
     CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
@@ -129,6 +134,9 @@ public:
     void reset();
 
 private:
+    void insert(const unsigned char* pKey, size_t nKeySize);
+    bool contains(const unsigned char* pKey, size_t nKeySize) const;
+
     unsigned int nBloomSize;
     unsigned int nInsertions;
     CBloomFilter b1, b2;
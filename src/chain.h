@@ -92,6 +92,13 @@ enum BlockStatus {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 };
 
+/** Lowest block version whose supermajority count is cached on CBlockIndex */
+static const int MAJORITY_COUNT_MIN_VERSION = 2;
+/** Number of consecutive block versions, from MAJORITY_COUNT_MIN_VERSION on, with a cached count */
+static const int MAJORITY_COUNT_VERSIONS = 3;
+/** Marks a cached supermajority count that hasn't been computed yet */
+static const uint16_t MAJORITY_COUNT_UNKNOWN = 0xffff;
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
@@ -146,6 +153,10 @@ public:
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
+    //! (memory only) Number of blocks with nVersion >= MAJORITY_COUNT_MIN_VERSION + i among the last
+    //! nMajorityWindow blocks up to and including this one, filled in lazily by CountSuperMajority.
+    mutable uint16_t nMajorityCount[MAJORITY_COUNT_VERSIONS];
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -160,6 +171,8 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nSequenceId = 0;
+        for (int i = 0; i < MAJORITY_COUNT_VERSIONS; i++)
+            nMajorityCount[i] = MAJORITY_COUNT_UNKNOWN;
 
         nVersion       = 0;
         hashMerkleRoot = uint256();
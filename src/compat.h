@@ -44,6 +44,9 @@
 #include <limits.h>
 #include <netdb.h>
 #include <unistd.h>
+#ifdef USE_POLL
+#include <poll.h>
+#endif
 #endif
 
 #ifdef WIN32
@@ -94,7 +97,7 @@ size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_POLL)
     return true;
 #else
     return (s < FD_SETSIZE);
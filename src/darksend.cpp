@@ -12,11 +12,13 @@
 #include "masternode-payments.h"
 #include "masternode-sync.h"
 #include "masternodeman.h"
+#include "scheduler.h"
 #include "script/sign.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilmoneystr.h"
 
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 
 int nPrivateSendRounds = DEFAULT_PRIVATESEND_ROUNDS;
@@ -625,6 +627,12 @@ void CDarksendPool::CommitFinalTransaction()
     {
         // See if the transaction is valid
         TRY_LOCK(cs_main, lockMain);
+        if(lockMain && !CheckFinalTransactionSignatures(finalTransaction)) {
+            LogPrintf("CDarksendPool::CommitFinalTransaction -- CheckFinalTransactionSignatures() error: Invalid signatures\n");
+            // invalid signatures were dropped, keep waiting for them until the session times out
+            RelayStatus(STATUS_REJECTED);
+            return;
+        }
         CValidationState validationState;
         mempool.PrioritiseTransaction(hashTx, hashTx.ToString(), 1000, 0.1*COIN);
         if(!lockMain || !AcceptToMemoryPool(mempool, validationState, finalTransaction, false, NULL, false, true, true))
@@ -845,47 +853,73 @@ void CDarksendPool::CheckForCompleteQueue()
     }
 }
 
-// Check to make sure a given input matches an input in the pool and its scriptSig is valid
-bool CDarksendPool::IsInputScriptSigValid(const CTxIn& txin)
+//
+// Verify every input signature of the final transaction in one batch on the
+// script checking threads. Signatures are only collected as they arrive, and
+// verified signatures go to the signature cache, so AcceptToMemoryPool in
+// CommitFinalTransaction doesn't have to verify them again.
+//
+bool CDarksendPool::CheckFinalTransactionSignatures(const CTransaction& txFinal)
 {
-    CMutableTransaction txNew;
-    txNew.vin.clear();
-    txNew.vout.clear();
-
-    int i = 0;
-    int nTxInIndex = -1;
-    CScript sigPubKey = CScript();
-
-    BOOST_FOREACH(CDarkSendEntry& entry, vecEntries) {
-
-        BOOST_FOREACH(const CTxDSOut& txdsout, entry.vecTxDSOut)
-            txNew.vout.push_back(txdsout);
+    AssertLockHeld(cs_main);
 
-        BOOST_FOREACH(const CTxDSIn& txdsin, entry.vecTxDSIn) {
-            txNew.vin.push_back(txdsin);
+    const unsigned int nFlags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+    int64_t nTimeStart = GetTimeMicros();
 
-            if(txdsin.prevout == txin.prevout) {
-                nTxInIndex = i;
-                sigPubKey = txdsin.prevPubKey;
+    // Take the scripts being spent from the UTXO set rather than from what clients told us
+    std::vector<CScript> vecScriptPubKey(txFinal.vin.size());
+    std::vector<bool> vecMissing(txFinal.vin.size(), false);
+    bool fMissing = false;
+    {
+        LOCK(mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        CCoinsViewCache view(&viewMemPool);
+        for(unsigned int i = 0; i < txFinal.vin.size(); i++) {
+            const COutPoint& prevout = txFinal.vin[i].prevout;
+            const Coin& coin = view.AccessCoin(prevout);
+            if(!coin.IsSpent()) {
+                vecScriptPubKey[i] = coin.out.scriptPubKey;
+            } else {
+                vecMissing[i] = true;
+                fMissing = true;
             }
-            i++;
         }
     }
 
-    if(nTxInIndex >= 0) { //might have to do this one input at a time?
-        txNew.vin[nTxInIndex].scriptSig = txin.scriptSig;
-        LogPrint("privatesend", "CDarksendPool::IsInputScriptSigValid -- verifying scriptSig %s\n", ScriptToAsmStr(txin.scriptSig).substr(0,24));
-        if(!VerifyScript(txNew.vin[nTxInIndex].scriptSig, sigPubKey, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, MutableTransactionSignatureChecker(&txNew, nTxInIndex))) {
-            LogPrint("privatesend", "CDarksendPool::IsInputScriptSigValid -- VerifyScript() failed on input %d\n", nTxInIndex);
-            return false;
+    if(!fMissing) {
+        std::vector<CScriptCheck> vChecks;
+        vChecks.reserve(txFinal.vin.size());
+        for(unsigned int i = 0; i < txFinal.vin.size(); i++)
+            vChecks.push_back(CScriptCheck(vecScriptPubKey[i], txFinal, i, nFlags, true));
+        if(RunScriptChecks(vChecks)) {
+            LogPrint("privatesend", "CDarksendPool::CheckFinalTransactionSignatures -- verified %u inputs in %.2fms\n", txFinal.vin.size(), (GetTimeMicros() - nTimeStart) * 0.001);
+            return true;
         }
-    } else {
-        LogPrint("privatesend", "CDarksendPool::IsInputScriptSigValid -- Failed to find matching input in pool, %s\n", txin.ToString());
-        return false;
     }
 
-    LogPrint("privatesend", "CDarksendPool::IsInputScriptSigValid -- Successfully validated input and scriptSig\n");
-    return true;
+    // Slow path: find the offending inputs so that only their owners get charged
+    // if they don't sign again before the session times out
+    for(unsigned int i = 0; i < txFinal.vin.size(); i++) {
+        if(!vecMissing[i]) {
+            CScriptCheck check(vecScriptPubKey[i], txFinal, i, nFlags, false);
+            if(check()) continue;
+            LogPrint("privatesend", "CDarksendPool::CheckFinalTransactionSignatures -- VerifyScript() failed on input %d: %s\n", i, ScriptErrorString(check.GetScriptError()));
+        } else {
+            LogPrint("privatesend", "CDarksendPool::CheckFinalTransactionSignatures -- Failed to find input %s\n", txFinal.vin[i].prevout.ToStringShort());
+        }
+
+        finalMutableTransaction.vin[i].scriptSig = CScript();
+        BOOST_FOREACH(CDarkSendEntry& entry, vecEntries) {
+            BOOST_FOREACH(CTxDSIn& txdsin, entry.vecTxDSIn) {
+                if(txdsin.prevout == txFinal.vin[i].prevout) {
+                    txdsin.scriptSig = CScript();
+                    txdsin.fHasSig = false;
+                }
+            }
+        }
+    }
+
+    return false;
 }
 
 // check to make sure the collateral provided by the client is valid
@@ -1006,10 +1040,8 @@ bool CDarksendPool::AddScriptSig(const CTxIn& txinNew)
         }
     }
 
-    if(!IsInputScriptSigValid(txinNew)) {
-        LogPrint("privatesend", "CDarksendPool::AddScriptSig -- Invalid scriptSig\n");
-        return false;
-    }
+    // The signature itself is verified in CheckFinalTransactionSignatures,
+    // together with all the others, once the session is fully signed
 
     LogPrint("privatesend", "CDarksendPool::AddScriptSig -- scriptSig=%s new\n", ScriptToAsmStr(txinNew.scriptSig).substr(0,24));
 
@@ -2494,20 +2526,6 @@ void ThreadCheckDarkSendPool()
             if(nTick % MASTERNODE_MIN_MNP_SECONDS == 15)
                 activeMasternode.ManageState();
 
-            if(nTick % 60 == 0) {
-                mnodeman.ProcessMasternodeConnections();
-                mnodeman.CheckAndRemove();
-                mnpayments.CheckAndRemove();
-                instantsend.CheckAndRemove();
-            }
-            if(fMasterNode && (nTick % (60 * 5) == 0)) {
-                mnodeman.DoFullVerificationStep();
-            }
-
-            if(nTick % (60 * 5) == 0) {
-                governance.DoMaintenance();
-            }
-
             darkSendPool.CheckTimeout();
             darkSendPool.CheckForCompleteQueue();
 
@@ -2518,3 +2536,68 @@ void ThreadCheckDarkSendPool()
         }
     }
 }
+
+static CCriticalSection cs_mapMaintenanceStats;
+static std::map<std::string, CMaintenanceTaskStats> mapMaintenanceStats;
+
+static void RunMaintenanceTask(const std::string& strName, const CScheduler::Function& task)
+{
+    if(!masternodeSync.IsBlockchainSynced() || ShutdownRequested()) {
+        LOCK(cs_mapMaintenanceStats);
+        mapMaintenanceStats[strName].nSkipped++;
+        return;
+    }
+
+    int64_t nTimeStart = GetTimeMicros();
+    task();
+    int64_t nTimeElapsed = GetTimeMicros() - nTimeStart;
+
+    {
+        LOCK(cs_mapMaintenanceStats);
+        CMaintenanceTaskStats& stats = mapMaintenanceStats[strName];
+        stats.nRuns++;
+        stats.nLastMicros = nTimeElapsed;
+        stats.nMaxMicros = std::max(stats.nMaxMicros, nTimeElapsed);
+        stats.nTotalMicros += nTimeElapsed;
+        stats.nLastRunTime = GetTime();
+    }
+
+    LogPrint("masternode", "RunMaintenanceTask -- %s: %.2fms\n", strName, nTimeElapsed * 0.001);
+}
+
+static void AddMaintenanceTask(CScheduler& scheduler, const std::string& strName, const CScheduler::Function& task, int64_t nInterval)
+{
+    {
+        LOCK(cs_mapMaintenanceStats);
+        CMaintenanceTaskStats& stats = mapMaintenanceStats[strName];
+        stats.strName = strName;
+        stats.nInterval = nInterval;
+    }
+    scheduler.scheduleEvery(boost::bind(&RunMaintenanceTask, strName, task), nInterval);
+}
+
+void ScheduleMasternodeMaintenance(CScheduler& scheduler)
+{
+    if(fLiteMode) return; // disable all Growth specific functionality
+
+    // Each cleanup pass is a task of its own so a slow one only delays itself
+    // and shows up separately in GetMaintenanceTaskStats.
+    AddMaintenanceTask(scheduler, "mnconnections", boost::bind(&CMasternodeMan::ProcessMasternodeConnections, &mnodeman), 60);
+    AddMaintenanceTask(scheduler, "mnodeman", boost::bind(&CMasternodeMan::CheckAndRemove, &mnodeman), 60);
+    AddMaintenanceTask(scheduler, "mnpayments", boost::bind(&CMasternodePayments::CheckAndRemove, &mnpayments), 60);
+    AddMaintenanceTask(scheduler, "instantsend", boost::bind(&CInstantSend::CheckAndRemove, &instantsend), 60);
+    AddMaintenanceTask(scheduler, "governance", boost::bind(&CGovernanceManager::DoMaintenance, &governance), 60 * 5);
+    if(fMasterNode) {
+        AddMaintenanceTask(scheduler, "mnverification", boost::bind(&CMasternodeMan::DoFullVerificationStep, &mnodeman), 60 * 5);
+    }
+}
+
+void GetMaintenanceTaskStats(std::vector<CMaintenanceTaskStats>& vStatsRet)
+{
+    LOCK(cs_mapMaintenanceStats);
+    vStatsRet.clear();
+    std::map<std::string, CMaintenanceTaskStats>::const_iterator it = mapMaintenanceStats.begin();
+    for(; it != mapMaintenanceStats.end(); ++it) {
+        vStatsRet.push_back(it->second);
+    }
+}
@@ -8,6 +8,8 @@
 #include "masternode.h"
 #include "wallet/wallet.h"
 
+class CScheduler;
+
 class CDarksendPool;
 class CDarkSendSigner;
 class CDarksendBroadcastTx;
@@ -371,8 +373,8 @@ private:
     bool IsCollateralValid(const CTransaction& txCollateral);
     /// Check that all inputs are signed. (Are all inputs signed?)
     bool IsSignaturesComplete();
-    /// Check to make sure a given input matches an input in the pool and its scriptSig is valid
-    bool IsInputScriptSigValid(const CTxIn& txin);
+    /// Verify the signatures of all inputs of the final transaction as one batch, dropping the invalid ones
+    bool CheckFinalTransactionSignatures(const CTransaction& txFinal);
     /// Are these outputs compatible with other client in the pool?
     bool IsOutputsCompatibleWithSessionDenom(const std::vector<CTxDSOut>& vecTxDSOut);
 
@@ -478,6 +480,24 @@ public:
     void UpdatedBlockTip(const CBlockIndex *pindex);
 };
 
+/** Runtime counters for one of the periodic masternode maintenance tasks */
+struct CMaintenanceTaskStats
+{
+    std::string strName;
+    int64_t nInterval;
+    int64_t nRuns;
+    int64_t nSkipped;
+    int64_t nLastMicros;
+    int64_t nMaxMicros;
+    int64_t nTotalMicros;
+    int64_t nLastRunTime;
+
+    CMaintenanceTaskStats() : nInterval(0), nRuns(0), nSkipped(0), nLastMicros(0), nMaxMicros(0), nTotalMicros(0), nLastRunTime(0) {}
+};
+
 void ThreadCheckDarkSendPool();
+/** Register masternode/payments/InstantSend/governance cleanup with the scheduler, each as its own task */
+void ScheduleMasternodeMaintenance(CScheduler& scheduler);
+void GetMaintenanceTaskStats(std::vector<CMaintenanceTaskStats>& vStatsRet);
 
 #endif
@@ -29,14 +29,21 @@ void HandleError(const leveldb::Status& status) throw(dbwrapper_error)
     throw dbwrapper_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+std::string CDBProfile::ToString() const
+{
+    return strprintf("compression=%d, blocksize=%u, maxopenfiles=%d, blockcache=%d%%",
+                     fCompression, nBlockSize, nMaxOpenFiles, nBlockCachePercent);
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBProfile& profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    options.block_cache = leveldb::NewLRUCache(nCacheSize / 100 * profile.nBlockCachePercent);
+    options.write_buffer_size = nCacheSize / 100 * (100 - profile.nBlockCachePercent) / 2; // up to two write buffers may be held in memory simultaneously
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.compression = profile.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.block_size = profile.nBlockSize;
+    options.max_open_files = profile.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -45,14 +52,15 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSizeIn, bool fMemory, bool fWipe, bool obfuscate, const CDBProfile& profileIn)
+    : strPath(path.string()), nCacheSize(nCacheSizeIn), profile(profileIn), nIterators(0)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -68,7 +76,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
-    LogPrintf("Opened LevelDB successfully\n");
+    LogPrintf("Opened LevelDB successfully (%s)\n", profile.ToString());
 
     // The base-case obfuscation key, which is a noop.
     obfuscate_key = std::vector<unsigned char>(OBFUSCATE_KEY_NUM_BYTES, '\000');
@@ -102,6 +110,42 @@ CDBWrapper::~CDBWrapper()
     options.env = NULL;
 }
 
+bool CDBWrapper::SetProfile(const CDBProfile& profileIn)
+{
+    boost::unique_lock<boost::mutex> lock(csIterators);
+    if (nIterators > 0)
+        return false;
+
+    delete pdb;
+    pdb = NULL;
+    delete options.filter_policy;
+    delete options.block_cache;
+    leveldb::Env* env = options.env;
+    options = GetOptions(nCacheSize, profileIn);
+    options.create_if_missing = true;
+    options.env = env;
+    leveldb::Status status = leveldb::DB::Open(options, strPath, &pdb);
+    if (!status.ok()) {
+        // try to leave the database usable with the tuning it had
+        delete options.filter_policy;
+        delete options.block_cache;
+        options = GetOptions(nCacheSize, profile);
+        options.create_if_missing = true;
+        options.env = env;
+        leveldb::DB::Open(options, strPath, &pdb);
+        HandleError(status);
+    }
+    profile = profileIn;
+    LogPrintf("Reopened LevelDB in %s (%s)\n", strPath, profile.ToString());
+    return true;
+}
+
+void CDBWrapper::IteratorDone()
+{
+    boost::unique_lock<boost::mutex> lock(csIterators);
+    nIterators--;
+}
+
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync) throw(dbwrapper_error)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
@@ -146,7 +190,12 @@ std::string CDBWrapper::GetObfuscateKeyHex() const
     return HexStr(obfuscate_key);
 }
 
-CDBIterator::~CDBIterator() { delete piter; }
+CDBIterator::~CDBIterator()
+{
+    delete piter;
+    if (pparent)
+        pparent->IteratorDone();
+}
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
 void CDBIterator::Next() { piter->Next(); }
@@ -13,6 +13,7 @@
 #include "version.h"
 
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
@@ -25,6 +26,26 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(dbwrapper_error);
 
+/** LevelDB tuning of one database */
+struct CDBProfile
+{
+    //! Snappy-compress table blocks (stored uncompressed anyway when LevelDB is built without Snappy)
+    bool fCompression;
+    //! approximate size of the (uncompressed) table blocks, larger ones compress better
+    size_t nBlockSize;
+    int nMaxOpenFiles;
+    //! percentage of the cache given to the block cache, the rest goes to the two write buffers LevelDB may hold
+    int nBlockCachePercent;
+
+    CDBProfile() : fCompression(false), nBlockSize(4096), nMaxOpenFiles(64), nBlockCachePercent(50) {}
+    CDBProfile(bool fCompressionIn, size_t nBlockSizeIn, int nMaxOpenFilesIn, int nBlockCachePercentIn) :
+        fCompression(fCompressionIn), nBlockSize(nBlockSizeIn), nMaxOpenFiles(nMaxOpenFilesIn), nBlockCachePercent(nBlockCachePercentIn) {}
+
+    std::string ToString() const;
+};
+
+class CDBWrapper;
+
 /** Batch of changes queued to be written to a CDBWrapper */
 class CDBBatch
 {
@@ -67,6 +88,11 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear()
+    {
+        batch.Clear();
+    }
 };
 
 class CDBIterator
@@ -74,15 +100,17 @@ class CDBIterator
 private:
     leveldb::Iterator *piter;
     const std::vector<unsigned char> *obfuscate_key;
+    CDBWrapper *pparent;
 
 public:
 
     /**
      * @param[in] piterIn          The original leveldb iterator.
      * @param[in] obfuscate_key    If passed, XOR data with this key.
+     * @param[in] pparentIn        If passed, the wrapper to tell when the iterator is gone.
      */
-    CDBIterator(leveldb::Iterator *piterIn, const std::vector<unsigned char>* obfuscate_key) :
-        piter(piterIn), obfuscate_key(obfuscate_key) { };
+    CDBIterator(leveldb::Iterator *piterIn, const std::vector<unsigned char>* obfuscate_key, CDBWrapper *pparentIn = NULL) :
+        piter(piterIn), obfuscate_key(obfuscate_key), pparent(pparentIn) { };
     ~CDBIterator();
 
     bool Valid();
@@ -134,10 +162,23 @@ public:
 
 class CDBWrapper
 {
+    friend class CDBIterator;
 private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
 
+    //! where the database lives and how it is tuned, for reopening it with another profile
+    std::string strPath;
+    size_t nCacheSize;
+    CDBProfile profile;
+
+    //! protects nIterators and opening the database
+    boost::mutex csIterators;
+    //! iterators handed out and not destroyed yet, they keep the database from being reopened
+    int nIterators;
+
+    void IteratorDone();
+
     //! database options used
     leveldb::Options options;
 
@@ -176,9 +217,18 @@ public:
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CDBProfile& profile = CDBProfile());
     ~CDBWrapper();
 
+    const CDBProfile& GetProfile() const { return profile; }
+
+    /**
+     * Close and reopen the database with different tuning. Fails while iterators
+     * are open; callers must keep other reads and writes out meanwhile. Throws
+     * dbwrapper_error if it can't be reopened, after trying the old tuning again.
+     */
+    bool SetProfile(const CDBProfile& profileIn);
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const throw(dbwrapper_error)
     {
@@ -256,7 +306,9 @@ public:
 
     CDBIterator *NewIterator()
     {
-        return new CDBIterator(pdb->NewIterator(iteroptions), &obfuscate_key);
+        boost::unique_lock<boost::mutex> lock(csIterators);
+        nIterators++;
+        return new CDBIterator(pdb->NewIterator(iteroptions), &obfuscate_key, this);
     }
 
     /**
@@ -264,6 +316,22 @@ public:
      */
     bool IsEmpty();
 
+    /**
+     * Compact the range of keys between begin and end, e.g. after erasing most of them.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(ssKey1.GetSerializeSize(key_begin));
+        ssKey2.reserve(ssKey2.GetSerializeSize(key_end));
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
+
     /**
      * Accessor for obfuscate_key.
      */
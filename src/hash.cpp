@@ -75,6 +75,57 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+void MurmurHash3Lanes(const uint32_t* pSeeds, const unsigned char* pData, size_t nSize, uint32_t* pHashesOut)
+{
+    // Same as MurmurHash3() above, with every step on h1 repeated for each lane
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    uint32_t h1[MURMURHASH3_LANES];
+    for (int j = 0; j < MURMURHASH3_LANES; j++)
+        h1[j] = pSeeds[j];
+
+    const size_t nblocks = nSize / 4;
+    for (size_t i = 0; i < nblocks; i++) {
+        uint32_t k1 = ReadLE32(pData + i*4);
+
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        for (int j = 0; j < MURMURHASH3_LANES; j++) {
+            h1[j] ^= k1;
+            h1[j] = (h1[j] << 13) | (h1[j] >> 19);
+            h1[j] = h1[j] * 5 + 0xe6546b64;
+        }
+    }
+
+    const uint8_t* tail = pData + nblocks * 4;
+    uint32_t k1 = 0;
+    switch (nSize & 3) {
+    case 3:
+        k1 ^= tail[2] << 16;
+    case 2:
+        k1 ^= tail[1] << 8;
+    case 1:
+        k1 ^= tail[0];
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+    };
+
+    for (int j = 0; j < MURMURHASH3_LANES; j++) {
+        uint32_t h = h1[j] ^ k1;
+        h ^= nSize;
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        pHashesOut[j] = h;
+    }
+}
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64])
 {
     unsigned char num[4];
@@ -320,6 +320,15 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+static const int MURMURHASH3_LANES = 4;
+
+/**
+ * MurmurHash3 of the same data under MURMURHASH3_LANES seeds at once. The mixing of the
+ * data blocks doesn't depend on the seed and is done once for all lanes, the per lane
+ * rounds are laid out so the compiler can run them in vector registers.
+ */
+void MurmurHash3Lanes(const uint32_t* pSeeds, const unsigned char* pData, size_t nSize, uint32_t* pHashesOut);
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 /** SipHash-2-4 */
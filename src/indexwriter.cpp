@@ -0,0 +1,258 @@
+// Copyright (c) 2017-2018 The Growth Coin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "indexwriter.h"
+
+#include "chain.h"
+#include "init.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/thread.hpp>
+
+CIndexWriter indexwriter;
+
+void ThreadIndexWriter()
+{
+    RenameThread("growth-indexer");
+    indexwriter.Thread();
+}
+
+/** Address type (1 = P2PKH, 2 = P2SH, 0 = not indexed) and hash of a script */
+static int GetAddressType(const CScript& script, uint160& hashBytes)
+{
+    if (script.IsPayToScriptHash()) {
+        hashBytes = uint160(std::vector<unsigned char>(script.begin()+2, script.begin()+22));
+        return 2;
+    }
+    if (script.IsPayToPublicKeyHash()) {
+        hashBytes = uint160(std::vector<unsigned char>(script.begin()+3, script.begin()+23));
+        return 1;
+    }
+    hashBytes.SetNull();
+    return 0;
+}
+
+void BuildIndexUpdate(const CBlock& block, const CBlockUndo& blockundo, int nHeight, unsigned int nTime, const uint256& hashBlock, bool fConnect, CIndexUpdate& update)
+{
+    update.fConnect = fConnect;
+
+    if (fConnect) {
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            const CTransaction& tx = block.vtx[i];
+            const uint256 txhash = tx.GetHash();
+
+            if (i > 0 && (fAddressIndex || fSpentIndex)) {
+                const CTxUndo& txundo = blockundo.vtxundo[i-1];
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const CTxIn& input = tx.vin[j];
+                    const CTxOut& prevout = txundo.vprevout[j].out;
+                    uint160 hashBytes;
+                    int addressType = GetAddressType(prevout.scriptPubKey, hashBytes);
+
+                    if (fAddressIndex && addressType > 0) {
+                        // record spending activity
+                        update.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, j, true), prevout.nValue * -1));
+
+                        // remove address from unspent index
+                        update.vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
+                    }
+
+                    if (fSpentIndex) {
+                        // add the spent index to determine the txid and input that spent an output
+                        // and to find the amount and address from an input
+                        update.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, nHeight, prevout.nValue, addressType, hashBytes)));
+                    }
+                }
+            }
+
+            if (fAddressIndex) {
+                for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                    const CTxOut& out = tx.vout[k];
+                    uint160 hashBytes;
+                    int addressType = GetAddressType(out.scriptPubKey, hashBytes);
+                    if (addressType == 0)
+                        continue;
+
+                    // record receiving activity
+                    update.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, k, false), out.nValue));
+
+                    // record unspent output
+                    update.vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight)));
+                }
+            }
+        }
+
+        if (fTimestampIndex)
+            update.vTimestampIndex.push_back(CTimestampIndexKey(nTime, hashBlock));
+        return;
+    }
+
+    // undo transactions in reverse order, outputs before the inputs they spent
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+
+        if (fAddressIndex) {
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                const CTxOut& out = tx.vout[k];
+                uint160 hashBytes;
+                int addressType = GetAddressType(out.scriptPubKey, hashBytes);
+                if (addressType == 0)
+                    continue;
+
+                // undo receiving activity
+                update.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, k, false), out.nValue));
+
+                // undo unspent index
+                update.vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue()));
+            }
+        }
+
+        if (i == 0)
+            continue;
+
+        const CTxUndo& txundo = blockundo.vtxundo[i-1];
+        for (unsigned int j = tx.vin.size(); j-- > 0;) {
+            const CTxIn& input = tx.vin[j];
+            const Coin& undo = txundo.vprevout[j];
+
+            if (fSpentIndex) {
+                // undo and delete the spent index
+                update.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue()));
+            }
+
+            if (fAddressIndex) {
+                uint160 hashBytes;
+                int addressType = GetAddressType(undo.out.scriptPubKey, hashBytes);
+                if (addressType == 0)
+                    continue;
+
+                // undo spending activity
+                update.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, j, true), undo.out.nValue * -1));
+
+                // restore unspent index
+                update.vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue(undo.out.nValue, undo.out.scriptPubKey, undo.nHeight)));
+            }
+        }
+    }
+}
+
+void CIndexWriter::Enqueue(const CBlockIndex* pindex, const CBlock& block, CBlockUndo& blockundo, bool fConnect)
+{
+    // build the job before taking the lock, copying the block is the expensive part
+    std::list<Job> jobs(1);
+    Job& job = jobs.front();
+    job.nHeight = pindex->nHeight;
+    job.nTime = pindex->nTime;
+    job.hashBlock = pindex->GetBlockHash();
+    job.hashPrevBlock = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256();
+    job.fConnect = fConnect;
+    job.block = block;
+    job.blockundo.vtxundo.swap(blockundo.vtxundo);
+
+    // callers hold cs_main, an interruption here would leave the chain half updated
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // nothing writes the job anymore, the next start replays it from disk
+    if (fFailed)
+        return;
+    // don't let validation run arbitrarily far ahead of the disk
+    while (fRunning && listPending.size() >= MAX_INDEX_QUEUE_BLOCKS)
+        condWritten.wait(lock);
+    job.nSeq = ++nSeqLast;
+    listPending.push_back(std::make_pair(job.nSeq, job.nHeight));
+    queue.splice(queue.end(), jobs);
+    condWork.notify_one();
+}
+
+bool CIndexWriter::Sync(int nHeight)
+{
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    uint64_t nSeqWait = 0;
+    for (std::list<std::pair<uint64_t, int> >::const_iterator it = listPending.begin(); it != listPending.end(); ++it)
+        if (nHeight < 0 || it->second <= nHeight)
+            nSeqWait = it->first;
+    while (fRunning && nSeqWritten < nSeqWait)
+        condWritten.wait(lock);
+    return !fFailed && nSeqWritten >= nSeqWait;
+}
+
+void CIndexWriter::SetRunning(bool fRunningIn)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = fRunningIn;
+    }
+    // wake up anyone waiting on a writer that is gone now
+    condWritten.notify_all();
+}
+
+bool CIndexWriter::WriteJobs(const std::list<Job>& jobs)
+{
+    if (jobs.empty())
+        return true;
+
+    int64_t nTimeStart = GetTimeMicros();
+    std::vector<CIndexUpdate> vUpdates(jobs.size());
+    std::vector<CIndexUpdate>::iterator itUpdate = vUpdates.begin();
+    for (std::list<Job>::const_iterator it = jobs.begin(); it != jobs.end(); ++it, ++itUpdate)
+        BuildIndexUpdate(it->block, it->blockundo, it->nHeight, it->nTime, it->hashBlock, it->fConnect, *itUpdate);
+
+    const Job& last = jobs.back();
+    if (!pblocktree->WriteIndexUpdates(vUpdates, last.fConnect ? last.hashBlock : last.hashPrevBlock)) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fFailed = true;
+            queue.clear();
+        }
+        strMiscWarning = "Failed to write address, spent or timestamp index";
+        LogPrintf("*** %s\n", strMiscWarning);
+        uiInterface.ThreadSafeMessageBox(_("Error: A fatal internal error occurred, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return false;
+    }
+    LogPrint("bench", "CIndexWriter::WriteJobs -- %u blocks up to height %d: %.2fms\n", (unsigned int)jobs.size(), last.nHeight, 0.001 * (GetTimeMicros() - nTimeStart));
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nSeqWritten = last.nSeq;
+        while (!listPending.empty() && listPending.front().first <= nSeqWritten)
+            listPending.pop_front();
+    }
+    condWritten.notify_all();
+    return true;
+}
+
+void CIndexWriter::Thread()
+{
+    SetRunning(true);
+    try {
+        while (true) {
+            std::list<Job> jobs;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty())
+                    condWork.wait(lock);
+                jobs.splice(jobs.end(), queue);
+            }
+            if (!WriteJobs(jobs))
+                break;
+        }
+    } catch (const boost::thread_interrupted&) {
+        // write out what is queued so the next start has nothing to replay
+        std::list<Job> jobs;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            jobs.splice(jobs.end(), queue);
+        }
+        WriteJobs(jobs);
+        SetRunning(false);
+        throw;
+    }
+    SetRunning(false);
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2017-2018 The Growth Coin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef INDEXWRITER_H
+#define INDEXWRITER_H
+
+#include "main.h"
+#include "primitives/block.h"
+#include "spentindex.h"
+#include "undo.h"
+
+#include <list>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlockIndex;
+
+//! most blocks waiting for the index writer before ConnectBlock/DisconnectBlock block on it
+static const unsigned int MAX_INDEX_QUEUE_BLOCKS = 512;
+
+/** The address, spent and timestamp index entries one block adds (fConnect) or removes */
+struct CIndexUpdate
+{
+    bool fConnect;
+    //! written when connecting, erased when disconnecting
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    //! null values are erased
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    //! null values are erased
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+    //! only written when connecting
+    std::vector<CTimestampIndexKey> vTimestampIndex;
+
+    CIndexUpdate() : fConnect(true) {}
+};
+
+/**
+ * Writes the address, spent and timestamp indexes from a background thread.
+ *
+ * ConnectBlock/DisconnectBlock hand over the block and its undo data; the
+ * writer derives the index entries and applies everything that piled up in
+ * one unsynced batch, together with the hash of the block the indexes now
+ * correspond to. Readers call Sync() first so they never see the indexes
+ * behind the chain they were asked about.
+ */
+class CIndexWriter
+{
+private:
+    struct Job
+    {
+        uint64_t nSeq;
+        int nHeight;
+        unsigned int nTime;
+        uint256 hashBlock;
+        uint256 hashPrevBlock;
+        bool fConnect;
+        CBlock block;
+        CBlockUndo blockundo;
+    };
+
+    boost::mutex mutex;
+    //! signalled when jobs are queued or the writer should stop
+    boost::condition_variable condWork;
+    //! signalled when jobs were written or the writer stopped
+    boost::condition_variable condWritten;
+
+    std::list<Job> queue;
+    //! (sequence, height) of every job not written yet, including the batch in progress
+    std::list<std::pair<uint64_t, int> > listPending;
+    uint64_t nSeqLast;
+    uint64_t nSeqWritten;
+    bool fRunning;
+    //! a write failed, the indexes stay behind the chain until the next start catches them up
+    bool fFailed;
+
+    bool WriteJobs(const std::list<Job>& jobs);
+    void SetRunning(bool fRunningIn);
+
+public:
+    CIndexWriter() : nSeqLast(0), nSeqWritten(0), fRunning(false), fFailed(false) {}
+
+    /** Queue the index changes of connecting (or disconnecting) pindex. Takes over blockundo's contents. */
+    void Enqueue(const CBlockIndex* pindex, const CBlock& block, CBlockUndo& blockundo, bool fConnect);
+    /**
+     * Wait until every queued block up to nHeight (all of them if negative) is written.
+     * Returns false if they never will be because the writer failed or isn't running.
+     */
+    bool Sync(int nHeight = -1);
+    /** Runs the writer until interrupted; whatever is still queued then is written before returning */
+    void Thread();
+};
+
+/** Derive the index entries of connecting (or disconnecting) a block from the block and its undo data */
+void BuildIndexUpdate(const CBlock& block, const CBlockUndo& blockundo, int nHeight, unsigned int nTime, const uint256& hashBlock, bool fConnect, CIndexUpdate& update);
+
+extern CIndexWriter indexwriter;
+
+void ThreadIndexWriter();
+
+#endif // INDEXWRITER_H
@@ -269,6 +269,7 @@ bool CInstantSend::ProcessTxLockVote(CNode* pfrom, CTxLockVote& vote)
     if(it == mapTxLockCandidates.end()) {
         if(!mapTxLockVotesOrphan.count(vote.GetHash())) {
             mapTxLockVotesOrphan[vote.GetHash()] = vote;
+            mapTxLockVotesOrphanExpiry.insert(std::make_pair(vote.GetTimeCreated(), vote.GetHash()));
             LogPrint("instantsend", "CInstantSend::ProcessTxLockVote -- Orphan vote: txid=%s  masternode=%s new\n",
                     txHash.ToString(), vote.GetMasternodeOutpoint().ToStringShort());
             bool fReprocess = true;
@@ -298,6 +299,7 @@ bool CInstantSend::ProcessTxLockVote(CNode* pfrom, CTxLockVote& vote)
         int nMasternodeOrphanExpireTime = GetTime() + 60*10; // keep time data for 10 minutes
         if(!mapMasternodeOrphanVotes.count(vote.GetMasternodeOutpoint())) {
             mapMasternodeOrphanVotes[vote.GetMasternodeOutpoint()] = nMasternodeOrphanExpireTime;
+            mapMasternodeOrphanVotesExpiry.insert(std::make_pair(nMasternodeOrphanExpireTime, vote.GetMasternodeOutpoint()));
         } else {
             int64_t nPrevOrphanVote = mapMasternodeOrphanVotes[vote.GetMasternodeOutpoint()];
             if(nPrevOrphanVote > GetTime() && nPrevOrphanVote > GetAverageMasternodeOrphanVoteTime()) {
@@ -308,6 +310,7 @@ bool CInstantSend::ProcessTxLockVote(CNode* pfrom, CTxLockVote& vote)
             }
             // not spamming, refresh
             mapMasternodeOrphanVotes[vote.GetMasternodeOutpoint()] = nMasternodeOrphanExpireTime;
+            mapMasternodeOrphanVotesExpiry.insert(std::make_pair(nMasternodeOrphanExpireTime, vote.GetMasternodeOutpoint()));
         }
 
         return true;
@@ -534,10 +537,8 @@ bool CInstantSend::ResolveConflicts(const CTxLockCandidate& txLockCandidate, int
     }
     // Not in block yet, make sure all its inputs are still unspent
     BOOST_FOREACH(const CTxIn& txin, txLockCandidate.txLockRequest.vin) {
-        CCoins coins;
-        if(!pcoinsTip->GetCoins(txin.prevout.hash, coins) ||
-           (unsigned int)txin.prevout.n>=coins.vout.size() ||
-           coins.vout[txin.prevout.n].IsNull()) {
+        Coin coin;
+        if(!pcoinsTip->GetCoin(txin.prevout, coin) || coin.IsSpent()) {
             // Not in UTXO anymore? A conflicting tx was mined while we were waiting for votes.
             // Reprocess tip to make sure tx for this lock is included.
             LogPrintf("CTxLockRequest::ResolveConflicts -- Failed to find UTXO %s - disconnecting tip...\n", txin.prevout.ToStringShort());
@@ -584,63 +585,63 @@ void CInstantSend::CheckAndRemove()
 
     LOCK(cs_instantsend);
 
-    std::map<uint256, CTxLockCandidate>::iterator itLockCandidate = mapTxLockCandidates.begin();
+    int nHeight = pCurrentBlockIndex->nHeight;
+    int64_t nNow = GetTime();
 
     // remove expired candidates
-    while(itLockCandidate != mapTxLockCandidates.end()) {
+    std::multimap<int, uint256>::iterator itCandidateExpiry = mapTxLockCandidatesExpiry.begin();
+    while(itCandidateExpiry != mapTxLockCandidatesExpiry.end() && itCandidateExpiry->first < nHeight) {
+        std::map<uint256, CTxLockCandidate>::iterator itLockCandidate = mapTxLockCandidates.find(itCandidateExpiry->second);
+        mapTxLockCandidatesExpiry.erase(itCandidateExpiry++);
+        // gone already, or unconfirmed/reconfirmed since and queued again
+        if(itLockCandidate == mapTxLockCandidates.end() || !itLockCandidate->second.IsExpired(nHeight)) continue;
         CTxLockCandidate &txLockCandidate = itLockCandidate->second;
         uint256 txHash = txLockCandidate.GetHash();
-        if(txLockCandidate.IsExpired(pCurrentBlockIndex->nHeight)) {
-            LogPrintf("CInstantSend::CheckAndRemove -- Removing expired Transaction Lock Candidate: txid=%s\n", txHash.ToString());
-            std::map<COutPoint, COutPointLock>::iterator itOutpointLock = txLockCandidate.mapOutPointLocks.begin();
-            while(itOutpointLock != txLockCandidate.mapOutPointLocks.end()) {
-                mapLockedOutpoints.erase(itOutpointLock->first);
-                mapVotedOutpoints.erase(itOutpointLock->first);
-                ++itOutpointLock;
-            }
-            mapLockRequestAccepted.erase(txHash);
-            mapLockRequestRejected.erase(txHash);
-            mapTxLockCandidates.erase(itLockCandidate++);
-        } else {
-            ++itLockCandidate;
+        LogPrintf("CInstantSend::CheckAndRemove -- Removing expired Transaction Lock Candidate: txid=%s\n", txHash.ToString());
+        std::map<COutPoint, COutPointLock>::iterator itOutpointLock = txLockCandidate.mapOutPointLocks.begin();
+        while(itOutpointLock != txLockCandidate.mapOutPointLocks.end()) {
+            mapLockedOutpoints.erase(itOutpointLock->first);
+            mapVotedOutpoints.erase(itOutpointLock->first);
+            ++itOutpointLock;
         }
+        mapLockRequestAccepted.erase(txHash);
+        mapLockRequestRejected.erase(txHash);
+        mapTxLockCandidates.erase(itLockCandidate);
     }
 
     // remove expired votes
-    std::map<uint256, CTxLockVote>::iterator itVote = mapTxLockVotes.begin();
-    while(itVote != mapTxLockVotes.end()) {
-        if(itVote->second.IsExpired(pCurrentBlockIndex->nHeight)) {
-            LogPrint("instantsend", "CInstantSend::CheckAndRemove -- Removing expired vote: txid=%s  masternode=%s\n",
-                    itVote->second.GetTxHash().ToString(), itVote->second.GetMasternodeOutpoint().ToStringShort());
-            mapTxLockVotes.erase(itVote++);
-        } else {
-            ++itVote;
-        }
+    std::multimap<int, uint256>::iterator itVoteExpiry = mapTxLockVotesExpiry.begin();
+    while(itVoteExpiry != mapTxLockVotesExpiry.end() && itVoteExpiry->first < nHeight) {
+        std::map<uint256, CTxLockVote>::iterator itVote = mapTxLockVotes.find(itVoteExpiry->second);
+        mapTxLockVotesExpiry.erase(itVoteExpiry++);
+        if(itVote == mapTxLockVotes.end() || !itVote->second.IsExpired(nHeight)) continue;
+        LogPrint("instantsend", "CInstantSend::CheckAndRemove -- Removing expired vote: txid=%s  masternode=%s\n",
+                itVote->second.GetTxHash().ToString(), itVote->second.GetMasternodeOutpoint().ToStringShort());
+        mapTxLockVotes.erase(itVote);
     }
 
     // remove expired orphan votes
-    std::map<uint256, CTxLockVote>::iterator itOrphanVote = mapTxLockVotesOrphan.begin();
-    while(itOrphanVote != mapTxLockVotesOrphan.end()) {
-        if(GetTime() - itOrphanVote->second.GetTimeCreated() > ORPHAN_VOTE_SECONDS) {
-            LogPrint("instantsend", "CInstantSend::CheckAndRemove -- Removing expired orphan vote: txid=%s  masternode=%s\n",
-                    itOrphanVote->second.GetTxHash().ToString(), itOrphanVote->second.GetMasternodeOutpoint().ToStringShort());
-            mapTxLockVotes.erase(itOrphanVote->first);
-            mapTxLockVotesOrphan.erase(itOrphanVote++);
-        } else {
-            ++itOrphanVote;
-        }
+    std::multimap<int64_t, uint256>::iterator itOrphanExpiry = mapTxLockVotesOrphanExpiry.begin();
+    while(itOrphanExpiry != mapTxLockVotesOrphanExpiry.end() && nNow - itOrphanExpiry->first > ORPHAN_VOTE_SECONDS) {
+        std::map<uint256, CTxLockVote>::iterator itOrphanVote = mapTxLockVotesOrphan.find(itOrphanExpiry->second);
+        mapTxLockVotesOrphanExpiry.erase(itOrphanExpiry++);
+        if(itOrphanVote == mapTxLockVotesOrphan.end() || nNow - itOrphanVote->second.GetTimeCreated() <= ORPHAN_VOTE_SECONDS) continue;
+        LogPrint("instantsend", "CInstantSend::CheckAndRemove -- Removing expired orphan vote: txid=%s  masternode=%s\n",
+                itOrphanVote->second.GetTxHash().ToString(), itOrphanVote->second.GetMasternodeOutpoint().ToStringShort());
+        mapTxLockVotes.erase(itOrphanVote->first);
+        mapTxLockVotesOrphan.erase(itOrphanVote);
     }
 
     // remove expired masternode orphan votes (DOS protection)
-    std::map<COutPoint, int64_t>::iterator itMasternodeOrphan = mapMasternodeOrphanVotes.begin();
-    while(itMasternodeOrphan != mapMasternodeOrphanVotes.end()) {
-        if(itMasternodeOrphan->second < GetTime()) {
-            LogPrint("instantsend", "CInstantSend::CheckAndRemove -- Removing expired orphan masternode vote: masternode=%s\n",
-                    itMasternodeOrphan->first.ToStringShort());
-            mapMasternodeOrphanVotes.erase(itMasternodeOrphan++);
-        } else {
-            ++itMasternodeOrphan;
-        }
+    std::multimap<int64_t, COutPoint>::iterator itMasternodeExpiry = mapMasternodeOrphanVotesExpiry.begin();
+    while(itMasternodeExpiry != mapMasternodeOrphanVotesExpiry.end() && itMasternodeExpiry->first < nNow) {
+        std::map<COutPoint, int64_t>::iterator itMasternodeOrphan = mapMasternodeOrphanVotes.find(itMasternodeExpiry->second);
+        mapMasternodeOrphanVotesExpiry.erase(itMasternodeExpiry++);
+        // refreshed votes were queued again with their new expiration time
+        if(itMasternodeOrphan == mapMasternodeOrphanVotes.end() || itMasternodeOrphan->second >= nNow) continue;
+        LogPrint("instantsend", "CInstantSend::CheckAndRemove -- Removing expired orphan masternode vote: masternode=%s\n",
+                itMasternodeOrphan->first.ToStringShort());
+        mapMasternodeOrphanVotes.erase(itMasternodeOrphan);
     }
 }
 
@@ -798,6 +799,8 @@ void CInstantSend::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
         LogPrint("instantsend", "CInstantSend::SyncTransaction -- txid=%s nHeightNew=%d lock candidate updated\n",
                 txHash.ToString(), nHeightNew);
         itLockCandidate->second.SetConfirmedHeight(nHeightNew);
+        if(nHeightNew != -1)
+            mapTxLockCandidatesExpiry.insert(std::make_pair(nHeightNew + Params().GetConsensus().nInstantSendKeepLock, txHash));
         // Loop through outpoint locks
         std::map<COutPoint, COutPointLock>::iterator itOutpointLock = itLockCandidate->second.mapOutPointLocks.begin();
         while(itOutpointLock != itLockCandidate->second.mapOutPointLocks.end()) {
@@ -812,6 +815,8 @@ void CInstantSend::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
                 it = mapTxLockVotes.find(nVoteHash);
                 if(it != mapTxLockVotes.end()) {
                     it->second.SetConfirmedHeight(nHeightNew);
+                    if(nHeightNew != -1)
+                        mapTxLockVotesExpiry.insert(std::make_pair(nHeightNew + Params().GetConsensus().nInstantSendKeepLock, nVoteHash));
                 }
                 ++itVote;
             }
@@ -826,6 +831,8 @@ void CInstantSend::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
             LogPrint("instantsend", "CInstantSend::SyncTransaction -- txid=%s nHeightNew=%d vote %s updated\n",
                     txHash.ToString(), nHeightNew, itOrphanVote->first.ToString());
             mapTxLockVotes[itOrphanVote->first].SetConfirmedHeight(nHeightNew);
+            if(nHeightNew != -1)
+                mapTxLockVotesExpiry.insert(std::make_pair(nHeightNew + Params().GetConsensus().nInstantSendKeepLock, itOrphanVote->first));
         }
         ++itOrphanVote;
     }
@@ -864,13 +871,11 @@ bool CTxLockRequest::IsValid(bool fRequireUnspent) const
 
     BOOST_FOREACH(const CTxIn& txin, vin) {
 
-        CCoins coins;
+        Coin coin;
         int nPrevoutHeight = 0;
         CAmount nValue = 0;
 
-        if(!pcoinsTip->GetCoins(txin.prevout.hash, coins) ||
-           (unsigned int)txin.prevout.n>=coins.vout.size() ||
-           coins.vout[txin.prevout.n].IsNull()) {
+        if(!pcoinsTip->GetCoin(txin.prevout, coin) || coin.IsSpent()) {
             LogPrint("instantsend", "CTxLockRequest::IsValid -- Failed to find UTXO %s\n", txin.prevout.ToStringShort());
             // Normally above sould be enough, but in case we are reprocessing this because of
             // a lot of legit orphan votes we should also check already spent outpoints.
@@ -896,8 +901,8 @@ bool CTxLockRequest::IsValid(bool fRequireUnspent) const
             nPrevoutHeight = mi->second->nHeight;
             nValue = txOutpointCreated.vout[txin.prevout.n].nValue;
         } else {
-            nPrevoutHeight = coins.nHeight;
-            nValue = coins.vout[txin.prevout.n].nValue;
+            nPrevoutHeight = coin.nHeight;
+            nValue = coin.out.nValue;
         }
 
         int nTxAge = chainActive.Height() - nPrevoutHeight + 1;
@@ -55,6 +55,13 @@ private:
     //track masternodes who voted with no txreq (for DOS protection)
     std::map<COutPoint, int64_t> mapMasternodeOrphanVotes; // mn outpoint - time
 
+    // expiry queues for CheckAndRemove, drained from the front up to the current height/time;
+    // an entry can be outdated, the maps above decide whether it is really expired
+    std::multimap<int, uint256> mapTxLockCandidatesExpiry; // last height to keep - tx hash
+    std::multimap<int, uint256> mapTxLockVotesExpiry; // last height to keep - vote hash
+    std::multimap<int64_t, uint256> mapTxLockVotesOrphanExpiry; // creation time - vote hash
+    std::multimap<int64_t, COutPoint> mapMasternodeOrphanVotesExpiry; // expiration time - mn outpoint
+
     bool CreateTxLockCandidate(const CTxLockRequest& txLockRequest);
     void Vote(CTxLockCandidate& txLockCandidate);
 
@@ -11,6 +11,8 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
+#include "blockindexsnapshot.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -18,6 +20,7 @@
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "hash.h"
+#include "indexwriter.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "net.h"
@@ -47,6 +50,7 @@
 #include "masternode-sync.h"
 #include "masternodeman.h"
 
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -54,6 +58,7 @@
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/math/distributions/poisson.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -69,6 +74,8 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+//! defined here so it outlives instance_of_cmaincleanup, which frees mapBlockIndex
+CBlockIndexArena blockindexarena;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
@@ -212,6 +219,7 @@ namespace {
         uint256 hash;
         CBlockIndex* pindex;     //!< Optional.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -226,6 +234,9 @@ namespace {
 
     /** Number of peers from which we're downloading blocks. */
     int nPeersWithValidatedDownloads = 0;
+
+    /** Masternode peers asked to announce new blocks with cmpctblock, oldest first. Protected by cs_main. */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -281,6 +292,10 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
     bool fPreferHeaders;
+    //! Whether this peer wants invs or cmpctblocks (when possible) for block announcements.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer will send us cmpctblocks if we request them.
+    bool fProvidesHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -297,6 +312,8 @@ struct CNodeState {
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
     }
 };
 
@@ -349,6 +366,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     }
     EraseOrphansFor(nodeid);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -388,14 +406,25 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false if the block was already in flight from the same peer.
+// pit will only be valid as long as the same cs_main lock is being held.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it's from the same node
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, pindex != NULL,
+                            boost::shared_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)};
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
@@ -406,7 +435,10 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     if (state->nBlocksInFlightValidHeaders == 1 && pindex != NULL) {
         nPeersWithValidatedDownloads++;
     }
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
 }
 
 /** Check whether the last unknown block a peer advertised is not yet known. */
@@ -458,6 +490,37 @@ bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
     return false;
 }
 
+// Requires cs_main
+// Ask a masternode peer that was first to give us a new block to announce the
+// next ones with cmpctblock right away, saving the inv/getdata round trip.
+// Masternodes stay connected and well connected, and slow blocks hurt their
+// payment voting the most. At most MAX_CMPCTBLOCK_HB_PEERS are asked, the
+// oldest one is told to stop when another one takes its place.
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom)
+{
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    if (std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId()) != lNodesAnnouncingHeaderAndIDs.end())
+        return;
+    if (!pfrom->fMasternode && !mnodeman.Has((CNetAddr)pfrom->addr))
+        return;
+
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage(NetMsgType::SENDCMPCT, false, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    LogPrint("net", "asking masternode peer=%d to announce blocks with cmpctblock\n", pfrom->id);
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, true, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -612,6 +675,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -874,15 +938,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -948,13 +1012,11 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
 int GetUTXOHeight(const COutPoint& outpoint)
 {
     LOCK(cs_main);
-    CCoins coins;
-    if(!pcoinsTip->GetCoins(outpoint.hash, coins) ||
-       (unsigned int)outpoint.n>=coins.vout.size() ||
-       coins.vout[outpoint.n].IsNull()) {
+    Coin coin;
+    if(!pcoinsTip->GetCoin(outpoint, coin)) {
         return -1;
     }
-    return coins.nHeight;
+    return coin.nHeight;
 }
 
 int GetInputAge(const CTxIn &txin)
@@ -966,11 +1028,11 @@ int GetInputAge(const CTxIn &txin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+        const Coin& coin = view.AccessCoin(txin.prevout);
 
-        if (coins) {
-            if(coins->nHeight < 0) return 0;
-            return chainActive.Height() - coins->nHeight + 1;
+        if (!coin.IsSpent()) {
+            if((int)coin.nHeight < 0) return 0;
+            return chainActive.Height() - (int)coin.nHeight + 1;
         } else {
             return -1;
         }
@@ -1050,9 +1112,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -1067,7 +1129,7 @@ std::string FormatStateMessage(const CValidationState &state)
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                               bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache, bool fDryRun)
+                              std::vector<COutPoint>& vCoinsToUncache, bool fDryRun)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1187,20 +1249,29 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            COutPoint outpoint(hash, out);
+            bool fHadCoinInCache = pcoinsTip->HaveCoinInCache(outpoint);
+            if (view.HaveCoin(outpoint)) {
+                if (!fHadCoinInCache)
+                    vCoinsToUncache.push_back(outpoint);
+                return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+            }
         }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                vCoinsToUncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out))) {
+                        return state.Invalid(false, REJECT_DUPLICATE, "txn-already-known");
+                    }
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
@@ -1249,8 +1320,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin& coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1532,12 +1603,12 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool fDryRun)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vHashTxToUncache, fDryRun);
+    std::vector<COutPoint> vCoinsToUncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vCoinsToUncache, fDryRun);
     if (!res || fDryRun) {
         if(!res) LogPrint("mempool", "%s: %s %s\n", __func__, tx.GetHash().ToString(), state.GetRejectReason());
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
-            pcoinsTip->Uncache(hashTx);
+        BOOST_FOREACH(const COutPoint& outpoint, vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
     }
     return res;
 }
@@ -1547,6 +1618,8 @@ bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, std::v
     if (!fTimestampIndex)
         return error("Timestamp index not enabled");
 
+    if (!indexwriter.Sync())
+        return error("timestamp index is behind, the index writer stopped");
     if (!pblocktree->ReadTimestampIndex(high, low, hashes))
         return error("Unable to get hashes for timestamps");
 
@@ -1561,6 +1634,8 @@ bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     if (mempool.getSpentIndex(key, value))
         return true;
 
+    if (!indexwriter.Sync())
+        return error("spent index is behind, the index writer stopped");
     if (!pblocktree->ReadSpentIndex(key, value))
         return false;
 
@@ -1573,6 +1648,9 @@ bool GetAddressIndex(uint160 addressHash, int type,
     if (!fAddressIndex)
         return error("address index not enabled");
 
+    // blocks above the requested range can't change the answer
+    if (!indexwriter.Sync(end > 0 ? end : -1))
+        return error("address index is behind, the index writer stopped");
     if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
         return error("unable to get txids for address");
 
@@ -1585,12 +1663,55 @@ bool GetAddressUnspent(uint160 addressHash, int type,
     if (!fAddressIndex)
         return error("address index not enabled");
 
+    if (!indexwriter.Sync())
+        return error("address index is behind, the index writer stopped");
     if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
         return error("unable to get txids for address");
 
     return true;
 }
 
+bool GetAddressIndexPage(uint160 addressHash, int type, const CAddressIndexKey &keyStart, int end, size_t nLimit, bool fWholeTransactions,
+                         std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, CAddressIndexKey &keyNext, bool &fMore)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!indexwriter.Sync(end > 0 ? end : -1))
+        return error("address index is behind, the index writer stopped");
+    if (!pblocktree->ReadAddressIndexPage(addressHash, type, keyStart, end, nLimit, fWholeTransactions, addressIndex, keyNext, fMore))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool GetAddressUnspentPage(uint160 addressHash, int type, const CAddressUnspentKey &keyStart, size_t nLimit,
+                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs, CAddressUnspentKey &keyNext, bool &fMore)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!indexwriter.Sync())
+        return error("address index is behind, the index writer stopped");
+    if (!pblocktree->ReadAddressUnspentIndexPage(addressHash, type, keyStart, nLimit, unspentOutputs, keyNext, fMore))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool GetAddressBalance(uint160 addressHash, int type, CAddressBalance &balance)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!indexwriter.Sync())
+        return error("address index is behind, the index writer stopped");
+    if (!pblocktree->ReadAddressBalance(addressHash, type, balance))
+        return error("unable to get balance for address");
+
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1627,10 +1748,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1717,6 +1837,38 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    vchBlock.clear();
+
+    // WriteBlockToDisk puts the message start and the block size right in front of the block
+    CDiskBlockPos posHeader = pos;
+    if (posHeader.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s: no block header at %s", __func__, pos.ToString());
+    posHeader.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blockStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blockStart) >> nSize;
+        if (memcmp(blockStart, messageStart, MESSAGE_START_SIZE) != 0)
+            return error("%s: block start mismatch at %s", __func__, pos.ToString());
+        if (nSize < 80 || nSize > MAX_SIZE)
+            return error("%s: invalid block size %u at %s", __func__, nSize, pos.ToString());
+        vchBlock.resize(nSize);
+        filein.read(&vchBlock[0], nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -2070,32 +2222,14 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool fSpent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(fSpent);
         }
-        // add outputs
-        inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
-    }
-    else {
-        // add outputs for coinbase tx
-        // In this case call the full ModifyCoins which will do a database
-        // lookup to be sure the coins do not already exist otherwise we do not
-        // know whether to mark them fresh or not.  We want the duplicate coinbases
-        // before BIP30 to still be properly overwritten.
-        inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
     }
+    // add outputs
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight)
@@ -2132,20 +2266,20 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase()) {
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - (int)coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(false,
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - (int)coin.nHeight));
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -2185,11 +2319,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out.scriptPubKey, tx, i, flags, cacheStore);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2201,7 +2335,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out.scriptPubKey, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2299,34 +2433,31 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+bool ApplyTxInUndo(Coin undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
+    if (view.HaveCoin(out))
+        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
             fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
+        }
     }
-    if (coins->IsAvailable(out.n))
-        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    view.AddCoin(out, undo, !fClean);
 
     return fClean;
 }
@@ -2350,114 +2481,40 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
-    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
-
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
         uint256 hash = tx.GetHash();
 
-        if (fAddressIndex) {
-
-            for (unsigned int k = tx.vout.size(); k-- > 0;) {
-                const CTxOut &out = tx.vout[k];
-
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, k, false), out.nValue));
-
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), hash, k), CAddressUnspentValue()));
-
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, k, false), out.nValue));
-
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), hash, k), CAddressUnspentValue()));
-
-                } else {
-                    continue;
-                }
-
-            }
-
-        }
-
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        bool fCoinBase = tx.IsCoinBase();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool fSpent = view.SpendCoin(out, &coin);
+                if (!fSpent || tx.vout[o] != coin.out || (uint32_t)pindex->nHeight != coin.nHeight || fCoinBase != coin.IsCoinBase())
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(txundo.vprevout[j], view, out))
                     fClean = false;
-
-                const CTxIn input = tx.vin[j];
-
-                if (fSpentIndex) {
-                    // undo and delete the spent index
-                    spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue()));
-                }
-
-                if (fAddressIndex) {
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
-
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
-
-                        // restore unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
-
-
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
-
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
-
-                        // restore unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
-
-                    } else {
-                        continue;
-                    }
-                }
-
+                // the index writer only sees the undo data, give it the height ApplyTxInUndo may have filled in
+                if (fAddressIndex && txundo.vprevout[j].nHeight == 0)
+                    txundo.vprevout[j].nHeight = view.AccessCoin(out).nHeight;
             }
         }
     }
 
-
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -2466,14 +2523,8 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
         return true;
     }
 
-    if (fAddressIndex) {
-        if (!pblocktree->EraseAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to delete address index");
-        }
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
-    }
+    if (fAddressIndex || fSpentIndex || fTimestampIndex)
+        indexwriter.Enqueue(pindex, block, blockUndo, false);
 
     return fClean;
 }
@@ -2510,6 +2561,102 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+bool RunScriptChecks(std::vector<CScriptCheck>& vChecks)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads) {
+        BOOST_FOREACH(CScriptCheck& check, vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+/** Reads one coin from the view below pcoinsTip on behalf of PrefetchBlockInputs */
+class CCoinPrefetch
+{
+private:
+    const CCoinsView *pbase;
+    COutPoint outpoint;
+    Coin *pcoin;
+
+public:
+    CCoinPrefetch(): pbase(NULL), pcoin(NULL) {}
+    CCoinPrefetch(const CCoinsView *pbaseIn, const COutPoint &outpointIn, Coin *pcoinIn) :
+        pbase(pbaseIn), outpoint(outpointIn), pcoin(pcoinIn) {}
+
+    bool operator()() {
+        // a missing coin simply stays spent, ConnectBlock reports it
+        pbase->GetCoin(outpoint, *pcoin);
+        return true;
+    }
+
+    void swap(CCoinPrefetch &check) {
+        std::swap(pbase, check.pbase);
+        std::swap(outpoint, check.outpoint);
+        std::swap(pcoin, check.pcoin);
+    }
+};
+
+static CCheckQueue<CCoinPrefetch> coinprefetchqueue(16);
+
+void ThreadCoinPrefetch() {
+    RenameThread("growth-coinpf");
+    coinprefetchqueue.Thread();
+}
+
+/**
+ * Load the coins a block spends into pcoinsTip before ConnectBlock needs them.
+ * The ones that aren't cached yet are read from the database by the prefetch
+ * threads in parallel instead of one at a time on the validation thread.
+ */
+static void PrefetchBlockInputs(const CBlock& block, unsigned int& nHitsRet, unsigned int& nMissesRet)
+{
+    AssertLockHeld(cs_main);
+    nHitsRet = 0;
+    nMissesRet = 0;
+
+    // outputs created in this block can't be in the database yet
+    std::set<uint256> setBlockTxids;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        setBlockTxids.insert(tx.GetHash());
+
+    std::vector<COutPoint> vMissing;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (setBlockTxids.count(txin.prevout.hash))
+                continue;
+            if (pcoinsTip->HaveCoinInCache(txin.prevout))
+                nHitsRet++;
+            else
+                vMissing.push_back(txin.prevout);
+        }
+    }
+    nMissesRet = vMissing.size();
+    // without worker threads ConnectBlock reads them just as fast by itself
+    if (vMissing.empty() || !nScriptCheckThreads)
+        return;
+
+    std::vector<Coin> vCoins(vMissing.size());
+    std::vector<CCoinPrefetch> vFetches;
+    vFetches.reserve(vMissing.size());
+    for (size_t i = 0; i < vMissing.size(); i++)
+        vFetches.push_back(CCoinPrefetch(pcoinsTip->GetBase(), vMissing[i], &vCoins[i]));
+    {
+        // the workers only read the base view, the cache is filled in here afterwards
+        CCheckQueueControl<CCoinPrefetch> control(&coinprefetchqueue);
+        control.Add(vFetches);
+        control.Wait();
+    }
+    for (size_t i = 0; i < vMissing.size(); i++)
+        pcoinsTip->CacheBaseCoin(vMissing[i], vCoins[i]);
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2723,10 +2870,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+                }
+            }
         }
     }
 
@@ -2770,14 +2919,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
-    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
-        const uint256 txhash = tx.GetHash();
 
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -2796,7 +2941,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, *pindex)) {
@@ -2804,43 +2949,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                  REJECT_INVALID, "bad-txns-nonfinal");
             }
 
-            if (fAddressIndex || fSpentIndex)
-            {
-                for (size_t j = 0; j < tx.vin.size(); j++) {
-
-                    const CTxIn input = tx.vin[j];
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    uint160 hashBytes;
-                    int addressType;
-
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-                        addressType = 2;
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-                        addressType = 1;
-                    } else {
-                        hashBytes.SetNull();
-                        addressType = 0;
-                    }
-
-                    if (fAddressIndex && addressType > 0) {
-                        // record spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
-
-                        // remove address from unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
-                    }
-
-                    if (fSpentIndex) {
-                        // add the spent index to determine the txid and input that spent an output
-                        // and to find the amount and address from an input
-                        spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
-                    }
-                }
-
-            }
-
             if (fStrictPayToScriptHash)
             {
                 // Add in sigops done by pay-to-script-hash inputs;
@@ -2862,35 +2970,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             control.Add(vChecks);
         }
 
-        if (fAddressIndex) {
-            for (unsigned int k = 0; k < tx.vout.size(); k++) {
-                const CTxOut &out = tx.vout[k];
-
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else {
-                    continue;
-                }
-
-            }
-        }
-
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
@@ -2955,23 +3034,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
-    if (fAddressIndex) {
-        if (!pblocktree->WriteAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to write address index");
-        }
-
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
-    }
-
-    if (fSpentIndex)
-        if (!pblocktree->UpdateSpentIndex(spentIndex))
-            return AbortNode(state, "Failed to write transaction index");
-
-    if (fTimestampIndex)
-        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash())))
-            return AbortNode(state, "Failed to write timestamp index");
+    // the address, spent and timestamp indexes are derived from the block and its undo data in the background.
+    // Blocks already in the active chain are indexed; only VerifyDB reconnects them, on a scratch view,
+    // and the balance totals must not count them twice.
+    if ((fAddressIndex || fSpentIndex || fTimestampIndex) && !chainActive.Contains(pindex))
+        indexwriter.Enqueue(pindex, block, blockundo, true);
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -3077,17 +3144,35 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetDirtyCacheSize()))
             return state.Error("out of disk space");
-        // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Write the chainstate (which may refer to block index entries), but
+        // keep the cache warm so that the next blocks don't start cold.
+        int64_t nSyncStart = GetTimeMicros();
+        if (!pcoinsTip->Sync())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
+        // Only make room when we are short on memory, and then only drop the
+        // least recently used entries.
+        if (fCacheLarge || fCacheCritical) {
+            pcoinsTip->Evict(nCoinCacheUsage / 100 * COINS_CACHE_EVICT_PERCENT);
+        }
+        LogPrint("bench", "    - Coins cache sync: %.2fms, %u entries (%.1fMiB) kept\n", 0.001 * (GetTimeMicros() - nSyncStart),
+                 pcoinsTip->GetCacheSize(), pcoinsTip->DynamicMemoryUsage() * (1.0 / 1024 / 1024));
+    }
+    // Reopen the chainstate with the regular profile once initial block download
+    // is over; if it is being iterated, try next time. Not worth it on the way out.
+    if (pcoinsdbview && pcoinsdbview->IsInitialDownloadProfile() && !ShutdownRequested() && !IsInitialBlockDownload()) {
+        try {
+            pcoinsdbview->SetInitialDownloadProfile(false);
+        } catch (const dbwrapper_error& e) {
+            return AbortNode(state, std::string("Failed to reopen coin database: ") + e.what());
+        }
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
         // Update best block in wallet (so we can detect restored wallets).
@@ -3219,6 +3304,7 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -3240,9 +3326,13 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         pblock = &block;
     }
     // Apply the block atomically to the chain state.
-    int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
+    int64_t nTimeLoaded = GetTimeMicros(); nTimeReadFromDisk += nTimeLoaded - nTime1;
     int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTimeLoaded - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    unsigned int nPrefetchHits, nPrefetchMisses;
+    PrefetchBlockInputs(*pblock, nPrefetchHits, nPrefetchMisses);
+    int64_t nTime2 = GetTimeMicros(); nTimePrefetch += nTime2 - nTimeLoaded;
+    LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs] (%u hits, %u misses)\n", (nTime2 - nTimeLoaded) * 0.001, nTimePrefetch * 0.000001, nPrefetchHits, nPrefetchMisses);
     {
         CCoinsViewCache view(pcoinsTip);
         bool rv = ConnectBlock(*pblock, state, pindexNew, view);
@@ -4151,16 +4241,53 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     return true;
 }
 
-static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams)
+unsigned int CountSuperMajority(int minVersion, const CBlockIndex* pstart, const Consensus::Params& consensusParams)
 {
-    unsigned int nFound = 0;
-    for (int i = 0; i < consensusParams.nMajorityWindow && nFound < nRequired && pstart != NULL; i++)
-    {
-        if (pstart->nVersion >= minVersion)
-            ++nFound;
-        pstart = pstart->pprev;
+    AssertLockHeld(cs_main);
+    int nWindow = consensusParams.nMajorityWindow;
+    if (minVersion < MAJORITY_COUNT_MIN_VERSION || minVersion >= MAJORITY_COUNT_MIN_VERSION + MAJORITY_COUNT_VERSIONS ||
+        nWindow >= MAJORITY_COUNT_UNKNOWN) {
+        unsigned int nFound = 0;
+        for (int i = 0; i < nWindow && pstart != NULL; i++)
+        {
+            if (pstart->nVersion >= minVersion)
+                ++nFound;
+            pstart = pstart->pprev;
+        }
+        return nFound;
+    }
+    if (pstart == NULL)
+        return 0;
+
+    // The counts are a rolling sum over the window: a block's count is its parent's,
+    // plus itself, minus the block that just dropped out of the window. Walk back to
+    // the last block that has them and roll forward from there.
+    std::vector<const CBlockIndex*> vToCompute;
+    const CBlockIndex* pindex = pstart;
+    while (pindex != NULL && pindex->nMajorityCount[0] == MAJORITY_COUNT_UNKNOWN) {
+        vToCompute.push_back(pindex);
+        pindex = pindex->pprev;
+    }
+    while (!vToCompute.empty()) {
+        pindex = vToCompute.back();
+        vToCompute.pop_back();
+        const CBlockIndex* pindexOut = pindex->nHeight >= nWindow ? pindex->GetAncestor(pindex->nHeight - nWindow) : NULL;
+        for (int i = 0; i < MAJORITY_COUNT_VERSIONS; i++) {
+            int nVersion = MAJORITY_COUNT_MIN_VERSION + i;
+            unsigned int nCount = pindex->pprev ? pindex->pprev->nMajorityCount[i] : 0;
+            if (pindex->nVersion >= nVersion)
+                nCount++;
+            if (pindexOut != NULL && pindexOut->nVersion >= nVersion)
+                nCount--;
+            pindex->nMajorityCount[i] = nCount;
+        }
     }
-    return (nFound >= nRequired);
+    return pstart->nMajorityCount[minVersion - MAJORITY_COUNT_MIN_VERSION];
+}
+
+static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams)
+{
+    return CountSuperMajority(minVersion, pstart, consensusParams) >= nRequired;
 }
 
 
@@ -4395,26 +4522,92 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+static boost::filesystem::path GetBlockIndexSnapshotPath()
 {
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts())
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
+
+/** Fill mapBlockIndex from the snapshot written on the last clean shutdown, if it still matches the databases */
+static bool LoadBlockIndexSnapshot(std::vector<CBlockIndex*>& vSortedByHeight)
+{
+    uint256 hashChecksum;
+    if (!pblocktree->ReadIndexSnapshot(hashChecksum))
         return false;
+    // the block index database moves on from here, so a snapshot is good for one start at most
+    if (!pblocktree->EraseIndexSnapshot()) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetBlockIndexSnapshotPath(), ec);
+        return error("%s: failed to forget the block index snapshot", __func__);
+    }
 
-    boost::this_thread::interruption_point();
+    int64_t nStart = GetTimeMillis();
+    bool fLoaded = ReadBlockIndexSnapshot(GetBlockIndexSnapshotPath(), hashChecksum, pcoinsTip->GetBestBlock(), vSortedByHeight);
+    boost::system::error_code ec;
+    boost::filesystem::remove(GetBlockIndexSnapshotPath(), ec);
+    if (!fLoaded) {
+        // only snapshot entries were inserted, none of them is heap allocated
+        mapBlockIndex.clear();
+        blockindexarena.Clear();
+        vSortedByHeight.clear();
+        LogPrintf("%s: block index snapshot unusable, loading the block index database instead\n", __func__);
+        return false;
+    }
+    LogPrintf("%s: loaded %u block index entries from snapshot in %dms\n", __func__, vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+/** Entries of mapBlockIndex, parents before their children */
+static std::vector<CBlockIndex*> GetBlockIndexByHeight()
+{
+    vector<pair<int, CBlockIndex*> > vHeights;
+    vHeights.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
         CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        vHeights.push_back(make_pair(pindex->nHeight, pindex));
+    }
+    sort(vHeights.begin(), vHeights.end());
+    std::vector<CBlockIndex*> vSortedByHeight;
+    vSortedByHeight.reserve(vHeights.size());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vHeights)
+        vSortedByHeight.push_back(item.second);
+    return vSortedByHeight;
+}
+
+bool DumpBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    // the snapshot has to match the block index database exactly
+    if (fReindex || !pblocktree || !pcoinsTip || !setDirtyBlockIndex.empty())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    std::vector<CBlockIndex*> vSortedByHeight = GetBlockIndexByHeight();
+    uint256 hashChecksum;
+    if (!WriteBlockIndexSnapshot(GetBlockIndexSnapshotPath(), vSortedByHeight, pcoinsTip->GetBestBlock(), hashChecksum))
+        return false;
+    if (!pblocktree->WriteIndexSnapshot(hashChecksum))
+        return error("%s: failed to record the block index snapshot", __func__);
+    LogPrintf("%s: wrote %u block index entries in %dms\n", __func__, vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool static LoadBlockIndexDB()
+{
+    const CChainParams& chainparams = Params();
+    std::vector<CBlockIndex*> vSortedByHeight;
+    if (!LoadBlockIndexSnapshot(vSortedByHeight)) {
+        if (!pblocktree->LoadBlockIndexGuts())
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        vSortedByHeight = GetBlockIndexByHeight();
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+
+    // Calculate nChainWork
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
@@ -4633,9 +4826,11 @@ void UnloadBlockIndex()
     }
 
     BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
+        if (!blockindexarena.Contains(entry.second))
+            delete entry.second;
     }
     mapBlockIndex.clear();
+    blockindexarena.Clear();
     fHavePruned = false;
 }
 
@@ -4665,6 +4860,7 @@ bool InitBlockIndex(const CChainParams& chainparams)
     // Use the provided setting for -addressindex in the new database
     fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
     pblocktree->WriteFlag("addressindex", fAddressIndex);
+    pblocktree->WriteFlag("addressbalances", true);
 
     // Use the provided setting for -timestampindex in the new database
     fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
@@ -4702,105 +4898,436 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+/** Derive the index changes of connecting (or disconnecting) pindex from its block and undo data on disk */
+static bool ReadIndexUpdate(const CBlockIndex* pindex, const CChainParams& chainparams, bool fConnect, CIndexUpdate& update)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    CBlock block;
+    CBlockUndo blockundo;
+    if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+        return error("%s: failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+    if (!UndoReadFromDisk(blockundo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+        return error("%s: failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+    BuildIndexUpdate(block, blockundo, pindex->nHeight, pindex->nTime, pindex->GetBlockHash(), fConnect, update);
+    return true;
+}
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+bool CatchUpIndexes(const CChainParams& chainparams)
+{
+    LOCK(cs_main);
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+    if (!fAddressIndex && !fSpentIndex && !fTimestampIndex)
+        return true;
+
+    // address indexes written before the per-address totals existed get them once
+    if (fAddressIndex) {
+        bool fAddressBalances = false;
+        pblocktree->ReadFlag("addressbalances", fAddressBalances);
+        if (!fAddressBalances && (!pblocktree->BuildAddressBalances() || !pblocktree->WriteFlag("addressbalances", true)))
+            return error("%s: failed to build address balances", __func__);
+    }
+
+    if (chainActive.Tip() == NULL)
+        return true;
+
+    uint256 hashIndexed;
+    if (!pblocktree->ReadBestIndexed(hashIndexed)) {
+        // written by a version that updated the indexes along with the chain
+        return pblocktree->WriteBestIndexed(chainActive.Tip()->GetBlockHash());
+    }
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashIndexed);
+    if (mi == mapBlockIndex.end())
+        return error("%s: indexes were written up to unknown block %s", __func__, hashIndexed.ToString());
+    CBlockIndex* pindexIndexed = mi->second;
+    if (pindexIndexed == chainActive.Tip())
+        return true;
+    const CBlockIndex* pindexFork = chainActive.FindFork(pindexIndexed);
+
+    // the writer didn't get to finish before the node stopped: undo what the
+    // indexes have from blocks no longer in the chain, then redo the missing ones.
+    // The writer thread isn't running yet, so write them here in bounded batches.
+    std::vector<CIndexUpdate> vUpdates;
+    int nDisconnected = 0;
+    for (const CBlockIndex* pindex = pindexIndexed; pindex != pindexFork && pindex->pprev; pindex = pindex->pprev) {
+        vUpdates.push_back(CIndexUpdate());
+        if (!ReadIndexUpdate(pindex, chainparams, false, vUpdates.back()))
+            return false;
+        if (vUpdates.size() >= MAX_INDEX_QUEUE_BLOCKS) {
+            if (!pblocktree->WriteIndexUpdates(vUpdates, pindex->pprev->GetBlockHash()))
+                return error("%s: failed to write index updates", __func__);
+            vUpdates.clear();
+        }
+        nDisconnected++;
+    }
+
+    int nConnected = 0;
+    for (const CBlockIndex* pindex = pindexFork ? chainActive.Next(pindexFork) : chainActive.Genesis(); pindex; pindex = chainActive.Next(pindex)) {
+        // the genesis block's transactions are never connected
+        if (!pindex->pprev)
+            continue;
+        vUpdates.push_back(CIndexUpdate());
+        if (!ReadIndexUpdate(pindex, chainparams, true, vUpdates.back()))
+            return false;
+        if (vUpdates.size() >= MAX_INDEX_QUEUE_BLOCKS) {
+            if (!pblocktree->WriteIndexUpdates(vUpdates, pindex->GetBlockHash()))
+                return error("%s: failed to write index updates", __func__);
+            vUpdates.clear();
+        }
+        nConnected++;
+    }
+    if (!pblocktree->WriteIndexUpdates(vUpdates, chainActive.Tip()->GetBlockHash()))
+        return error("%s: failed to write index updates", __func__);
+
+    LogPrintf("%s: replayed index updates of %d disconnected and %d connected blocks\n", __func__, nDisconnected, nConnected);
+    return true;
+}
+
+/**
+ * Read-ahead pipeline used by LoadExternalBlockFile. A reader thread scans the
+ * file for blocks and copies them out raw, worker threads deserialize them,
+ * hash the header and run the context-free CheckBlock (which ProcessNewBlock
+ * then skips), and the importing thread takes the blocks strictly in file
+ * order. At most vSlots.size() blocks are held in memory at once.
+ */
+class CBlockImportPipeline
+{
+public:
+    struct CSlot {
+        CDataStream ssData;
+        CDiskBlockPos pos;
+        CBlock block;
+        uint256 hash;
+        //! Empty if the block deserialized
+        std::string strError;
+        bool fReady;
+
+        CSlot() : ssData(SER_DISK, CLIENT_VERSION), fReady(false) {}
+    };
+
+private:
+    const CChainParams& chainparams;
+    CBufferedFile blkdat;
+    int nFile;
+    std::vector<CSlot> vSlots;
+
+    boost::mutex mutex;
+    //! Signalled when the reader has filled a slot or reached the end of the file
+    boost::condition_variable condRead;
+    //! Signalled when a worker has finished a slot or the reader reached the end of the file
+    boost::condition_variable condReady;
+    //! Signalled when the importing thread has released a slot
+    boost::condition_variable condFree;
+    //! Number of blocks the reader has filled in
+    size_t nRead;
+    //! Next block to be claimed by a worker
+    size_t nNextDecode;
+    //! Number of blocks the importing thread has released
+    size_t nReleased;
+    bool fEof;
+    bool fStop;
+    //! Set by the reader on an I/O error that ends the import
+    std::string strReadError;
+
+    boost::thread_group threads;
+
+    bool WaitForFreeSlot(size_t i)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && i >= nReleased + vSlots.size())
+            condFree.wait(lock);
+        return !fStop;
+    }
+
+    void SetEof()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fEof = true;
+        }
+        condRead.notify_all();
+        condReady.notify_all();
+    }
+
+    void ThreadRead()
+    {
+        RenameThread("growth-impread");
+        int64_t nTimeStart = GetTimeMicros();
+        try {
+            size_t i = 0;
+            uint64_t nRewind = blkdat.GetPos();
+            while (!blkdat.eof()) {
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(chainparams.MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                if (!WaitForFreeSlot(i))
+                    return;
+                // The slot is ours alone until it is published: the block that
+                // previously occupied it has already been released.
+                CSlot& slot = vSlots[i % vSlots.size()];
+                try {
+                    // read block
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.SetPos(nBlockPos);
+                    slot.ssData.clear();
+                    slot.ssData.resize(nSize);
+                    blkdat.read(&slot.ssData[0], nSize);
+                    nRewind = blkdat.GetPos();
+                    slot.pos = CDiskBlockPos(nFile, nBlockPos);
+                    nBytesRead += nSize + MESSAGE_START_SIZE + sizeof(nSize);
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: I/O error - %s\n", __func__, e.what());
                     continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+                }
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    nRead = ++i;
+                }
+                condRead.notify_one();
             }
+        } catch (const std::runtime_error& e) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            strReadError = e.what();
+        }
+        nTimeRead = GetTimeMicros() - nTimeStart;
+        SetEof();
+    }
+
+    void ThreadDecode()
+    {
+        RenameThread("growth-impwork");
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !fEof && nNextDecode >= nRead)
+                    condRead.wait(lock);
+                if (fStop || nNextDecode >= nRead)
+                    return;
+                i = nNextDecode++;
+            }
+
+            int64_t nTimeStart = GetTimeMicros();
+            CSlot& slot = vSlots[i % vSlots.size()];
+            slot.block.SetNull();
+            slot.strError.clear();
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+                slot.ssData >> slot.block;
+                slot.hash = slot.block.GetHash();
+                // Sets block.fChecked on success, so validation does not redo the
+                // proof of work and merkle root; on failure it runs again there.
+                CValidationState state;
+                CheckBlock(slot.block, state);
+            } catch (const std::exception& e) {
+                slot.strError = e.what();
+            }
+            slot.ssData.clear();
+            int64_t nTime = GetTimeMicros() - nTimeStart;
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, chainparams, NULL, &block, true, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                slot.fReady = true;
+                nTimeDecode += nTime;
+            }
+            condReady.notify_all();
+        }
+    }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, chainparams, NULL, &block, true, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
+public:
+    //! Statistics of the reader and worker stages, complete once the pipeline is stopped
+    uint64_t nBytesRead;
+    int64_t nTimeRead;
+    int64_t nTimeDecode;
+
+    CBlockImportPipeline(const CChainParams& chainparamsIn, FILE* fileIn, int nFileIn, int nThreadsIn, int nReadAhead) :
+        chainparams(chainparamsIn), blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION), nFile(nFileIn),
+        vSlots(std::max(nReadAhead, nThreadsIn)), nRead(0), nNextDecode(0), nReleased(0), fEof(false), fStop(false),
+        nBytesRead(0), nTimeRead(0), nTimeDecode(0)
+    {
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+        for (int i = 0; i < nThreadsIn; i++)
+            threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadDecode, this));
+    }
+
+    ~CBlockImportPipeline()
+    {
+        Stop();
+    }
+
+    /** Stop and join all pipeline threads */
+    void Stop()
+    {
+        // may run while unwinding from an interruption of the importing thread
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condRead.notify_all();
+        condFree.notify_all();
+        threads.join_all();
+    }
+
+    /** Wait for block i to be decoded; the slot stays valid until Release(i). Returns NULL past the last block. */
+    CSlot* Get(size_t i)
+    {
+        CSlot& slot = vSlots[i % vSlots.size()];
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(i < nRead && slot.fReady) && !(fEof && i >= nRead))
+            condReady.wait(lock);
+        return i < nRead ? &slot : NULL;
+    }
+
+    /** Hand the slot of block i back to the reader */
+    void Release(size_t i)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vSlots[i % vSlots.size()].fReady = false;
+            nReleased = i + 1;
+        }
+        condFree.notify_all();
+    }
+
+    /** The I/O error that ended the import early, if any */
+    std::string GetReadError()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return strReadError;
+    }
+};
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+
+    // -importthreads=0 means autodetect
+    int nThreads = GetArg("-importthreads", DEFAULT_IMPORT_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    nThreads = std::max(1, std::min(nThreads, MAX_IMPORT_THREADS));
+
+    int nLoaded = 0;
+    size_t nBlocks = 0;
+    int64_t nTimeWait = 0;
+    int64_t nTimeValidate = 0;
+    uint64_t nBytesRead = 0;
+    int64_t nTimeRead = 0;
+    int64_t nTimeDecode = 0;
+    try {
+        std::string strReadError;
+        {
+            // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+            CBlockImportPipeline pipeline(chainparams, fileIn, dbp ? dbp->nFile : -1, nThreads, IMPORT_READAHEAD_BLOCKS);
+            for (size_t i = 0; ; i++) {
+                boost::this_thread::interruption_point();
+
+                int64_t nTimeStart = GetTimeMicros();
+                CBlockImportPipeline::CSlot* pslot = pipeline.Get(i);
+                nTimeWait += GetTimeMicros() - nTimeStart;
+                if (!pslot)
+                    break;
+                nBlocks++;
+
+                nTimeStart = GetTimeMicros();
+                CBlockImportPipeline::CSlot& slot = *pslot;
+                CDiskBlockPos* pos = dbp ? &slot.pos : NULL;
+                const uint256& hash = slot.hash;
+                bool fError = false;
+                if (!slot.strError.empty()) {
+                    LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, slot.strError);
+                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(slot.block.hashPrevBlock) == mapBlockIndex.end()) {
+                    // detect out of order blocks, and store them for later
+                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                            slot.block.hashPrevBlock.ToString());
+                    if (pos)
+                        mapBlocksUnknownParent.insert(std::make_pair(slot.block.hashPrevBlock, *pos));
+                } else {
+                    // process in case the block isn't known yet
+                    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                        CValidationState state;
+                        if (ProcessNewBlock(state, chainparams, NULL, &slot.block, true, pos))
+                            nLoaded++;
+                        fError = state.IsError();
+                    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+                    }
+
+                    // Recursively process earlier encountered successors of this block
+                    deque<uint256> queue;
+                    queue.push_back(hash);
+                    while (!fError && !queue.empty()) {
+                        uint256 head = queue.front();
+                        queue.pop_front();
+                        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                        while (range.first != range.second) {
+                            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                            CBlock block;
+                            try {
+                                if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+                                {
+                                    LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                                            head.ToString());
+                                    CValidationState dummy;
+                                    if (ProcessNewBlock(dummy, chainparams, NULL, &block, true, &it->second))
+                                    {
+                                        nLoaded++;
+                                        queue.push_back(block.GetHash());
+                                    }
+                                }
+                            } catch (const std::exception& e) {
+                                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
                             }
+                            range.first++;
+                            mapBlocksUnknownParent.erase(it);
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
                     }
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                nTimeValidate += GetTimeMicros() - nTimeStart;
+                pipeline.Release(i);
+                if (fError)
+                    break;
             }
-        }
+            pipeline.Stop();
+            strReadError = pipeline.GetReadError();
+            nBytesRead = pipeline.nBytesRead;
+            nTimeRead = pipeline.nTimeRead;
+            nTimeDecode = pipeline.nTimeDecode;
+        }
+        if (!strReadError.empty())
+            AbortNode(std::string("System error: ") + strReadError);
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    if (nBlocks > 0) {
+        // validation only waits on the workers if reading or decoding is the bottleneck
+        LogPrintf("Block import: read %u blocks (%.2f MB) in %.2fs (%.2f MB/s), decoded in %.2fs by %d threads (%.1f blocks/s each), "
+                  "validated in %.2fs (%.1f blocks/s) after waiting %.2fs for decoded blocks\n",
+                  nBlocks, nBytesRead * 0.000001, nTimeRead * 0.000001, nBytesRead / (double)std::max((int64_t)1, nTimeRead),
+                  nTimeDecode * 0.000001, nThreads, nBlocks * 1000000.0 / std::max((int64_t)1, nTimeDecode),
+                  nTimeValidate * 0.000001, nBlocks * 1000000.0 / std::max((int64_t)1, nTimeValidate), nTimeWait * 0.000001);
+    }
     return nLoaded > 0;
 }
 
@@ -5085,7 +5612,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
 
     case MSG_BLOCK:
@@ -5139,6 +5667,89 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+namespace {
+
+typedef boost::shared_ptr<std::vector<char> > CRawBlockRef;
+
+/**
+ * Blocks near the tip we served recently, in wire format. After a new block
+ * many peers ask for it within a short time, they all get the same bytes
+ * instead of a fresh read, deserialization and serialization each.
+ * Protected by cs_main.
+ */
+std::list<std::pair<uint256, CRawBlockRef> > listRelayBlocks; // most recently used first
+
+CRawBlockRef GetRawBlock(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    const uint256& hash = pindex->GetBlockHash();
+
+    for (std::list<std::pair<uint256, CRawBlockRef> >::iterator it = listRelayBlocks.begin(); it != listRelayBlocks.end(); ++it) {
+        if (it->first == hash) {
+            listRelayBlocks.splice(listRelayBlocks.begin(), listRelayBlocks, it);
+            return it->second;
+        }
+    }
+
+    CRawBlockRef pvchBlock(new std::vector<char>());
+    if (!ReadRawBlockFromDisk(*pvchBlock, pindex->GetBlockPos(), Params().MessageStart()))
+        return CRawBlockRef();
+
+    // the header is all we can check without deserializing everything
+    CBlockHeader header;
+    CDataStream ssHeader(&(*pvchBlock)[0], &(*pvchBlock)[0] + 80, SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader >> header;
+    if (header.GetHash() != hash) {
+        error("%s: GetHash() doesn't match index for %s at %s", __func__, pindex->ToString(), pindex->GetBlockPos().ToString());
+        return CRawBlockRef();
+    }
+
+    // historical downloads would only push the blocks everybody is asking for out of the cache
+    if (pindex->nHeight + BLOCK_RELAY_CACHE_DEPTH >= chainActive.Height()) {
+        listRelayBlocks.push_front(std::make_pair(hash, pvchBlock));
+        if (listRelayBlocks.size() > MAX_BLOCK_RELAY_CACHE_SIZE)
+            listRelayBlocks.pop_back();
+    }
+
+    return pvchBlock;
+}
+
+/**
+ * The compact encoding of the last block we announced or served as
+ * cmpctblock. Every peer gets the same nonce, so the short ids are computed
+ * once per block. Protected by cs_main.
+ */
+uint256 hashCompactBlock;
+boost::shared_ptr<const CBlockHeaderAndShortTxIDs> pCompactBlock;
+
+/** Compact encoding of pindex, built from pvchBlock if it isn't the cached one */
+boost::shared_ptr<const CBlockHeaderAndShortTxIDs> GetCompactBlock(const CBlockIndex* pindex, const CRawBlockRef& pvchBlock)
+{
+    AssertLockHeld(cs_main);
+    if (pCompactBlock && hashCompactBlock == pindex->GetBlockHash())
+        return pCompactBlock;
+
+    if (!pvchBlock)
+        return boost::shared_ptr<const CBlockHeaderAndShortTxIDs>();
+    CBlock block;
+    CDataStream ssBlock(*pvchBlock, SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock >> block;
+
+    pCompactBlock.reset(new CBlockHeaderAndShortTxIDs(block));
+    hashCompactBlock = pindex->GetBlockHash();
+    return pCompactBlock;
+}
+
+boost::shared_ptr<const CBlockHeaderAndShortTxIDs> GetCompactBlock(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    if (pCompactBlock && hashCompactBlock == pindex->GetBlockHash())
+        return pCompactBlock;
+    return GetCompactBlock(pindex, GetRawBlock(pindex));
+}
+
+} // anon namespace
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -5152,13 +5763,17 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
+        // Message workers are still busy with what this peer sent before
+        if (pfrom->nProcessQueueSize >= ReceiveFloodSize())
+            break;
+
         const CInv &inv = *it;
         LogPrint("net", "ProcessGetData -- inv = %s\n", inv.ToString());
         {
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -5193,17 +5808,21 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // Pruned nodes may have deleted the block, so check whether
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    // Send block from the relay cache or straight from disk, as stored
+                    CRawBlockRef pvchBlock = GetRawBlock(mi->second);
+                    if (!pvchBlock)
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else // MSG_FILTERED_BLOCK)
+                        pfrom->PushMessage(NetMsgType::BLOCK, CFlatData(*pvchBlock));
+                    else if (inv.type == MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
+                            // merkle blocks depend on the peer's filter, build them from the cached bytes
+                            CBlock block;
+                            CDataStream ssBlock(*pvchBlock, SER_NETWORK, PROTOCOL_VERSION);
+                            ssBlock >> block;
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
                             pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
@@ -5219,6 +5838,20 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // else
                             // no response
                     }
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // If a peer is asking for old blocks, we're almost guaranteed
+                        // they won't have a useful mempool to match against a compact block,
+                        // and we don't feel like constructing the object for them, so
+                        // instead we respond with the full, non-compact block.
+                        boost::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock;
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                            pcmpctblock = GetCompactBlock(mi->second, pvchBlock);
+                        if (pcmpctblock)
+                            pfrom->PushMessage(NetMsgType::CMPCTBLOCK, *pcmpctblock);
+                        else
+                            pfrom->PushMessage(NetMsgType::BLOCK, CFlatData(*pvchBlock));
+                    }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -5426,6 +6059,249 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/** Hand a masternode/governance/InstantSend/PrivateSend/spork message to every extension handler, only the owner reads it */
+void static ProcessExtensionMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    darkSendPool.ProcessMessage(pfrom, strCommand, vRecv);
+    mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+    mnpayments.ProcessMessage(pfrom, strCommand, vRecv);
+    instantsend.ProcessMessage(pfrom, strCommand, vRecv);
+    sporkManager.ProcessSpork(pfrom, strCommand, vRecv);
+    masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+    governance.ProcessMessage(pfrom, strCommand, vRecv);
+}
+
+namespace {
+
+/** Message families which can be handled off the message handler thread, they take whatever locks they need themselves */
+enum MessageFamily
+{
+    MESSAGE_FAMILY_NONE = -1,
+    MESSAGE_FAMILY_MASTERNODE,
+    MESSAGE_FAMILY_GOVERNANCE,
+    MESSAGE_FAMILY_INSTANTSEND,
+    MESSAGE_FAMILY_PRIVATESEND,
+    MESSAGE_FAMILY_COUNT
+};
+
+const char* const MESSAGE_FAMILY_NAMES[MESSAGE_FAMILY_COUNT] = { "mnmsg", "govmsg", "ixmsg", "psmsg" };
+
+MessageFamily GetMessageFamily(const std::string& strCommand)
+{
+    if (strCommand == NetMsgType::MNANNOUNCE || strCommand == NetMsgType::MNPING ||
+        strCommand == NetMsgType::DSEG || strCommand == NetMsgType::MNVERIFY ||
+        strCommand == NetMsgType::MASTERNODEPAYMENTVOTE || strCommand == NetMsgType::MASTERNODEPAYMENTSYNC)
+        return MESSAGE_FAMILY_MASTERNODE;
+    if (strCommand == NetMsgType::MNGOVERNANCESYNC || strCommand == NetMsgType::MNGOVERNANCEOBJECT ||
+        strCommand == NetMsgType::MNGOVERNANCEOBJECTVOTE)
+        return MESSAGE_FAMILY_GOVERNANCE;
+    if (strCommand == NetMsgType::TXLOCKVOTE)
+        return MESSAGE_FAMILY_INSTANTSEND;
+    if (strCommand == NetMsgType::DSACCEPT || strCommand == NetMsgType::DSVIN ||
+        strCommand == NetMsgType::DSFINALTX || strCommand == NetMsgType::DSSIGNFINALTX ||
+        strCommand == NetMsgType::DSCOMPLETE || strCommand == NetMsgType::DSSTATUSUPDATE ||
+        strCommand == NetMsgType::DSQUEUE)
+        return MESSAGE_FAMILY_PRIVATESEND;
+    // sporks and sync status stay on the message handler thread
+    return MESSAGE_FAMILY_NONE;
+}
+
+struct CQueuedMessage
+{
+    CNode* pfrom;
+    std::string strCommand;
+    CDataStream vRecv;
+
+    CQueuedMessage(CNode* pfromIn, const std::string& strCommandIn, CDataStream& vRecvIn) :
+        pfrom(pfromIn), strCommand(strCommandIn), vRecv(vRecvIn.begin(), vRecvIn.end(), vRecvIn.GetType(), vRecvIn.GetVersion()) {}
+};
+
+struct CMessageWorkerQueue
+{
+    std::deque<CQueuedMessage*> queue;
+    boost::condition_variable cond;
+};
+
+/**
+ * Queues of extension messages, each served by one -msgworkers thread. Every
+ * family gets its own queues and a peer is always pinned to the same queue
+ * of a family, so messages of one family from one peer are handled in the
+ * order they were received. PrivateSend only ever gets one queue: the mixing
+ * session it drives is shared by all peers and its handlers expect to run
+ * one at a time.
+ */
+class CMessageWorkerPool
+{
+private:
+    boost::mutex mutex;
+    std::vector<CMessageWorkerQueue*> vQueues;
+    int nWorkersPerFamily;
+
+    /** Number of queues of the family that are served. Requires mutex. */
+    int GetFamilyWorkers(MessageFamily family) const
+    {
+        return family == MESSAGE_FAMILY_PRIVATESEND ? 1 : nWorkersPerFamily;
+    }
+
+public:
+    CMessageWorkerPool() : nWorkersPerFamily(0) {}
+
+    ~CMessageWorkerPool()
+    {
+        BOOST_FOREACH(CMessageWorkerQueue* pqueue, vQueues) {
+            BOOST_FOREACH(CQueuedMessage* pmsg, pqueue->queue)
+                delete pmsg;
+            delete pqueue;
+        }
+    }
+
+    void Start(boost::thread_group& threadGroup, int nWorkersPerFamilyIn)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nWorkersPerFamily = nWorkersPerFamilyIn;
+            for (int i = 0; i < MESSAGE_FAMILY_COUNT * nWorkersPerFamily; i++)
+                vQueues.push_back(new CMessageWorkerQueue());
+        }
+        for (int i = 0; i < MESSAGE_FAMILY_COUNT * nWorkersPerFamily; i++) {
+            if (i % nWorkersPerFamily >= GetFamilyWorkers((MessageFamily)(i / nWorkersPerFamily)))
+                continue;
+            threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, MESSAGE_FAMILY_NAMES[i / nWorkersPerFamily],
+                                                  boost::function<void()>(boost::bind(&CMessageWorkerPool::Thread, this, i))));
+        }
+    }
+
+    /** Whether messages of this type are handed to a worker */
+    bool Handles(const std::string& strCommand)
+    {
+        if (GetMessageFamily(strCommand) == MESSAGE_FAMILY_NONE)
+            return false;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nWorkersPerFamily > 0;
+    }
+
+    /** Queue the message for a worker, returns false if it has to be handled inline */
+    bool Push(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv)
+    {
+        MessageFamily family = GetMessageFamily(strCommand);
+        if (family == MESSAGE_FAMILY_NONE)
+            return false;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nWorkersPerFamily == 0)
+            return false;
+
+        CMessageWorkerQueue* pqueue = vQueues[family * nWorkersPerFamily + pfrom->id % GetFamilyWorkers(family)];
+        pfrom->AddRef();
+        pfrom->nProcessQueueSize += vRecv.size();
+        pqueue->queue.push_back(new CQueuedMessage(pfrom, strCommand, vRecv));
+        pqueue->cond.notify_one();
+        return true;
+    }
+
+    void Thread(int nQueue)
+    {
+        CMessageWorkerQueue* pqueue;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pqueue = vQueues[nQueue];
+        }
+
+        while (true) {
+            CQueuedMessage* pmsg;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (pqueue->queue.empty())
+                    pqueue->cond.wait(lock);
+                pmsg = pqueue->queue.front();
+                pqueue->queue.pop_front();
+            }
+
+            CNode* pfrom = pmsg->pfrom;
+            size_t nSize = pmsg->vRecv.size();
+            if (!pfrom->fDisconnect) {
+                int64_t nTimeStart = GetTimeMicros();
+                try {
+                    ProcessExtensionMessage(pfrom, pmsg->strCommand, pmsg->vRecv);
+                } catch (const std::ios_base::failure& e) {
+                    pfrom->PushMessage(NetMsgType::REJECT, pmsg->strCommand, REJECT_MALFORMED, string("error parsing message"));
+                    LogPrintf("%s(%s, %u bytes): Exception '%s' caught\n", __func__, SanitizeString(pmsg->strCommand), nSize, e.what());
+                } catch (const boost::thread_interrupted&) {
+                    throw;
+                } catch (const std::exception& e) {
+                    PrintExceptionContinue(&e, "CMessageWorkerPool::Thread()");
+                } catch (...) {
+                    PrintExceptionContinue(NULL, "CMessageWorkerPool::Thread()");
+                }
+                pfrom->RecordMsgProcessTime(pmsg->strCommand, GetTimeMicros() - nTimeStart);
+            }
+            delete pmsg;
+
+            pfrom->nProcessQueueSize -= nSize;
+            pfrom->Release();
+        }
+    }
+};
+
+CMessageWorkerPool messageWorkers;
+
+} // anon namespace
+
+void StartMessageWorkers(boost::thread_group& threadGroup, int nWorkersPerFamily)
+{
+    if (nWorkersPerFamily <= 0)
+        return;
+    LogPrintf("Using %d threads per masternode message family\n", nWorkersPerFamily);
+    messageWorkers.Start(threadGroup, nWorkersPerFamily);
+}
+
+// Requires cs_main.
+// Complete the compact block pfrom is sending us with the transactions it
+// sent in resp. Returns true when blockRet is ready for ProcessNewBlock.
+bool static FillCompactBlock(CNode* pfrom, const BlockTransactions& resp, CBlock& blockRet)
+{
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+    if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+            it->second.first != pfrom->GetId()) {
+        LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+        return false;
+    }
+
+    PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+    ReadStatus status = partialBlock.FillBlock(blockRet, resp.txn);
+    if (status == READ_STATUS_INVALID) {
+        MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+        Misbehaving(pfrom->GetId(), 100);
+        LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+        return false;
+    } else if (status == READ_STATUS_FAILED) {
+        // Might have collided, fall back to getdata now :(
+        std::vector<CInv> invs;
+        invs.push_back(CInv(MSG_BLOCK, resp.blockhash));
+        pfrom->PushMessage(NetMsgType::GETDATA, invs);
+        return false;
+    }
+    return true;
+}
+
+// Process a block we rebuilt from a compact block, the same way as a full block message.
+void static ProcessCompactBlock(CNode* pfrom, const string& strCommand, const CBlock& block, const CChainParams& chainparams)
+{
+    CValidationState state;
+    // The block was in flight from pfrom, so it counts as requested
+    ProcessNewBlock(state, chainparams, pfrom, &block, false, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
+        pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5608,6 +6484,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // nodes)
             pfrom->PushMessage(NetMsgType::SENDHEADERS);
         }
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell our peer we are willing to provide version-1 cmpctblocks
+            // However, we do not request new block announcements using
+            // cmpctblock messages here, masternode peers are asked to
+            // once they gave us a new block first.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
     }
 
 
@@ -5683,6 +6568,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         State(pfrom->GetId())->fPreferHeaders = true;
     }
 
+    else if (strCommand == NetMsgType::SENDCMPCT)
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
 
     else if (strCommand == NetMsgType::INV)
     {
@@ -6188,6 +7085,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                             pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
                 }
                 if (vGetData.size() > 0) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+                        // We seem to be rather well-synced, so it appears pfrom was the first to provide us
+                        // with this block! Let masternodes announce using compact blocks in the future.
+                        MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+                        // In any case, we want to download using a compact block, not a regular one
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
                     pfrom->PushMessage(NetMsgType::GETDATA, vGetData);
                 }
             }
@@ -6196,6 +7100,193 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CheckBlockIndex(chainparams.GetConsensus());
     }
 
+    else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                    return true;
+                }
+            }
+
+            // If AcceptBlockHeader returned true, it set pindex
+            assert(pindex);
+            UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+            bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+                return true;
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                    pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (fAlreadyInFlight) {
+                    // We requested this block for some reason, but our mempool will probably be useless
+                    // so we just grab the block via normal getdata
+                    std::vector<CInv> vInv(1);
+                    vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                    pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                }
+                return true;
+            }
+
+            // If we're not close to tip yet, give up and let parallel block fetch work its magic
+            if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
+
+            CNodeState *nodestate = State(pfrom->GetId());
+
+            // We want to be a bit conservative just to be extra careful about DoS
+            // possibilities in compact block processing...
+            if (pindex->nHeight <= chainActive.Height() + 2) {
+                if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                     (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                    list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+                    if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+                        if (!(*queuedBlockIt)->partialBlock)
+                            (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                        else {
+                            // The block was already in flight using compact blocks from the same peer
+                            LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                            return true;
+                        }
+                    }
+
+                    PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                    ReadStatus status = partialBlock.InitData(cmpctblock);
+                    if (status == READ_STATUS_INVALID) {
+                        MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                        Misbehaving(pfrom->GetId(), 100);
+                        LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                        return true;
+                    } else if (status == READ_STATUS_FAILED) {
+                        // Duplicate txindexes, the block is now in-flight, so just request it
+                        std::vector<CInv> vInv(1);
+                        vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                        pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                        return true;
+                    }
+
+                    BlockTransactionsRequest req;
+                    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                        if (!partialBlock.IsTxAvailable(i))
+                            req.indexes.push_back(i);
+                    }
+                    if (req.indexes.empty()) {
+                        // Our mempool had everything, no round trip needed
+                        BlockTransactions txn;
+                        txn.blockhash = cmpctblock.header.GetHash();
+                        fBlockReconstructed = FillCompactBlock(pfrom, txn, block);
+                    } else {
+                        req.blockhash = pindex->GetBlockHash();
+                        pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                    }
+                }
+            } else if (fAlreadyInFlight) {
+                // We requested this block, but its far into the future, so our
+                // mempool will probably be useless - request the block normally
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                return true;
+            }
+            // else the header is all we take from an announcement this far ahead,
+            // parallel block download fetches the block itself
+
+            CheckBlockIndex(chainparams.GetConsensus());
+        }
+
+        if (fBlockReconstructed)
+            ProcessCompactBlock(pfrom, strCommand, block, chainparams);
+    }
+
+
+    else if (strCommand == NetMsgType::GETBLOCKTXN)
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
+        // A block this recent was most likely just served from the relay cache
+        CRawBlockRef pvchBlock = GetRawBlock(it->second);
+        if (!pvchBlock)
+            assert(!"cannot load block from disk");
+        CBlock block;
+        CDataStream ssBlock(*pvchBlock, SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock >> block;
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+    }
+
+
+    else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            fBlockReconstructed = FillCompactBlock(pfrom, resp, block);
+        }
+
+        if (fBlockReconstructed)
+            ProcessCompactBlock(pfrom, strCommand, block, chainparams);
+    }
+
+
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
@@ -6474,14 +7565,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (found)
         {
-            //probably one the extensions
-            darkSendPool.ProcessMessage(pfrom, strCommand, vRecv);
-            mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-            mnpayments.ProcessMessage(pfrom, strCommand, vRecv);
-            instantsend.ProcessMessage(pfrom, strCommand, vRecv);
-            sporkManager.ProcessSpork(pfrom, strCommand, vRecv);
-            masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
-            governance.ProcessMessage(pfrom, strCommand, vRecv);
+            //probably one the extensions, with -msgworkers most of them are handled on their own threads
+            if (!messageWorkers.Push(pfrom, strCommand, vRecv))
+                ProcessExtensionMessage(pfrom, strCommand, vRecv);
         }
         else
         {
@@ -6522,6 +7608,11 @@ bool ProcessMessages(CNode* pfrom)
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
+        // Leave the rest in vRecvMsg while message workers are still busy with
+        // what this peer sent before, so -maxreceivebuffer keeps throttling it
+        if (pfrom->nProcessQueueSize >= ReceiveFloodSize())
+            break;
+
         // get next message
         CNetMessage& msg = *it;
 
@@ -6558,8 +7649,8 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        const uint256& hash = msg.GetMessageHash();
+        unsigned int nChecksum = ReadLE32(hash.begin());
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -6569,6 +7660,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -6601,6 +7693,10 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        // Messages handed to a -msgworkers thread are timed there
+        if (!messageWorkers.Handles(strCommand))
+            pfrom->RecordMsgProcessTime(strCommand, GetTimeMicros() - nTimeStart);
+
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -6754,7 +7850,9 @@ bool SendMessages(CNode* pto)
             // add all to the inv queue.
             LOCK(pto->cs_inventory);
             vector<CBlock> vHeaders;
-            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            bool fRevertToInv = ((!state.fPreferHeaders &&
+                                 (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
+                                pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
             CBlockIndex *pBestIndex = NULL; // last header queued for delivery
             ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
 
@@ -6806,6 +7904,15 @@ bool SendMessages(CNode* pto)
                     }
                 }
             }
+            boost::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock;
+            if (!fRevertToInv && vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+                // We only send up to 1 block as header-and-ids, as otherwise
+                // probably means we're doing an initial-ish-sync or they're slow
+                pcmpctblock = GetCompactBlock(pBestIndex);
+                // Still announce the block if it can't be encoded
+                if (!pcmpctblock && !state.fPreferHeaders)
+                    fRevertToInv = true;
+            }
             if (fRevertToInv) {
                 // If falling back to using an inv, just try to inv the tip.
                 // The last entry in vBlockHashesToAnnounce was our tip at some point
@@ -6833,7 +7940,12 @@ bool SendMessages(CNode* pto)
                             pto->id, hashToAnnounce.ToString());
                     }
                 }
-            } else if (!vHeaders.empty()) {
+            } else if (pcmpctblock) {
+                LogPrint("net", "%s: sending header-and-ids %s to peer=%d\n", __func__,
+                        vHeaders.front().GetHash().ToString(), pto->id);
+                pto->PushMessage(NetMsgType::CMPCTBLOCK, *pcmpctblock);
+                state.pindexBestHeaderSent = pBestIndex;
+            } else if (!vHeaders.empty() && state.fPreferHeaders) {
                 if (vHeaders.size() > 1) {
                     LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
                             vHeaders.size(),
@@ -6853,52 +7965,55 @@ bool SendMessages(CNode* pto)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
-            bool fSendTrickle = pto->fWhitelisted;
-            if (pto->nNextInvSend < nNow) {
-                fSendTrickle = true;
-                pto->nNextInvSend = PoissonNextSend(nNow, AVG_INVENTORY_BROADCAST_INTERVAL);
-            }
             LOCK(pto->cs_inventory);
-            vInv.reserve(std::min<size_t>(1000, pto->vInventoryToSend.size()));
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vInv.reserve(std::min<size_t>(MAX_INV_SZ, pto->vInventoryToSend.size() + pto->setInventoryTxToSend.size()));
+
+            // Blocks and masternode inventory go out right away
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (inv.type == MSG_TX && pto->filterInventoryKnown.contains(inv.hash))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        LogPrint("net", "SendMessages -- queued inv(vInvWait): %s  index=%d peer=%d\n", inv.ToString(), vInvWait.size(), pto->id);
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
                 pto->filterInventoryKnown.insert(inv.hash);
-
-                LogPrint("net", "SendMessages -- queued inv: %s  index=%d peer=%d\n", inv.ToString(), vInv.size(), pto->id);
                 vInv.push_back(inv);
-                if (vInv.size() >= 1000)
-                {
+                if (vInv.size() == MAX_INV_SZ) {
                     LogPrint("net", "SendMessages -- pushing inv's: count=%d peer=%d\n", vInv.size(), pto->id);
                     pto->PushMessage(NetMsgType::INV, vInv);
                     vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
+
+            // Transactions are trickled out in batches on a Poisson timer to protect privacy
+            bool fSendTrickle = pto->fWhitelisted;
+            if (pto->nNextInvSend < nNow) {
+                fSendTrickle = true;
+                pto->nNextInvSend = PoissonNextSend(nNow, AVG_INVENTORY_BROADCAST_INTERVAL);
+            }
+            if (fSendTrickle && !pto->fRelayTxes)
+                pto->setInventoryTxToSend.clear();
+            if (fSendTrickle) {
+                // Parents before their children, then by fee rate. Whatever was mined
+                // or evicted in the meantime isn't worth announcing and is dropped.
+                std::vector<uint256> vInvTx(pto->setInventoryTxToSend.begin(), pto->setInventoryTxToSend.end());
+                pto->setInventoryTxToSend.clear();
+                mempool.SortForRelay(vInvTx);
+                // At most one full inv worth per trickle, the rest waits for the next one
+                unsigned int nRelayedTransactions = 0;
+                std::vector<uint256>::iterator it = vInvTx.begin();
+                for (; it != vInvTx.end() && nRelayedTransactions < MAX_INV_SZ; ++it) {
+                    const uint256& hash = *it;
+                    if (pto->filterInventoryKnown.contains(hash))
+                        continue;
+                    nRelayedTransactions++;
+                    pto->filterInventoryKnown.insert(hash);
+                    vInv.push_back(CInv(MSG_TX, hash));
+                    if (vInv.size() == MAX_INV_SZ) {
+                        LogPrint("net", "SendMessages -- pushing inv's: count=%d peer=%d\n", vInv.size(), pto->id);
+                        pto->PushMessage(NetMsgType::INV, vInv);
+                        vInv.clear();
+                    }
+                }
+                pto->setInventoryTxToSend.insert(it, vInvTx.end());
+            }
         }
         if (!vInv.empty()) {
             LogPrint("net", "SendMessages -- pushing tailing inv's: count=%d peer=%d\n", vInv.size(), pto->id);
@@ -7004,8 +8119,10 @@ public:
         // block headers
         BlockMap::iterator it1 = mapBlockIndex.begin();
         for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+            if (!blockindexarena.Contains((*it1).second))
+                delete (*it1).second;
         mapBlockIndex.clear();
+        blockindexarena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
@@ -34,6 +34,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CBloomFilter;
 class CChainParams;
 class CInv;
@@ -75,10 +76,25 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 
+/** Number of recently served blocks kept in wire format for answering getdata */
+static const unsigned int MAX_BLOCK_RELAY_CACHE_SIZE = 8;
+/** Only blocks this close to the tip go into the block relay cache */
+static const int BLOCK_RELAY_CACHE_DEPTH = 6;
+
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads decoding and hashing blocks imported from disk */
+static const int MAX_IMPORT_THREADS = 16;
+/** -importthreads default (0 = auto) */
+static const int DEFAULT_IMPORT_THREADS = 0;
+/** Number of blocks the block import reader may run ahead of validation */
+static const int IMPORT_READAHEAD_BLOCKS = 64;
+/** Maximum number of worker threads per masternode message family */
+static const int MAX_MESSAGE_WORKER_THREADS = 8;
+/** -msgworkers default (0 = handle masternode messages on the message handler thread) */
+static const int DEFAULT_MESSAGE_WORKER_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -95,6 +111,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Percentage of the coins cache budget that unmodified entries are evicted down to when it runs full. */
+static const unsigned int COINS_CACHE_EVICT_PERCENT = 75;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -102,7 +120,7 @@ static const unsigned int AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL = 24 * 24 * 60;
 /** Average delay between peer address broadcasts in seconds. */
 static const unsigned int AVG_ADDRESS_BROADCAST_INTERVAL = 30;
 /** Average delay between trickled inventory broadcasts in seconds.
- *  Blocks, whitelisted receivers, and a random 25% of transactions bypass this. */
+ *  Only transaction invs are trickled, whitelisted receivers bypass this. */
 static const unsigned int AVG_INVENTORY_BROADCAST_INTERVAL = 5;
 /** Block download timeout base, expressed in millionths of the block interval (i.e. 2.5 min) */
 static const int64_t BLOCK_DOWNLOAD_TIMEOUT_BASE = 250000;
@@ -129,6 +147,13 @@ static const bool DEFAULT_ENABLE_REPLACEMENT = false;
 /** Maximum number of headers to announce when relaying blocks with headers message.*/
 static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
 
+/** Maximum number of peers asked to announce new blocks to us with cmpctblock right away */
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
+/** Serve getdata for compact blocks only this close to the tip, deeper ones are sent in full */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Answer getblocktxn only this close to the tip, deeper requests get the full block */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+
 static const int APRIL2018_REWARDS_BLOCK_CHANGE = 18950; // 2018/04/02 @ approx. 13:00 (UTC)
 
 struct BlockHasher
@@ -150,6 +175,9 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fTimestampIndex;
+extern bool fSpentIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern unsigned int nBytesPerSigOp;
@@ -222,10 +250,14 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Write a snapshot of the block index for a fast next start; only after the final flush on shutdown */
+bool DumpBlockIndexSnapshot();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
+/** Queue the index updates the background writer had not written when the node last stopped */
+bool CatchUpIndexes(const CChainParams& chainparams);
 /** Unload database information */
 void UnloadBlockIndex();
 /** Process protocol messages received from a given node */
@@ -238,6 +270,20 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread that reads block inputs ahead of ConnectBlock */
+void ThreadCoinPrefetch();
+/**
+ * Start nWorkersPerFamily threads each for masternode, governance, InstantSend
+ * and PrivateSend messages, which ProcessMessages then queues for them
+ * instead of handling them inline.
+ */
+void StartMessageWorkers(boost::thread_group& threadGroup, int nWorkersPerFamily);
+/**
+ * Run a batch of script checks on the script checking threads (inline when
+ * there are none) and return whether all of them passed. The queue is shared
+ * with ConnectBlock, so cs_main must be held.
+ */
+bool RunScriptChecks(std::vector<CScriptCheck>& vChecks);
 
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
@@ -454,6 +500,36 @@ struct CAddressUnspentValue {
     }
 };
 
+/** Running totals of every address index entry of one address, so its balance doesn't need a range scan */
+struct CAddressBalance {
+    CAmount balance;
+    CAmount received;
+    int64_t txCount;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(balance);
+        READWRITE(received);
+        READWRITE(txCount);
+    }
+
+    CAddressBalance() {
+        SetNull();
+    }
+
+    void SetNull() {
+        balance = 0;
+        received = 0;
+        txCount = 0;
+    }
+
+    bool IsNull() const {
+        return (balance == 0 && received == 0 && txCount == 0);
+    }
+};
+
 struct CAddressIndexKey {
     unsigned int type;
     uint160 hashBytes;
@@ -700,8 +776,8 @@ private:
 
 public:
     CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+        scriptPubKey(scriptPubKeyIn),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
 
     bool operator()();
@@ -725,14 +801,24 @@ bool GetAddressIndex(uint160 addressHash, int type,
                      int start = 0, int end = 0);
 bool GetAddressUnspent(uint160 addressHash, int type,
                        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
+bool GetAddressIndexPage(uint160 addressHash, int type, const CAddressIndexKey &keyStart, int end, size_t nLimit, bool fWholeTransactions,
+                         std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, CAddressIndexKey &keyNext, bool &fMore);
+bool GetAddressUnspentPage(uint160 addressHash, int type, const CAddressUnspentKey &keyStart, size_t nLimit,
+                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs, CAddressUnspentKey &keyNext, bool &fMore);
+bool GetAddressBalance(uint160 addressHash, int type, CAddressBalance &balance);
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the block at pos as stored on disk (which is its wire format) without deserializing it */
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
+/** Restore the output at out from its undo record, taking missing metadata from the rest of its transaction */
+bool ApplyTxInUndo(Coin undo, CCoinsViewCache& view, const COutPoint& out);
+
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
@@ -835,6 +921,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins database below pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -850,6 +939,12 @@ int GetSpendHeight(const CCoinsViewCache& inputs);
  */
 int32_t ComputeBlockVersion(const CBlockIndex* pindexPrev, const Consensus::Params& params);
 
+/**
+ * Number of blocks of minVersion or above in the last Consensus::Params::nMajorityWindow
+ * blocks, starting at pstart and going backwards. Requires cs_main.
+ */
+unsigned int CountSuperMajority(int minVersion, const CBlockIndex* pstart, const Consensus::Params& consensusParams);
+
 /**
  * Return true if hash can be found in chainActive at nBlockHeight height.
  * Fills hashRet with found hash, if no nBlockHeight is specified - chainActive.Height() is used.
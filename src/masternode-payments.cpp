@@ -240,6 +240,15 @@ void CMasternodePayments::Clear()
     LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePaymentVotes);
     mapMasternodeBlocks.clear();
     mapMasternodePaymentVotes.clear();
+    mapVoteHashesByHeight.clear();
+}
+
+void CMasternodePayments::AddVoteToHeightIndex(const uint256& nHash, int nBlockHeight)
+{
+    AssertLockHeld(cs_mapMasternodePaymentVotes);
+    // only index hashes that are new to mapMasternodePaymentVotes, the index and the map must stay the same size
+    if(mapMasternodePaymentVotes.count(nHash)) return;
+    mapVoteHashesByHeight.insert(std::make_pair(nBlockHeight, nHash));
 }
 
 bool CMasternodePayments::CanVote(COutPoint outMasternode, int nBlockHeight)
@@ -323,6 +332,7 @@ void CMasternodePayments::ProcessMessage(CNode* pfrom, std::string& strCommand,
         if(netfulfilledman.HasFulfilledRequest(pfrom->addr, NetMsgType::MASTERNODEPAYMENTSYNC)) {
             // Asking for the payments list multiple times in a short period of time is no good
             LogPrintf("MASTERNODEPAYMENTSYNC -- peer already asked me for the list, peer=%d\n", pfrom->id);
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return;
         }
@@ -352,6 +362,7 @@ void CMasternodePayments::ProcessMessage(CNode* pfrom, std::string& strCommand,
             }
 
             // Avoid processing same vote multiple times
+            AddVoteToHeightIndex(nHash, vote.nBlockHeight);
             mapMasternodePaymentVotes[nHash] = vote;
             // but first mark vote as non-verified,
             // AddPaymentVote() below should take care of it if vote is actually ok
@@ -387,6 +398,7 @@ void CMasternodePayments::ProcessMessage(CNode* pfrom, std::string& strCommand,
         if(!vote.CheckSignature(mnInfo.pubKeyMasternode, pCurrentBlockIndex->nHeight, nDos)) {
             if(nDos) {
                 LogPrintf("MASTERNODEPAYMENTVOTE -- ERROR: invalid signature\n");
+                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), nDos);
             } else {
                 // only warn about anything non-critical (i.e. nDos == 0) in debug mode
@@ -474,6 +486,7 @@ bool CMasternodePayments::AddPaymentVote(const CMasternodePaymentVote& vote)
 
     LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePaymentVotes);
 
+    AddVoteToHeightIndex(vote.GetHash(), vote.nBlockHeight);
     mapMasternodePaymentVotes[vote.GetHash()] = vote;
 
     if(!mapMasternodeBlocks.count(vote.nBlockHeight)) {
@@ -636,19 +649,24 @@ void CMasternodePayments::CheckAndRemove()
 
     LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePaymentVotes);
 
-    int nLimit = GetStorageLimit();
+    // votes loaded from mnpayments.dat are not indexed yet
+    if(mapVoteHashesByHeight.size() != mapMasternodePaymentVotes.size()) {
+        mapVoteHashesByHeight.clear();
+        std::map<uint256, CMasternodePaymentVote>::iterator it = mapMasternodePaymentVotes.begin();
+        for(; it != mapMasternodePaymentVotes.end(); ++it) {
+            mapVoteHashesByHeight.insert(std::make_pair(it->second.nBlockHeight, it->first));
+        }
+    }
 
-    std::map<uint256, CMasternodePaymentVote>::iterator it = mapMasternodePaymentVotes.begin();
-    while(it != mapMasternodePaymentVotes.end()) {
-        CMasternodePaymentVote vote = (*it).second;
+    int nFirstBlock = pCurrentBlockIndex->nHeight - GetStorageLimit();
 
-        if(pCurrentBlockIndex->nHeight - vote.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CheckAndRemove -- Removing old Masternode payment: nBlockHeight=%d\n", vote.nBlockHeight);
-            mapMasternodePaymentVotes.erase(it++);
-            mapMasternodeBlocks.erase(vote.nBlockHeight);
-        } else {
-            ++it;
-        }
+    // only touch votes which are actually out of range, everything past them is newer
+    std::multimap<int, uint256>::iterator it = mapVoteHashesByHeight.begin();
+    while(it != mapVoteHashesByHeight.end() && it->first < nFirstBlock) {
+        LogPrint("mnpayments", "CMasternodePayments::CheckAndRemove -- Removing old Masternode payment: nBlockHeight=%d\n", it->first);
+        mapMasternodePaymentVotes.erase(it->second);
+        mapMasternodeBlocks.erase(it->first);
+        mapVoteHashesByHeight.erase(it++);
     }
     LogPrintf("CMasternodePayments::CheckAndRemove -- %s\n", ToString());
 }
@@ -701,6 +719,7 @@ bool CMasternodePaymentVote::IsValid(CNode* pnode, int nValidationHeight, std::s
         if(nRank > MNPAYMENTS_SIGNATURES_TOTAL*2 && nBlockHeight > nValidationHeight) {
             strError = strprintf("Masternode is not in the top %d (%d)", MNPAYMENTS_SIGNATURES_TOTAL*2, nRank);
             LogPrintf("CMasternodePaymentVote::IsValid -- Error: %s\n", strError);
+            LOCK(cs_main);
             Misbehaving(pnode->GetId(), 20);
         }
         // Still invalid however
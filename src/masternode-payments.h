@@ -176,6 +176,11 @@ private:
     // Keep track of current block index
     const CBlockIndex *pCurrentBlockIndex;
 
+    // vote hashes ordered by payment block height, lets CheckAndRemove stop at the first vote still in range
+    std::multimap<int, uint256> mapVoteHashesByHeight;
+
+    void AddVoteToHeightIndex(const uint256& nHash, int nBlockHeight);
+
 public:
     std::map<uint256, CMasternodePaymentVote> mapMasternodePaymentVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
@@ -12,6 +12,8 @@
 #include "netfulfilledman.h"
 #include "util.h"
 
+#include <boost/bind.hpp>
+
 /** Masternode manager */
 CMasternodeMan mnodeman;
 
@@ -103,6 +105,8 @@ CMasternodeMan::CMasternodeMan()
   mWeAskedForMasternodeList(),
   mWeAskedForMasternodeListEntry(),
   mWeAskedForVerification(),
+  listVerifyCandidates(),
+  nVerifyHeight(0),
   mMnbRecoveryRequests(),
   mMnbRecoveryGoodReplies(),
   listScheduledMnbRequestConnections(),
@@ -535,6 +539,15 @@ bool CMasternodeMan::Has(const CTxIn& vin)
     return (pMN != NULL);
 }
 
+bool CMasternodeMan::Has(const CNetAddr& addr)
+{
+    LOCK(cs);
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        if((CNetAddr)mn.addr == addr) return true;
+    }
+    return false;
+}
+
 //
 // Deterministically select the oldest/best masternode to pay on the network
 //
@@ -822,6 +835,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             // use announced Masternode as a peer
             addrman.Add(CAddress(mnb.addr), pfrom->addr, 2*60*60);
         } else if(nDos > 0) {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), nDos);
         }
 
@@ -879,7 +893,8 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         LogPrint("masternode", "DSEG -- Masternode list, masternode=%s\n", vin.prevout.ToStringShort());
 
-        LOCK(cs);
+        // Need LOCK2 here to ensure consistent locking order because Misbehaving below needs cs_main
+        LOCK2(cs_main, cs);
 
         if(vin == CTxIn()) { //only should ask for this once
             //local network
@@ -962,11 +977,8 @@ void CMasternodeMan::DoFullVerificationStep()
 
     std::vector<std::pair<int, CMasternode> > vecMasternodeRanks = GetMasternodeRanks(pCurrentBlockIndex->nHeight - 1, MIN_POSE_PROTO_VERSION);
 
-    // Need LOCK2 here to ensure consistent locking order because the SendVerifyRequest call below locks cs_main
-    // through GetHeight() signal in ConnectNode
-    LOCK2(cs_main, cs);
-
-    int nCount = 0;
+    // connections are made by the connection pool thread, nothing below needs cs_main
+    LOCK(cs);
 
     int nMyRank = -1;
     int nRanksTotal = (int)vecMasternodeRanks.size();
@@ -996,12 +1008,8 @@ void CMasternodeMan::DoFullVerificationStep()
     int nOffset = MAX_POSE_RANK + nMyRank - 1;
     if(nOffset >= (int)vecMasternodeRanks.size()) return;
 
-    std::vector<CMasternode*> vSortedByAddr;
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        vSortedByAddr.push_back(&mn);
-    }
-
-    sort(vSortedByAddr.begin(), vSortedByAddr.end(), CompareByAddr());
+    listVerifyCandidates.clear();
+    nVerifyHeight = pCurrentBlockIndex->nHeight - 1;
 
     it = vecMasternodeRanks.begin() + nOffset;
     while(it != vecMasternodeRanks.end()) {
@@ -1016,18 +1024,22 @@ void CMasternodeMan::DoFullVerificationStep()
             it += MAX_POSE_CONNECTIONS;
             continue;
         }
-        LogPrint("masternode", "CMasternodeMan::DoFullVerificationStep -- Verifying masternode %s rank %d/%d address %s\n",
+        LogPrint("masternode", "CMasternodeMan::DoFullVerificationStep -- Candidate masternode %s rank %d/%d address %s\n",
                     it->second.vin.prevout.ToStringShort(), it->first, nRanksTotal, it->second.addr.ToString());
-        if(SendVerifyRequest((CAddress)it->second.addr, vSortedByAddr)) {
-            nCount++;
-            if(nCount >= MAX_POSE_CONNECTIONS) break;
-        }
+        listVerifyCandidates.push_back((CAddress)it->second.addr);
         nOffset += MAX_POSE_CONNECTIONS;
         if(nOffset >= (int)vecMasternodeRanks.size()) break;
         it += MAX_POSE_CONNECTIONS;
     }
 
-    LogPrint("masternode", "CMasternodeMan::DoFullVerificationStep -- Sent verification requests to %d masternodes\n", nCount);
+    // connect to up to MAX_POSE_CONNECTIONS candidates at once, every failed connect moves on to the next one
+    int nCount = 0;
+    while(nCount < MAX_POSE_CONNECTIONS && StartNextVerifyRequest()) {
+        nCount++;
+    }
+
+    LogPrint("masternode", "CMasternodeMan::DoFullVerificationStep -- Started verification of %d masternodes, %d more candidates\n",
+                nCount, (int)listVerifyCandidates.size());
 }
 
 // This function tries to find masternodes with the same addr,
@@ -1088,7 +1100,18 @@ void CMasternodeMan::CheckSameAddr()
     }
 }
 
-bool CMasternodeMan::SendVerifyRequest(const CAddress& addr, const std::vector<CMasternode*>& vSortedByAddr)
+bool CMasternodeMan::StartNextVerifyRequest()
+{
+    LOCK(cs);
+    while(!listVerifyCandidates.empty()) {
+        CAddress addr = listVerifyCandidates.front();
+        listVerifyCandidates.pop_front();
+        if(SendVerifyRequest(addr, nVerifyHeight)) return true;
+    }
+    return false;
+}
+
+bool CMasternodeMan::SendVerifyRequest(const CAddress& addr, int nBlockHeight)
 {
     if(netfulfilledman.HasFulfilledRequest(addr, strprintf("%s", NetMsgType::MNVERIFY)+"-request")) {
         // we already asked for verification, not a good idea to do this too often, skip it
@@ -1096,20 +1119,25 @@ bool CMasternodeMan::SendVerifyRequest(const CAddress& addr, const std::vector<C
         return false;
     }
 
-    CNode* pnode = ConnectNode(addr, NULL, true);
+    ConnectMasternodeAsync(addr, boost::bind(&CMasternodeMan::VerifyConnected, this, addr, nBlockHeight, _1));
+    return true;
+}
+
+void CMasternodeMan::VerifyConnected(const CAddress& addr, int nBlockHeight, CNode* pnode)
+{
     if(pnode == NULL) {
-        LogPrintf("CMasternodeMan::SendVerifyRequest -- can't connect to node to verify it, addr=%s\n", addr.ToString());
-        return false;
+        LogPrintf("CMasternodeMan::VerifyConnected -- can't connect to node to verify it, addr=%s\n", addr.ToString());
+        StartNextVerifyRequest();
+        return;
     }
 
+    LOCK(cs);
     netfulfilledman.AddFulfilledRequest(addr, strprintf("%s", NetMsgType::MNVERIFY)+"-request");
     // use random nonce, store it and require node to reply with correct one later
-    CMasternodeVerification mnv(addr, GetRandInt(999999), pCurrentBlockIndex->nHeight - 1);
+    CMasternodeVerification mnv(addr, GetRandInt(999999), nBlockHeight);
     mWeAskedForVerification[addr] = mnv;
-    LogPrintf("CMasternodeMan::SendVerifyRequest -- verifying node using nonce %d addr=%s\n", mnv.nonce, addr.ToString());
+    LogPrintf("CMasternodeMan::VerifyConnected -- verifying node using nonce %d addr=%s\n", mnv.nonce, addr.ToString());
     pnode->PushMessage(NetMsgType::MNVERIFY, mnv);
-
-    return true;
 }
 
 void CMasternodeMan::SendVerifyReply(CNode* pnode, CMasternodeVerification& mnv)
@@ -128,6 +128,9 @@ private:
     std::map<COutPoint, std::map<CNetAddr, int64_t> > mWeAskedForMasternodeListEntry;
     // who we asked for the masternode verification
     std::map<CNetAddr, CMasternodeVerification> mWeAskedForVerification;
+    // masternodes left to verify this round, tried as earlier connects fail
+    std::list<CAddress> listVerifyCandidates;
+    int nVerifyHeight;
 
     // these maps are used for masternode recovery from MASTERNODE_NEW_START_REQUIRED state
     std::map<uint256, std::pair< int64_t, std::set<CNetAddr> > > mMnbRecoveryRequests;
@@ -280,6 +283,8 @@ public:
     }
 
     bool Has(const CTxIn& vin);
+    /// Whether any masternode in the list runs on this IP
+    bool Has(const CNetAddr& addr);
 
     masternode_info_t GetMasternodeInfo(const CTxIn& vin);
 
@@ -306,7 +311,9 @@ public:
 
     void DoFullVerificationStep();
     void CheckSameAddr();
-    bool SendVerifyRequest(const CAddress& addr, const std::vector<CMasternode*>& vSortedByAddr);
+    bool StartNextVerifyRequest();
+    bool SendVerifyRequest(const CAddress& addr, int nBlockHeight);
+    void VerifyConnected(const CAddress& addr, int nBlockHeight, CNode* pnode);
     void SendVerifyReply(CNode* pnode, CMasternodeVerification& mnv);
     void ProcessVerifyReply(CNode* pnode, CMasternodeVerification& mnv);
     void ProcessVerifyBroadcast(CNode* pnode, const CMasternodeVerification& mnv);
@@ -19,6 +19,7 @@
 #include "hash.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
+#include "socketevents.h"
 #include "ui_interface.h"
 #include "wallet/wallet.h"
 #include "utilstrencodings.h"
@@ -41,6 +42,7 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -69,6 +71,16 @@ using namespace std;
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 40;
     const int MAX_OUTBOUND_MASTERNODE_CONNECTIONS = 100;
+    // non-blocking connects ThreadMasternodeConnections keeps going at once
+    const size_t MAX_PENDING_MASTERNODE_CONNECTS = 16;
+    // 64KB reads per socket before ThreadSocketHandler moves on to the next one
+    const int MAX_SOCKET_READS_PER_WAKEUP = 4;
+    // idle receive buffers kept around for new messages, small payloads are cheap enough to allocate
+    const size_t MIN_RECV_BUFFER_POOL_ENTRY = 16 * 1024;
+    const size_t MAX_RECV_BUFFER_POOL_SIZE = 16 * 1024 * 1024;
+    const size_t MAX_RECV_BUFFER_POOL_COUNT = 32;
+    // payload memory committed ahead of what a peer has actually sent, whatever its header claims
+    const unsigned int RECV_ALLOCATION_STEP = 256 * 1024;
 
     struct ListenSocket {
         SOCKET socket;
@@ -90,6 +102,7 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+static CSocketEvents socketEvents;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
@@ -388,6 +401,54 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+// Look for an existing connection
+static CNode* FindConnectedNode(const CAddress& addrConnect, bool fConnectToMasternode)
+{
+    LOCK(cs_vNodes);
+    CNode* pnode = FindNode((CService)addrConnect);
+    if (pnode)
+    {
+        // we have existing connection to this node but it was not a connection to masternode,
+        // change flag and add reference so that we can correctly clear it later
+        if(fConnectToMasternode && !pnode->fMasternode) {
+            pnode->AddRef();
+            pnode->fMasternode = true;
+        }
+    }
+    return pnode;
+}
+
+// Wrap a connected socket into a node and start serving it
+static CNode* AddConnectedNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest, bool fConnectToMasternode)
+{
+    if (!IsSelectableSocket(hSocket)) {
+        LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
+        CloseSocket(hSocket);
+        return NULL;
+    }
+
+    addrman.Attempt(addrConnect);
+
+    // Add node
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false, true);
+    if (!socketEvents.Add(hSocket, pnode)) {
+        LogPrintf("Cannot create connection: failed to watch socket for peer=%d\n", pnode->id);
+        delete pnode;
+        return NULL;
+    }
+
+    pnode->nTimeConnected = GetTime();
+    if(fConnectToMasternode) {
+        pnode->AddRef();
+        pnode->fMasternode = true;
+    }
+
+    LOCK(cs_vNodes);
+    vNodes.push_back(pnode);
+
+    return pnode;
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fConnectToMasternode)
 {
     if (pszDest == NULL) {
@@ -396,19 +457,9 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fConnectToMas
         if (IsLocal(addrConnect) && !fConnectToMasternode)
             return NULL;
 
-        LOCK(cs_vNodes);
-        // Look for an existing connection
-        CNode* pnode = FindNode((CService)addrConnect);
+        CNode* pnode = FindConnectedNode(addrConnect, fConnectToMasternode);
         if (pnode)
-        {
-            // we have existing connection to this node but it was not a connection to masternode,
-            // change flag and add reference so that we can correctly clear it later
-            if(fConnectToMasternode && !pnode->fMasternode) {
-                pnode->AddRef();
-                pnode->fMasternode = true;
-            }
             return pnode;
-        }
     }
 
     /// debug print
@@ -422,27 +473,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fConnectToMas
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
-            LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
-            CloseSocket(hSocket);
-            return NULL;
-        }
-
-        addrman.Attempt(addrConnect);
-
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false, true);
-
-        pnode->nTimeConnected = GetTime();
-        if(fConnectToMasternode) {
-            pnode->AddRef();
-            pnode->fMasternode = true;
-        }
-
-        LOCK(cs_vNodes);
-        vNodes.push_back(pnode);
-
-        return pnode;
+        return AddConnectedNode(hSocket, addrConnect, pszDest, fConnectToMasternode);
     } else if (!proxyConnectionFailed) {
         // If connecting to the node failed, and failure is not caused by a problem connecting to
         // the proxy, mark this as an attempt.
@@ -458,6 +489,7 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        socketEvents.Remove(hSocket);
         CloseSocket(hSocket);
     }
 
@@ -668,9 +700,111 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_msgStats);
+        stats.mapMsgCmdStats = mapMsgCmdStats;
+    }
 }
 #undef X
 
+const std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
+
+const int64_t CNetMsgStats::PROCESS_TIME_BUCKET_LIMITS[CNetMsgStats::PROCESS_TIME_BUCKETS - 1] = {
+    100, 1000, 10000, 100000, 1000000
+};
+
+CNetMsgStats::CNetMsgStats()
+{
+    nMsgsSent = 0;
+    nBytesSent = 0;
+    nMsgsRecv = 0;
+    nBytesRecv = 0;
+    nMsgsProcessed = 0;
+    nProcessTime = 0;
+    nProcessTimeMax = 0;
+    for (int i = 0; i < PROCESS_TIME_BUCKETS; i++)
+        vProcessTimeHistogram[i] = 0;
+}
+
+void CNetMsgStats::RecordProcessTime(int64_t nMicros)
+{
+    nMsgsProcessed++;
+    nProcessTime += nMicros;
+    nProcessTimeMax = std::max(nProcessTimeMax, nMicros);
+    int nBucket = 0;
+    while (nBucket < PROCESS_TIME_BUCKETS - 1 && nMicros >= PROCESS_TIME_BUCKET_LIMITS[nBucket])
+        nBucket++;
+    vProcessTimeHistogram[nBucket]++;
+}
+
+CNetMsgStats& CNetMsgStats::operator+=(const CNetMsgStats& other)
+{
+    nMsgsSent += other.nMsgsSent;
+    nBytesSent += other.nBytesSent;
+    nMsgsRecv += other.nMsgsRecv;
+    nBytesRecv += other.nBytesRecv;
+    nMsgsProcessed += other.nMsgsProcessed;
+    nProcessTime += other.nProcessTime;
+    nProcessTimeMax = std::max(nProcessTimeMax, other.nProcessTimeMax);
+    for (int i = 0; i < PROCESS_TIME_BUCKETS; i++)
+        vProcessTimeHistogram[i] += other.vProcessTimeHistogram[i];
+    return *this;
+}
+
+// Totals of the peers which are gone already
+static CCriticalSection cs_mapNetMsgStatsRetired;
+static mapMsgCmdStats_t mapNetMsgStatsRetired;
+
+void GetNetMsgStats(mapMsgCmdStats_t& mapStatsRet)
+{
+    {
+        LOCK(cs_mapNetMsgStatsRetired);
+        mapStatsRet = mapNetMsgStatsRetired;
+    }
+
+    std::vector<CNode*> vNodesCopy = CopyNodeVector();
+    BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+        LOCK(pnode->cs_msgStats);
+        for (mapMsgCmdStats_t::const_iterator it = pnode->mapMsgCmdStats.begin(); it != pnode->mapMsgCmdStats.end(); ++it)
+            mapStatsRet[it->first] += it->second;
+    }
+    ReleaseNodeVector(vNodesCopy);
+}
+
+// The map is filled for all commands when the node is created and never
+// grows, so the lookup is cheap and garbage commands can't blow it up.
+static CNetMsgStats& GetMsgCmdStats(mapMsgCmdStats_t& mapStats, const std::string& strCommand)
+{
+    mapMsgCmdStats_t::iterator it = mapStats.find(strCommand);
+    if (it == mapStats.end())
+        it = mapStats.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(it != mapStats.end());
+    return it->second;
+}
+
+void CNode::RecordMsgSent(const std::string& strCommand, uint64_t nBytes)
+{
+    LOCK(cs_msgStats);
+    CNetMsgStats& stats = GetMsgCmdStats(mapMsgCmdStats, strCommand);
+    stats.nMsgsSent++;
+    stats.nBytesSent += nBytes;
+}
+
+void CNode::RecordMsgRecv(const std::string& strCommand, uint64_t nBytes)
+{
+    LOCK(cs_msgStats);
+    CNetMsgStats& stats = GetMsgCmdStats(mapMsgCmdStats, strCommand);
+    stats.nMsgsRecv++;
+    stats.nBytesRecv += nBytes;
+}
+
+void CNode::RecordMsgProcessTime(const std::string& strCommand, int64_t nMicros)
+{
+    LOCK(cs_msgStats);
+    GetMsgCmdStats(mapMsgCmdStats, strCommand).RecordProcessTime(nMicros);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -703,6 +837,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            RecordMsgRecv(msg.hdr.GetCommand(), msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE);
             messageHandlerCondition.notify_one();
         }
     }
@@ -710,6 +845,85 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+char* CNode::GetRecvBuffer(unsigned int& nSizeRet)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+    return vRecvMsg.back().GetDataBuffer(nSizeRet);
+}
+
+void CNode::CommitRecvBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.CommitData(nBytes);
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        RecordMsgRecv(msg.hdr.GetCommand(), msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE);
+        messageHandlerCondition.notify_one();
+    }
+}
+
+namespace {
+
+/**
+ * Payload buffers of processed messages, handed out again to new messages so
+ * that their data is received into memory which is already allocated.
+ */
+class CRecvBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vBuffers;
+    size_t nPooledBytes;
+
+public:
+    CRecvBufferPool() : nPooledBytes(0) {}
+
+    /** Swap the smallest pooled buffer with room for nSize bytes into bufRet, or the largest one we have */
+    void Get(CSerializeData& bufRet, size_t nSize)
+    {
+        LOCK(cs);
+        if (vBuffers.empty())
+            return;
+        size_t nBest = 0;
+        for (size_t i = 1; i < vBuffers.size(); i++) {
+            bool fFits = vBuffers[i].capacity() >= nSize;
+            bool fBestFits = vBuffers[nBest].capacity() >= nSize;
+            if (fFits ? (!fBestFits || vBuffers[i].capacity() < vBuffers[nBest].capacity())
+                      : (!fBestFits && vBuffers[i].capacity() > vBuffers[nBest].capacity()))
+                nBest = i;
+        }
+        bufRet.swap(vBuffers[nBest]);
+        nPooledBytes -= bufRet.capacity();
+        vBuffers[nBest].swap(vBuffers.back());
+        vBuffers.pop_back();
+    }
+
+    void Release(CSerializeData& buf)
+    {
+        if (buf.capacity() < MIN_RECV_BUFFER_POOL_ENTRY || buf.capacity() > MAX_PROTOCOL_MESSAGE_LENGTH)
+            return;
+        LOCK(cs);
+        if (nPooledBytes + buf.capacity() > MAX_RECV_BUFFER_POOL_SIZE || vBuffers.size() >= MAX_RECV_BUFFER_POOL_COUNT)
+            return;
+        buf.clear();
+        nPooledBytes += buf.capacity();
+        vBuffers.push_back(CSerializeData());
+        vBuffers.back().swap(buf);
+    }
+};
+
+CRecvBufferPool recvBufferPool;
+
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData buf;
+    vRecv.SwapData(buf);
+    recvBufferPool.Release(buf);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -738,6 +952,18 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Start from a pooled buffer where possible. Only the first step is reserved,
+    // the header alone doesn't earn a peer an allocation of the full claimed size.
+    // Oversized messages get the peer disconnected, don't bother with those.
+    if (hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH) {
+        if (hdr.nMessageSize >= MIN_RECV_BUFFER_POOL_ENTRY) {
+            CSerializeData buf;
+            recvBufferPool.Get(buf, hdr.nMessageSize);
+            vRecv.SwapData(buf);
+        }
+        vRecv.reserve(std::min(hdr.nMessageSize, RECV_ALLOCATION_STEP));
+    }
+
     return nCopy;
 }
 
@@ -748,15 +974,44 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + RECV_ALLOCATION_STEP));
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    CommitData(nCopy);
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nSizeRet)
+{
+    if (!in_data || complete())
+        return NULL;
+
+    if (vRecv.size() == nDataPos) {
+        // Same 256 KiB steps as readData
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + RECV_ALLOCATION_STEP));
+    }
+
+    nSizeRet = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+void CNetMessage::CommitData(unsigned int nBytes)
+{
+    // hash while the data is still in cache rather than in a second pass over the whole message
+    hasher.Write((const unsigned char*)&vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+}
+
+const uint256& CNetMessage::GetMessageHash()
+{
+    assert(complete());
+    if (data_hash.IsNull())
+        hasher.Finalize(data_hash.begin());
+    return data_hash;
+}
+
 
 
 
@@ -1003,6 +1258,11 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
 
     CNode* pnode = new CNode(hSocket, addr, "", true);
     pnode->fWhitelisted = whitelisted;
+    if (!socketEvents.Add(hSocket, pnode)) {
+        LogPrintf("connection from %s dropped: failed to watch socket\n", addr.ToString());
+        delete pnode;
+        return;
+    }
 
     LogPrint("net", "connection from %s accepted\n", addr.ToString());
 
@@ -1012,9 +1272,163 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+/**
+ * Level-triggered backends report whatever is ready at the time of the wait,
+ * so tell them what we want from each socket:
+ * * If there is data to send, wait for sending data. As this only
+ *   happens when optimistic write failed, we choose to first drain the
+ *   write buffer in this case before receiving more. This avoids
+ *   needlessly queueing received data, if the remote peer is not themselves
+ *   receiving data. This means properly utilizing TCP flow control signalling.
+ * * Otherwise, if there is no (complete) message in the receive buffer,
+ *   or there is space left in the buffer, wait for receiving data.
+ * * (if neither of the above applies, there is certainly one message
+ *   in the receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * * We send some data.
+ * * We wait for data to be received (and disconnect after timeout).
+ * * We process a message in the buffer (message handler thread).
+ */
+static void SetLevelTriggeredInterest()
+{
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+
+        int nInterest = 0;
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && !pnode->vSendMsg.empty())
+                nInterest = CSocketEvents::SOCKET_EVENT_WRITE;
+        }
+        if (nInterest == 0)
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv && (
+                pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                nInterest = CSocketEvents::SOCKET_EVENT_READ;
+        }
+        socketEvents.SetInterest(pnode->hSocket, nInterest);
+    }
+}
+
+/**
+ * Act on the readiness in nEvents: flush the send queue first, then read
+ * until the socket would block or the receive buffer is full, following the
+ * same flow control rules as SetLevelTriggeredInterest. Handled events are
+ * cleared from nEvents. Returns true if some of them are left over, i.e.
+ * the node has to be looked at again without waiting for a new event.
+ */
+static bool SocketServiceEvents(CNode* pnode, int& nEvents, bool& fMoreWork)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+
+    //
+    // Send
+    //
+    bool fSendPending = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            if (!pnode->vSendMsg.empty() && (nEvents & (CSocketEvents::SOCKET_EVENT_WRITE | CSocketEvents::SOCKET_EVENT_ERROR)))
+                SocketSendData(pnode);
+            // anything left means the socket is full again, a new edge follows once it drains
+            fSendPending = !pnode->vSendMsg.empty();
+            nEvents &= ~CSocketEvents::SOCKET_EVENT_WRITE;
+        }
+        else
+            fSendPending = (nEvents & CSocketEvents::SOCKET_EVENT_WRITE) != 0;
+    }
+
+    //
+    // Receive
+    //
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+    if ((nEvents & (CSocketEvents::SOCKET_EVENT_READ | CSocketEvents::SOCKET_EVENT_ERROR)) && !fSendPending)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            for (int nReads = 0; ; nReads++)
+            {
+                if (!(pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                      pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    break; // wait for the message handler to catch up
+                if (nReads == MAX_SOCKET_READS_PER_WAKEUP)
+                {
+                    // let the other sockets have a turn, but come back right away
+                    fMoreWork = true;
+                    break;
+                }
+
+                // typical socket buffer is 8K-64K
+                char pchBuf[0x10000];
+                // in the middle of a payload, receive straight into the message
+                unsigned int nDirect = 0;
+                char* pchDirect = pnode->GetRecvBuffer(nDirect);
+                int nBytes = pchDirect ? recv(pnode->hSocket, pchDirect, nDirect, MSG_DONTWAIT)
+                                       : recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                if (nBytes > 0)
+                {
+                    if (pchDirect)
+                        pnode->CommitRecvBytes(nBytes);
+                    else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                        pnode->CloseSocketDisconnect();
+                    pnode->nLastRecv = GetTime();
+                    pnode->nRecvBytes += nBytes;
+                    pnode->RecordBytesRecv(nBytes);
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        return false;
+                }
+                else if (nBytes == 0)
+                {
+                    // socket closed gracefully
+                    if (!pnode->fDisconnect)
+                        LogPrint("net", "socket closed\n");
+                    pnode->CloseSocketDisconnect();
+                    return false;
+                }
+                else
+                {
+                    // error
+                    int nErr = WSAGetLastError();
+                    if (nErr == WSAEWOULDBLOCK)
+                    {
+                        // drained, wait for the next edge
+                        nEvents &= ~(CSocketEvents::SOCKET_EVENT_READ | CSocketEvents::SOCKET_EVENT_ERROR);
+                        break;
+                    }
+                    if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                    {
+                        if (!pnode->fDisconnect)
+                            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                        pnode->CloseSocketDisconnect();
+                        return false;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    return nEvents != 0;
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    // readiness reported by socketEvents and not used up yet, each node in here holds a reference
+    std::map<CNode*, int> mapPendingEvents;
+    std::vector<CSocketEvents::Event> vEvents;
+    bool fMoreWork = false;
+    int64_t nLastInactivityCheck = 0;
     while (true)
     {
         //
@@ -1086,167 +1500,85 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
+        if (!socketEvents.IsEdgeTriggered())
+            SetLevelTriggeredInterest();
+
         //
-        // Find which sockets have data to receive
+        // Wait for socket events
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
+        // frequency to poll for disconnects and the interest of level-triggered backends
+        int64_t nWaitMillis = fMoreWork ? 0 : 50;
+        fMoreWork = false;
+        if (!socketEvents.Wait(vEvents, nWaitMillis))
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            LogPrintf("socket %s error %s\n", socketEvents.GetBackendName(), NetworkErrorString(WSAGetLastError()));
+            MilliSleep(nWaitMillis);
         }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+        BOOST_FOREACH(const CSocketEvents::Event& event, vEvents)
         {
-            if (have_fds)
+            //
+            // Accept new connections
+            //
+            if (event.pdata == NULL)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                    if (hListenSocket.socket == event.hSocket)
+                        AcceptConnection(hListenSocket);
+                continue;
+            }
+
+            CNode* pnode = (CNode*)event.pdata;
+            std::map<CNode*, int>::iterator it = mapPendingEvents.find(pnode);
+            if (it == mapPendingEvents.end()) {
+                pnode->AddRef();
+                mapPendingEvents.insert(std::make_pair(pnode, event.nEvents));
+            } else {
+                it->second |= event.nEvents;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
         //
-        // Accept new connections
+        // Service each socket with pending events
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        std::map<CNode*, int>::iterator it = mapPendingEvents.begin();
+        while (it != mapPendingEvents.end())
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = it->first;
+            if (SocketServiceEvents(pnode, it->second, fMoreWork) && socketEvents.IsEdgeTriggered()) {
+                // edge-triggered readiness is not reported again, keep it until it is used up
+                ++it;
+            } else {
+                pnode->Release();
+                mapPendingEvents.erase(it++);
             }
         }
 
         //
-        // Service each socket
+        // Inactivity checking
         //
+        int64_t nTime = GetTime();
+        if (nTime == nLastInactivityCheck)
+            continue;
+        nLastInactivityCheck = nTime;
+
         vector<CNode*> vNodesCopy = CopyNodeVector();
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            boost::this_thread::interruption_point();
-
-            //
-            // Receive
-            //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            // safety net for a missed edge, normally writes are driven by the socket becoming writable
+            if (socketEvents.IsEdgeTriggered())
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend && !pnode->vSendMsg.empty())
                     SocketSendData(pnode);
             }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
             if (nTime - pnode->nTimeConnected > 60)
             {
                 if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
@@ -1457,10 +1789,17 @@ void ThreadDNSAddressSeed()
 
 void DumpAddresses()
 {
+    // peers.dat is written as a whole, skip it if nothing changed since the last time
+    static uint64_t nLastChangeCount = std::numeric_limits<uint64_t>::max();
+    uint64_t nChangeCount = addrman.GetChangeCount();
+    if (nChangeCount == nLastChangeCount)
+        return;
+
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (adb.Write(addrman))
+        nLastChangeCount = nChangeCount;
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1665,47 +2004,213 @@ void ThreadOpenAddedConnections()
     }
 }
 
-void ThreadMnbRequestConnections()
+//
+// Masternode connection pool
+//
+// Verification and mnb recovery connect to many masternodes which are not connected yet.
+// Instead of a blocking connect each, ThreadMasternodeConnections keeps up to
+// MAX_PENDING_MASTERNODE_CONNECTS non-blocking connects in flight and hands the resulting
+// node to the requester. Connections through a proxy still block, the SOCKS5 handshake
+// isn't done asynchronously.
+//
+
+struct CMasternodeConnectRequest
 {
-    // Connecting to specific addresses, no masternode connections available
-    if (mapArgs.count("-connect") && mapMultiArgs["-connect"].size() > 0)
-        return;
+    CAddress addr;
+    MasternodeConnectedCallback callback;
+};
 
-    while (true)
-    {
-        MilliSleep(1000);
+struct CPendingMasternodeConnect
+{
+    CMasternodeConnectRequest request;
+    SOCKET hSocket;
+    int64_t nTimeout;
+    CSemaphoreGrant grant;
+};
 
-        CSemaphoreGrant grant(*semMasternodeOutbound);
-        boost::this_thread::interruption_point();
+static CCriticalSection cs_dqMasternodeConnectRequests;
+static std::deque<CMasternodeConnectRequest> dqMasternodeConnectRequests;
 
-        std::pair<CService, std::set<uint256> > p = mnodeman.PopScheduledMnbRequestConnection();
-        if(p.first == CService() || p.second.empty()) continue;
+void ConnectMasternodeAsync(const CAddress& addr, const MasternodeConnectedCallback& callback)
+{
+    CMasternodeConnectRequest request;
+    request.addr = addr;
+    request.callback = callback;
+    LOCK(cs_dqMasternodeConnectRequests);
+    dqMasternodeConnectRequests.push_back(request);
+}
 
-        CNode* pnode = NULL;
+static void RunMasternodeConnectedCallback(const CMasternodeConnectRequest& request, CNode* pnode)
+{
+    if (pnode)
+        pnode->AddRef();
+    try {
+        request.callback(pnode);
+    } catch (const std::exception& e) {
+        PrintExceptionContinue(&e, "RunMasternodeConnectedCallback()");
+    }
+    if (pnode)
+        pnode->Release();
+}
+
+void ThreadMasternodeConnections()
+{
+    CSocketEvents pendingEvents;
+    if (!pendingEvents.Init())
+        return;
+
+    std::map<SOCKET, CPendingMasternodeConnect*> mapPending;
+    std::vector<CSocketEvents::Event> vEvents;
+
+    try {
+        while (true)
         {
-            LOCK2(cs_main, cs_vNodes);
-            pnode = ConnectNode(CAddress(p.first), NULL, true);
-            if(!pnode) continue;
-            pnode->AddRef();
-        }
+            // start new connects while there is room
+            while (mapPending.size() < MAX_PENDING_MASTERNODE_CONNECTS) {
+                CSemaphoreGrant grant(*semMasternodeOutbound, true);
+                if (!grant)
+                    break;
+
+                CMasternodeConnectRequest request;
+                {
+                    LOCK(cs_dqMasternodeConnectRequests);
+                    if (dqMasternodeConnectRequests.empty())
+                        break;
+                    request = dqMasternodeConnectRequests.front();
+                    dqMasternodeConnectRequests.pop_front();
+                }
+
+                CNode* pnode = FindConnectedNode(request.addr, true);
+                if (pnode) {
+                    RunMasternodeConnectedCallback(request, pnode);
+                    continue;
+                }
 
-        grant.MoveTo(pnode->grantMasternodeOutbound);
+                proxyType proxy;
+                if (GetProxy(request.addr.GetNetwork(), proxy)) {
+                    pnode = ConnectNode(request.addr, NULL, true);
+                    if (pnode)
+                        grant.MoveTo(pnode->grantMasternodeOutbound);
+                    RunMasternodeConnectedCallback(request, pnode);
+                    continue;
+                }
 
-        // compile request vector
-        std::vector<CInv> vToFetch;
-        std::set<uint256>::iterator it = p.second.begin();
-        while(it != p.second.end()) {
-            if(*it != uint256()) {
-                vToFetch.push_back(CInv(MSG_MASTERNODE_ANNOUNCE, *it));
-                LogPrint("masternode", "ThreadMnbRequestConnections -- asking for mnb %s from addr=%s\n", it->ToString(), p.first.ToString());
+                LogPrint("net", "trying masternode connection %s\n", request.addr.ToString());
+                SOCKET hSocket;
+                if (!StartConnectSocket(request.addr, hSocket)) {
+                    addrman.Attempt(request.addr);
+                    RunMasternodeConnectedCallback(request, NULL);
+                    continue;
+                }
+                if (!IsSelectableSocket(hSocket) || !pendingEvents.Add(hSocket, NULL)) {
+                    LogPrintf("ThreadMasternodeConnections -- can't watch socket for %s\n", request.addr.ToString());
+                    CloseSocket(hSocket);
+                    RunMasternodeConnectedCallback(request, NULL);
+                    continue;
+                }
+                pendingEvents.SetInterest(hSocket, CSocketEvents::SOCKET_EVENT_WRITE);
+
+                CPendingMasternodeConnect* pconnect = new CPendingMasternodeConnect();
+                pconnect->request = request;
+                pconnect->hSocket = hSocket;
+                pconnect->nTimeout = GetTimeMillis() + nConnectTimeout;
+                grant.MoveTo(pconnect->grant);
+                mapPending[hSocket] = pconnect;
             }
-            ++it;
+
+            // this also sleeps when nothing is in flight, new requests are picked up on the next round
+            if (!pendingEvents.Wait(vEvents, 100))
+                MilliSleep(100);
+            boost::this_thread::interruption_point();
+
+            // writable or failed sockets first, then the ones which ran out of time
+            std::vector<std::pair<CPendingMasternodeConnect*, bool> > vDone;
+            BOOST_FOREACH(const CSocketEvents::Event& event, vEvents) {
+                std::map<SOCKET, CPendingMasternodeConnect*>::iterator it = mapPending.find(event.hSocket);
+                if (it == mapPending.end())
+                    continue;
+                vDone.push_back(std::make_pair(it->second, false));
+                mapPending.erase(it);
+            }
+            int64_t nNow = GetTimeMillis();
+            for (std::map<SOCKET, CPendingMasternodeConnect*>::iterator it = mapPending.begin(); it != mapPending.end(); ) {
+                if (it->second->nTimeout <= nNow) {
+                    vDone.push_back(std::make_pair(it->second, true));
+                    mapPending.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+
+            for (size_t i = 0; i < vDone.size(); i++) {
+                CPendingMasternodeConnect* pconnect = vDone[i].first;
+                const CAddress& addr = pconnect->request.addr;
+                pendingEvents.Remove(pconnect->hSocket);
+
+                CNode* pnode = NULL;
+                if (vDone[i].second) {
+                    LogPrint("net", "connection to %s timeout\n", addr.ToString());
+                    CloseSocket(pconnect->hSocket);
+                    addrman.Attempt(addr);
+                } else if (FinishConnectSocket(addr, pconnect->hSocket)) {
+                    pnode = AddConnectedNode(pconnect->hSocket, addr, NULL, true);
+                    if (pnode)
+                        pconnect->grant.MoveTo(pnode->grantMasternodeOutbound);
+                } else {
+                    addrman.Attempt(addr);
+                }
+                RunMasternodeConnectedCallback(pconnect->request, pnode);
+                delete pconnect;
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        for (std::map<SOCKET, CPendingMasternodeConnect*>::iterator it = mapPending.begin(); it != mapPending.end(); ++it) {
+            SOCKET hSocket = it->first;
+            pendingEvents.Remove(hSocket);
+            CloseSocket(hSocket);
+            delete it->second;
         }
+        throw;
+    }
+}
 
-        // ask for data
-        pnode->PushMessage(NetMsgType::GETDATA, vToFetch);
+static void RequestMnbs(const CService& addr, const std::set<uint256>& setHashes, CNode* pnode)
+{
+    if (!pnode)
+        return;
 
-        pnode->Release();
+    // compile request vector
+    std::vector<CInv> vToFetch;
+    std::set<uint256>::const_iterator it = setHashes.begin();
+    while(it != setHashes.end()) {
+        if(*it != uint256()) {
+            vToFetch.push_back(CInv(MSG_MASTERNODE_ANNOUNCE, *it));
+            LogPrint("masternode", "ThreadMnbRequestConnections -- asking for mnb %s from addr=%s\n", it->ToString(), addr.ToString());
+        }
+        ++it;
+    }
+
+    // ask for data
+    pnode->PushMessage(NetMsgType::GETDATA, vToFetch);
+}
+
+void ThreadMnbRequestConnections()
+{
+    // Connecting to specific addresses, no masternode connections available
+    if (mapArgs.count("-connect") && mapMultiArgs["-connect"].size() > 0)
+        return;
+
+    while (true)
+    {
+        MilliSleep(1000);
+        boost::this_thread::interruption_point();
+
+        // the connection pool connects to several masternodes at once, hand it everything scheduled
+        while (true) {
+            std::pair<CService, std::set<uint256> > p = mnodeman.PopScheduledMnbRequestConnection();
+            if(p.first == CService() || p.second.empty()) break;
+            ConnectMasternodeAsync(CAddress(p.first), boost::bind(&RequestMnbs, p.first, p.second, _1));
+        }
     }
 }
 
@@ -1763,7 +2268,7 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->fDisconnect = true;
 
-                    if (pnode->nSendSize < SendBufferSize())
+                    if (pnode->nSendSize < SendBufferSize() && pnode->nProcessQueueSize < ReceiveFloodSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
@@ -1944,8 +2449,12 @@ void static Discover(boost::thread_group& threadGroup)
 #endif
 }
 
-void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
+bool StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 {
+    // without it no connection would ever be serviced
+    if (!socketEvents.Init())
+        return false;
+
     uiInterface.InitMessage(_("Loading addresses..."));
     // Load addresses for peers.dat
     int64_t nStart = GetTimeMillis();
@@ -1969,6 +2478,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
            addrman.size(), GetTimeMillis() - nStart);
     fAddressesInitialized = true;
 
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (!socketEvents.Add(hListenSocket.socket, NULL, true))
+            LogPrintf("StartNode -- can't watch listening socket, no inbound connections will be accepted on it\n");
+
     if (semOutbound == NULL) {
         // initialize semaphore
         int nMaxOutbound = min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections);
@@ -2008,12 +2521,15 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Initiate masternode connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "mnbcon", &ThreadMnbRequestConnections));
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "mncon", &ThreadMasternodeConnections));
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
+
+    return true;
 }
 
 bool StopNode()
@@ -2119,8 +2635,10 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         mapRelay.insert(std::make_pair(inv, ss));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
+    // Only queue the inv here, SendMessages batches the queues per peer.
+    // Don't hold cs_vNodes while doing so, filter matching can take a while.
+    std::vector<CNode*> vNodesCopy = CopyNodeVector();
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
     {
         if(!pnode->fRelayTxes)
             continue;
@@ -2132,13 +2650,15 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         } else
             pnode->PushInventory(inv);
     }
+    ReleaseNodeVector(vNodesCopy);
 }
 
 void RelayInv(CInv &inv, const int minProtoVersion) {
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
+    std::vector<CNode*> vNodesCopy = CopyNodeVector();
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
         if(pnode->nVersion >= minProtoVersion)
             pnode->PushInventory(inv);
+    ReleaseNodeVector(vNodesCopy);
 }
 
 void CNode::RecordBytesRecv(uint64_t bytes)
@@ -2349,13 +2869,14 @@ bool CAddrDB::Read(CAddrMan& addr)
     // Don't try to resize to a negative number if file is small
     if (fileSize >= sizeof(uint256))
         dataSize = fileSize - sizeof(uint256);
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
+    // read straight into the stream, the table can be several megabytes
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers.resize(dataSize);
     uint256 hashIn;
 
     // read data and checksum from file
     try {
-        filein.read((char *)&vchData[0], dataSize);
+        filein.read((char *)&ssPeers[0], dataSize);
         filein >> hashIn;
     }
     catch (const std::exception& e) {
@@ -2363,8 +2884,6 @@ bool CAddrDB::Read(CAddrMan& addr)
     }
     filein.fclose();
 
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
-
     // verify stored checksum matches input data
     uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
     if (hashIn != hashTmp)
@@ -2421,6 +2940,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fDisconnect = false;
     nRefCount = 0;
     nSendSize = 0;
+    nProcessQueueSize = 0;
     nSendOffset = 0;
     hashContinue = uint256();
     nStartingHeight = -1;
@@ -2438,6 +2958,9 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fMasternode = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
     vchKeyedNetGroup = CalculateKeyedNetGroup(addr);
+    BOOST_FOREACH(const std::string &msg, getAllNetMessageTypes())
+        mapMsgCmdStats[msg] = CNetMsgStats();
+    mapMsgCmdStats[NET_MESSAGE_COMMAND_OTHER] = CNetMsgStats();
 
     {
         LOCK(cs_nLastNodeId);
@@ -2461,11 +2984,18 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
 
 CNode::~CNode()
 {
+    socketEvents.Remove(hSocket);
     CloseSocket(hSocket);
 
     if (pfilter)
         delete pfilter;
 
+    {
+        LOCK(cs_mapNetMsgStatsRetired);
+        for (mapMsgCmdStats_t::const_iterator it = mapMsgCmdStats.begin(); it != mapMsgCmdStats.end(); ++it)
+            mapNetMsgStatsRetired[it->first] += it->second;
+    }
+
     GetNodeSignals().FinalizeNode(GetId());
 }
 
@@ -2564,6 +3094,9 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
+    const char* pszCommand = &ssSend[MESSAGE_START_SIZE];
+    RecordMsgSent(std::string(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE)), ssSend.size());
+
     std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
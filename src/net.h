@@ -8,6 +8,7 @@
 
 #include "bloom.h"
 #include "compat.h"
+#include "hash.h"
 #include "limitedmap.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -17,6 +18,7 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -26,6 +28,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -89,10 +92,17 @@ CNode* FindNode(const CService& ip);
 // and/or you want it to be disconnected on CMasternodeMan::ProcessMasternodeConnections()
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest = NULL, bool fConnectToMasternode = false);
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+/** Called on the connection pool thread with the masternode's node, or NULL if connecting failed */
+typedef boost::function<void(CNode*)> MasternodeConnectedCallback;
+/**
+ * Connect to a masternode like ConnectNode(addr, NULL, true) does, without blocking the caller.
+ * The connect runs alongside others on the masternode connection pool thread.
+ */
+void ConnectMasternodeAsync(const CAddress& addr, const MasternodeConnectedCallback& callback);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
-void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
+bool StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
@@ -187,6 +197,37 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic and processing time of one message type, of one peer or of all peers */
+class CNetMsgStats
+{
+public:
+    //! Upper bounds (microseconds) of the processing time histogram buckets, the last bucket is open ended
+    static const int PROCESS_TIME_BUCKETS = 6;
+    static const int64_t PROCESS_TIME_BUCKET_LIMITS[PROCESS_TIME_BUCKETS - 1];
+
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    uint64_t nMsgsProcessed;
+    int64_t nProcessTime;       // total, microseconds
+    int64_t nProcessTimeMax;    // microseconds
+    uint64_t vProcessTimeHistogram[PROCESS_TIME_BUCKETS];
+
+    CNetMsgStats();
+
+    void RecordProcessTime(int64_t nMicros);
+    CNetMsgStats& operator+=(const CNetMsgStats& other);
+};
+
+/** Per command statistics, every known command is always present, unknown ones are counted as NET_MESSAGE_COMMAND_OTHER */
+typedef std::map<std::string, CNetMsgStats> mapMsgCmdStats_t;
+
+extern const std::string NET_MESSAGE_COMMAND_OTHER;
+
+/** Message statistics of all peers, including the ones already disconnected */
+void GetNetMsgStats(mapMsgCmdStats_t& mapStatsRet);
+
 class CNodeStats
 {
 public:
@@ -209,6 +250,7 @@ public:
     double dPingWait;
     double dPingMin;
     std::string addrLocal;
+    mapMsgCmdStats_t mapMsgCmdStats;
 };
 
 
@@ -224,6 +266,8 @@ public:
 
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
+    CHash256 hasher;                // double-SHA256 of the data received so far
+    uint256 data_hash;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
@@ -235,6 +279,8 @@ public:
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -250,6 +296,14 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Space in vRecv the payload can be received into directly, NULL if not in the middle of the payload */
+    char* GetDataBuffer(unsigned int& nSizeRet);
+    /** Account for nBytes received into the buffer returned by GetDataBuffer() */
+    void CommitData(unsigned int nBytes);
+
+    /** Double-SHA256 of the payload, only valid once the message is complete */
+    const uint256& GetMessageHash();
 };
 
 
@@ -331,6 +385,7 @@ public:
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    std::atomic<size_t> nProcessQueueSize; // total size of this peer's messages waiting for a message worker
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -399,6 +454,9 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
+    // Transaction ids still to announce, trickled out in batches by SendMessages
+    std::set<uint256> setInventoryTxToSend;
+    // Other inventory still to announce, sent on the next SendMessages pass
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
@@ -422,6 +480,10 @@ public:
 
     std::vector<unsigned char> vchKeyedNetGroup;
 
+    // Per command traffic and processing time, see CNetMsgStats
+    CCriticalSection cs_msgStats;
+    mapMsgCmdStats_t mapMsgCmdStats;
+
     CNode(SOCKET hSocketIn, const CAddress &addrIn, const std::string &addrNameIn = "", bool fInboundIn = false, bool fNetworkNodeIn = false);
     ~CNode();
 
@@ -471,6 +533,15 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Buffer to receive the rest of the current message payload into without
+    // an extra copy, NULL when there is no partially received payload.
+    char* GetRecvBuffer(unsigned int& nSizeRet);
+
+    // requires LOCK(cs_vRecvMsg)
+    // Account for nBytes received into the buffer returned by GetRecvBuffer()
+    void CommitRecvBytes(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -527,8 +598,14 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (inv.type == MSG_TX && filterInventoryKnown.contains(inv.hash)) {
-                LogPrint("net", "PushInventory --  filtered inv: %s peer=%d\n", inv.ToString(), id);
+            if (inv.type == MSG_TX) {
+                if (filterInventoryKnown.contains(inv.hash)) {
+                    LogPrint("net", "PushInventory --  filtered inv: %s peer=%d\n", inv.ToString(), id);
+                    return;
+                }
+                // queued once no matter how often it is relayed before the next trickle
+                if (setInventoryTxToSend.insert(inv.hash).second)
+                    LogPrint("net", "PushInventory --  inv: %s peer=%d\n", inv.ToString(), id);
                 return;
             }
             LogPrint("net", "PushInventory --  inv: %s peer=%d\n", inv.ToString(), id);
@@ -797,6 +874,10 @@ public:
 
     void copyStats(CNodeStats &stats);
 
+    void RecordMsgSent(const std::string& strCommand, uint64_t nBytes);
+    void RecordMsgRecv(const std::string& strCommand, uint64_t nBytes);
+    void RecordMsgProcessTime(const std::string& strCommand, int64_t nMicros);
+
     static bool IsWhitelistedRange(const CNetAddr &ip);
     static void AddWhitelistedRange(const CSubNet &subnet);
 
@@ -865,6 +946,8 @@ public:
 };
 
 void DumpBanlist();
+//! Write peers.dat, unless addrman did not change since the last successful write
+void DumpAddresses();
 
 /** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
 int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
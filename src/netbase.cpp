@@ -266,11 +266,19 @@ bool static InterruptibleRecv(char* data, size_t len, int timeout, SOCKET& hSock
                 if (!IsSelectableSocket(hSocket)) {
                     return false;
                 }
+#ifdef USE_POLL
+                struct pollfd pfd;
+                pfd.fd = hSocket;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                int nRet = poll(&pfd, 1, std::min(endTime - curTime, maxWait));
+#else
                 struct timeval tval = MillisToTimeval(std::min(endTime - curTime, maxWait));
                 fd_set fdset;
                 FD_ZERO(&fdset);
                 FD_SET(hSocket, &fdset);
                 int nRet = select(hSocket + 1, &fdset, NULL, NULL, &tval);
+#endif
                 if (nRet == SOCKET_ERROR) {
                     return false;
                 }
@@ -426,7 +434,7 @@ static bool Socks5(const std::string& strDest, int port, const ProxyCgrowthtials
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet)
 {
     hSocketRet = INVALID_SOCKET;
 
@@ -455,8 +463,10 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
 #endif
 
     // Set to non-blocking
-    if (!SetSocketNonBlocking(hSocket, true))
-        return error("ConnectSocketDirectly: Setting socket to non-blocking failed, error %s\n", NetworkErrorString(WSAGetLastError()));
+    if (!SetSocketNonBlocking(hSocket, true)) {
+        CloseSocket(hSocket);
+        return error("StartConnectSocket: Setting socket to non-blocking failed, error %s\n", NetworkErrorString(WSAGetLastError()));
+    }
 
     if (connect(hSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR)
     {
@@ -464,40 +474,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
         {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
-                CloseSocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                LogPrintf("select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                CloseSocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
-#ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
-#else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
-#endif
-            {
-                LogPrintf("getsockopt() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                CloseSocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                LogPrintf("connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
-                CloseSocket(hSocket);
-                return false;
-            }
+            // under way, the socket becomes writable once it is done
         }
 #ifdef WIN32
         else if (WSAGetLastError() != WSAEISCONN)
@@ -515,6 +492,69 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
     return true;
 }
 
+bool FinishConnectSocket(const CService &addrConnect, SOCKET& hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
+#ifdef WIN32
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+#else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+#endif
+    {
+        LogPrintf("getsockopt() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+        CloseSocket(hSocket);
+        return false;
+    }
+    if (nRet != 0)
+    {
+        LogPrintf("connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
+        CloseSocket(hSocket);
+        return false;
+    }
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    hSocketRet = INVALID_SOCKET;
+
+    SOCKET hSocket;
+    if (!StartConnectSocket(addrConnect, hSocket))
+        return false;
+
+#ifdef USE_POLL
+    struct pollfd pfd;
+    pfd.fd = hSocket;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int nRet = poll(&pfd, 1, nTimeout);
+#else
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+#endif
+    if (nRet == 0)
+    {
+        LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
+        CloseSocket(hSocket);
+        return false;
+    }
+    if (nRet == SOCKET_ERROR)
+    {
+        LogPrintf("select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+        CloseSocket(hSocket);
+        return false;
+    }
+    if (!FinishConnectSocket(addrConnect, hSocket))
+        return false;
+
+    hSocketRet = hSocket;
+    return true;
+}
+
 bool SetProxy(enum Network net, const proxyType &addrProxy) {
     assert(net >= 0 && net < NET_MAX);
     if (!addrProxy.IsValid())
@@ -211,6 +211,13 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout, bool *outProxyConnectionFailed = 0);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault, int nTimeout, bool *outProxyConnectionFailed = 0);
+/**
+ * Start a non-blocking connect to addr without going through a proxy. Once hSocketRet
+ * becomes writable, FinishConnectSocket() tells whether it worked; both close the
+ * socket when they fail.
+ */
+bool StartConnectSocket(const CService &addr, SOCKET& hSocketRet);
+bool FinishConnectSocket(const CService &addr, SOCKET& hSocket);
 /** Return readable error string for a network error code */
 std::string NetworkErrorString(int err);
 /** Close socket and set hSocket to INVALID_SOCKET */
@@ -29,6 +29,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "stop", 0 },
     { "setmocktime", 0 },
     { "getaddednodeinfo", 0 },
+    { "getnetmsgstats", 0 },
     { "setgenerate", 0 },
     { "setgenerate", 1 },
     { "generate", 0 },
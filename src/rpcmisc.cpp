@@ -18,6 +18,7 @@
 #include "spork.h"
 #include "utilstrencodings.h"
 #ifdef ENABLE_WALLET
+#include "darksend.h"
 #include "masternode-sync.h"
 #include "wallet/wallet.h"
 #include "wallet/walletdb.h"
@@ -144,8 +145,9 @@ UniValue mnsync(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
         throw runtime_error(
-            "mnsync [status|next|reset]\n"
+            "mnsync [status|next|reset|maintenance]\n"
             "Returns the sync status, updates to the next step or resets it entirely.\n"
+            "\"maintenance\" shows how often and how long each periodic cleanup task ran.\n"
         );
 
     std::string strMode = params[0].get_str();
@@ -174,6 +176,27 @@ UniValue mnsync(const UniValue& params, bool fHelp)
         masternodeSync.Reset();
         return "success";
     }
+
+#ifdef ENABLE_WALLET
+    if(strMode == "maintenance")
+    {
+        std::vector<CMaintenanceTaskStats> vStats;
+        GetMaintenanceTaskStats(vStats);
+        UniValue objTasks(UniValue::VOBJ);
+        BOOST_FOREACH(const CMaintenanceTaskStats& stats, vStats) {
+            UniValue objTask(UniValue::VOBJ);
+            objTask.push_back(Pair("interval", stats.nInterval));
+            objTask.push_back(Pair("runs", stats.nRuns));
+            objTask.push_back(Pair("skipped", stats.nSkipped));
+            objTask.push_back(Pair("lastms", stats.nLastMicros * 0.001));
+            objTask.push_back(Pair("maxms", stats.nMaxMicros * 0.001));
+            objTask.push_back(Pair("avgms", stats.nRuns ? stats.nTotalMicros * 0.001 / stats.nRuns : 0.0));
+            objTask.push_back(Pair("lastrun", stats.nLastRunTime));
+            objTasks.push_back(Pair(stats.strName, objTask));
+        }
+        return objTasks;
+    }
+#endif // ENABLE_WALLET
     return "failure";
 }
 
@@ -570,6 +593,112 @@ bool timestampSort(std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> a,
     return a.second.time < b.second.time;
 }
 
+//! largest limit a paginated address query accepts
+static const int MAX_ADDRESS_PAGE_SIZE = 10000;
+
+/** Read the "limit" and "cursor" of a paginated address query, false if the whole result is wanted */
+bool getPageFromParams(const UniValue& params, size_t& nLimit, std::string& strCursor)
+{
+    if (!params[0].isObject())
+        return false;
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    if (limitValue.isNull())
+        return false;
+    int limit = limitValue.get_int();
+    if (limit <= 0 || limit > MAX_ADDRESS_PAGE_SIZE)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Limit is expected to be between 1 and %d", MAX_ADDRESS_PAGE_SIZE));
+    nLimit = limit;
+
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    if (!cursorValue.isNull())
+        strCursor = cursorValue.get_str();
+    return true;
+}
+
+/** A cursor is the hex encoded index key the next page starts at */
+template<typename Key>
+std::string encodeCursor(const Key& key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    return HexStr(ss.begin(), ss.end());
+}
+
+/** Decode a cursor and return the position of its address in addresses */
+template<typename Key>
+size_t decodeCursor(const std::string& strCursor, const std::vector<std::pair<uint160, int> >& addresses, Key& key)
+{
+    if (!IsHex(strCursor))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    try {
+        CDataStream ss(ParseHex(strCursor), SER_DISK, CLIENT_VERSION);
+        ss >> key;
+    } catch (const std::exception&) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    for (size_t n = 0; n < addresses.size(); n++)
+        if (addresses[n].first == key.hashBytes && (unsigned int)addresses[n].second == key.type)
+            return n;
+    throw JSONRPCError(RPC_INVALID_PARAMETER, "Cursor does not belong to the given addresses");
+}
+
+/**
+ * Read up to nLimit address index entries, address by address in the order
+ * given, continuing at strCursor. With fWholeTransactions the page runs past
+ * nLimit to the end of the transaction it stops in. Returns the cursor of the
+ * next page, or an empty string after the last one.
+ */
+std::string readAddressIndexPage(const std::vector<std::pair<uint160, int> >& addresses, int start, int end, size_t nLimit, bool fWholeTransactions,
+                                 const std::string& strCursor, std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex)
+{
+    if (start <= 0 || end <= 0) {
+        start = 0;
+        end = 0;
+    }
+
+    CAddressIndexKey keyStart;
+    size_t nFirst = strCursor.empty() ? 0 : decodeCursor(strCursor, addresses, keyStart);
+    for (size_t n = nFirst; n < addresses.size(); n++) {
+        if (n != nFirst || strCursor.empty())
+            keyStart = CAddressIndexKey(addresses[n].second, addresses[n].first, start, 0, uint256(), 0, false);
+        if (addressIndex.size() >= nLimit)
+            return encodeCursor(keyStart);
+
+        CAddressIndexKey keyNext;
+        bool fMore = false;
+        if (!GetAddressIndexPage(addresses[n].first, addresses[n].second, keyStart, end, nLimit - addressIndex.size(), fWholeTransactions, addressIndex, keyNext, fMore)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+        if (fMore)
+            return encodeCursor(keyNext);
+    }
+    return "";
+}
+
+/** Like readAddressIndexPage, for unspent outputs */
+std::string readAddressUnspentPage(const std::vector<std::pair<uint160, int> >& addresses, size_t nLimit,
+                                   const std::string& strCursor, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+{
+    CAddressUnspentKey keyStart;
+    size_t nFirst = strCursor.empty() ? 0 : decodeCursor(strCursor, addresses, keyStart);
+    for (size_t n = nFirst; n < addresses.size(); n++) {
+        if (n != nFirst || strCursor.empty())
+            keyStart = CAddressUnspentKey(addresses[n].second, addresses[n].first, uint256(), 0);
+        if (unspentOutputs.size() >= nLimit)
+            return encodeCursor(keyStart);
+
+        CAddressUnspentKey keyNext;
+        bool fMore = false;
+        if (!GetAddressUnspentPage(addresses[n].first, addresses[n].second, keyStart, nLimit - unspentOutputs.size(), unspentOutputs, keyNext, fMore)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+        if (fMore)
+            return encodeCursor(keyNext);
+    }
+    return "";
+}
+
 UniValue getaddressmempool(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -654,6 +783,8 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "      \"address\"  (string) The base58check encoded address\n"
             "      ,...\n"
             "    ]\n"
+            "  \"limit\" (number, optional) Return at most this many outputs, address by address in index order instead of by height\n"
+            "  \"cursor\" (string, optional) Continue where the previous page ended, with otherwise the same arguments\n"
             "}\n"
             "\nResult\n"
             "[\n"
@@ -666,6 +797,11 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "    \"satoshis\"  (number) The number of satoshis of the output\n"
             "  }\n"
             "]\n"
+            "\nResult (with limit)\n"
+            "{\n"
+            "  \"utxos\"  (array) The outputs as above\n"
+            "  \"cursor\"  (string) Pass this to get the next page, absent after the last one\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
             + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}")
@@ -677,15 +813,24 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
+    size_t nLimit = 0;
+    std::string strCursor;
+    std::string strNextCursor;
+    bool fPaged = getPageFromParams(params, nLimit, strCursor);
+
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    if (fPaged) {
+        strNextCursor = readAddressUnspentPage(addresses, nLimit, strCursor, unspentOutputs);
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
         }
-    }
 
-    std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+    }
 
     UniValue result(UniValue::VARR);
 
@@ -705,6 +850,14 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         result.push_back(output);
     }
 
+    if (fPaged) {
+        UniValue page(UniValue::VOBJ);
+        page.push_back(Pair("utxos", result));
+        if (!strNextCursor.empty())
+            page.push_back(Pair("cursor", strNextCursor));
+        return page;
+    }
+
     return result;
 }
 
@@ -723,6 +876,8 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Return at most this many deltas, address by address\n"
+            "  \"cursor\" (string, optional) Continue where the previous page ended, with otherwise the same arguments\n"
             "}\n"
             "\nResult:\n"
             "[\n"
@@ -734,6 +889,11 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    \"address\"  (string) The base58check encoded address\n"
             "  }\n"
             "]\n"
+            "\nResult (with limit):\n"
+            "{\n"
+            "  \"deltas\"  (array) The deltas as above\n"
+            "  \"cursor\"  (string) Pass this to get the next page, absent after the last one\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
             + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}")
@@ -760,16 +920,25 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
+    size_t nLimit = 0;
+    std::string strCursor;
+    std::string strNextCursor;
+    bool fPaged = getPageFromParams(params, nLimit, strCursor);
+
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    if (fPaged) {
+        strNextCursor = readAddressIndexPage(addresses, start, end, nLimit, false, strCursor, addressIndex);
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
             }
         }
     }
@@ -792,6 +961,14 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         result.push_back(delta);
     }
 
+    if (fPaged) {
+        UniValue page(UniValue::VOBJ);
+        page.push_back(Pair("deltas", result));
+        if (!strNextCursor.empty())
+            page.push_back(Pair("cursor", strNextCursor));
+        return page;
+    }
+
     return result;
 }
 
@@ -813,6 +990,7 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
             "{\n"
             "  \"balance\"  (string) The current balance in satoshis\n"
             "  \"received\"  (string) The total number of satoshis received (including change)\n"
+            "  \"txcount\"  (numeric) The number of transactions involving each address, summed over the addresses\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
@@ -825,27 +1003,24 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
-    }
-
     CAmount balance = 0;
     CAmount received = 0;
+    int64_t txcount = 0;
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if (it->second > 0) {
-            received += it->second;
+    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+        CAddressBalance addressBalance;
+        if (!GetAddressBalance((*it).first, (*it).second, addressBalance)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
-        balance += it->second;
+        balance += addressBalance.balance;
+        received += addressBalance.received;
+        txcount += addressBalance.txCount;
     }
 
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("balance", balance));
     result.push_back(Pair("received", received));
+    result.push_back(Pair("txcount", txcount));
 
     return result;
 
@@ -866,12 +1041,19 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Return the txids of this many index entries, address by address; a page runs past it to finish the last transaction\n"
+            "  \"cursor\" (string, optional) Continue where the previous page ended, with otherwise the same arguments\n"
             "}\n"
             "\nResult:\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nResult (with limit):\n"
+            "{\n"
+            "  \"txids\"  (array) The transaction ids, once per address\n"
+            "  \"cursor\"  (string) Pass this to get the next page, absent after the last one\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
             + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}")
@@ -894,16 +1076,25 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
+    size_t nLimit = 0;
+    std::string strCursor;
+    std::string strNextCursor;
+    bool fPaged = getPageFromParams(params, nLimit, strCursor);
+
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    if (fPaged) {
+        strNextCursor = readAddressIndexPage(addresses, start, end, nLimit, true, strCursor, addressIndex);
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
             }
         }
     }
@@ -915,7 +1106,7 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         int height = it->first.blockHeight;
         std::string txid = it->first.txhash.GetHex();
 
-        if (addresses.size() > 1) {
+        if (addresses.size() > 1 && !fPaged) {
             txids.insert(std::make_pair(height, txid));
         } else {
             if (txids.insert(std::make_pair(height, txid)).second) {
@@ -930,6 +1121,14 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
+    if (fPaged) {
+        UniValue page(UniValue::VOBJ);
+        page.push_back(Pair("txids", result));
+        if (!strNextCursor.empty())
+            page.push_back(Pair("cursor", strNextCursor));
+        return page;
+    }
+
     return result;
 
 }
@@ -79,6 +79,28 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+// Labels of CNetMsgStats::vProcessTimeHistogram, see CNetMsgStats::PROCESS_TIME_BUCKET_LIMITS
+static const char* const PROCESS_TIME_BUCKET_NAMES[CNetMsgStats::PROCESS_TIME_BUCKETS] = {
+    "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"
+};
+
+static UniValue NetMsgStatsToJSON(const CNetMsgStats& stats)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("msgssent", stats.nMsgsSent));
+    obj.push_back(Pair("bytessent", stats.nBytesSent));
+    obj.push_back(Pair("msgsrecv", stats.nMsgsRecv));
+    obj.push_back(Pair("bytesrecv", stats.nBytesRecv));
+    obj.push_back(Pair("processed", stats.nMsgsProcessed));
+    obj.push_back(Pair("processtime", stats.nProcessTime));
+    obj.push_back(Pair("processtimemax", stats.nProcessTimeMax));
+    UniValue histogram(UniValue::VOBJ);
+    for (int i = 0; i < CNetMsgStats::PROCESS_TIME_BUCKETS; i++)
+        histogram.push_back(Pair(PROCESS_TIME_BUCKET_NAMES[i], stats.vProcessTimeHistogram[i]));
+    obj.push_back(Pair("processtimehistogram", histogram));
+    return obj;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -112,7 +134,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"bytessent_per_msg\": {\n"
+            "       \"command\": n,           (numeric) The total bytes sent aggregated by message type, unused types are omitted\n"
+            "       ...\n"
+            "    },\n"
+            "    \"bytesrecv_per_msg\": {\n"
+            "       \"command\": n,           (numeric) The total bytes received aggregated by message type, unused types are omitted\n"
+            "       ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -167,6 +198,17 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
+        UniValue sendPerMsgCmd(UniValue::VOBJ);
+        UniValue recvPerMsgCmd(UniValue::VOBJ);
+        BOOST_FOREACH(const mapMsgCmdStats_t::value_type& i, stats.mapMsgCmdStats) {
+            if (i.second.nBytesSent)
+                sendPerMsgCmd.push_back(Pair(i.first, i.second.nBytesSent));
+            if (i.second.nBytesRecv)
+                recvPerMsgCmd.push_back(Pair(i.first, i.second.nBytesRecv));
+        }
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsgCmd));
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
+
         ret.push_back(obj);
     }
 
@@ -404,6 +446,66 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnetmsgstats ( nodeid )\n"
+            "\nReturns traffic and processing time per message type, for all peers since startup\n"
+            "or for a single connected peer. Message types that were never seen are omitted.\n"
+            "\nArguments:\n"
+            "1. nodeid     (numeric, optional) Only return the statistics of this peer (see getpeerinfo for ids)\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {\n"
+            "    \"msgssent\": n,            (numeric) Number of messages sent\n"
+            "    \"bytessent\": n,           (numeric) Bytes sent, including message headers\n"
+            "    \"msgsrecv\": n,            (numeric) Number of messages received\n"
+            "    \"bytesrecv\": n,           (numeric) Bytes received, including message headers\n"
+            "    \"processed\": n,           (numeric) Number of received messages that were processed\n"
+            "    \"processtime\": n,         (numeric) Total processing time in microseconds\n"
+            "    \"processtimemax\": n,      (numeric) Longest processing time in microseconds\n"
+            "    \"processtimehistogram\": { (json object) Number of messages per processing time bucket\n"
+            "      \"<100us\": n,\n"
+            "      ...\n"
+            "      \">=1s\": n\n"
+            "    }\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetmsgstats", "")
+            + HelpExampleCli("getnetmsgstats", "3")
+            + HelpExampleRpc("getnetmsgstats", "3")
+       );
+
+    mapMsgCmdStats_t mapStats;
+    if (params.size() > 0) {
+        NodeId nodeid = params[0].get_int();
+        vector<CNodeStats> vstats;
+        CopyNodeStats(vstats);
+        bool fFound = false;
+        BOOST_FOREACH(const CNodeStats& stats, vstats) {
+            if (stats.nodeid == nodeid) {
+                mapStats = stats.mapMsgCmdStats;
+                fFound = true;
+                break;
+            }
+        }
+        if (!fFound)
+            throw JSONRPCError(RPC_CLIENT_NODE_NOT_CONNECTED, "Node not found in connected nodes");
+    } else {
+        GetNetMsgStats(mapStats);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    BOOST_FOREACH(const mapMsgCmdStats_t::value_type& i, mapStats) {
+        if (i.second.nMsgsSent || i.second.nMsgsRecv || i.second.nMsgsProcessed)
+            ret.push_back(Pair(i.first, NetMsgStatsToJSON(i.second)));
+    }
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -270,6 +270,7 @@ static const CRPCCommand vRPCCommands[] =
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
     { "network",            "getconnectioncount",     &getconnectioncount,     true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
+    { "network",            "getnetmsgstats",         &getnetmsgstats,         true  },
     { "network",            "getpeerinfo",            &getpeerinfo,            true  },
     { "network",            "ping",                   &ping,                   true  },
     { "network",            "setban",                 &setban,                 true  },
@@ -0,0 +1,227 @@
+// Copyright (c) 2014-2018 The Growth Coin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "util.h"
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#ifdef USE_EPOLL
+// upper bound of events taken from the kernel per epoll_wait() call
+static const int MAX_EPOLL_EVENTS = 256;
+#endif
+
+CSocketEvents::CSocketEvents()
+{
+#ifdef USE_EPOLL
+    hEpoll = -1;
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        close(hEpoll);
+#endif
+}
+
+bool CSocketEvents::Init()
+{
+#ifdef USE_EPOLL
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+        return error("CSocketEvents::Init -- epoll_create1 failed: %s", NetworkErrorString(WSAGetLastError()));
+#endif
+    LogPrintf("CSocketEvents::Init -- using %s\n", GetBackendName());
+    return true;
+}
+
+const char* CSocketEvents::GetBackendName() const
+{
+#if defined(USE_EPOLL)
+    return "epoll";
+#elif defined(USE_POLL)
+    return "poll";
+#else
+    return "select";
+#endif
+}
+
+bool CSocketEvents::IsEdgeTriggered() const
+{
+#ifdef USE_EPOLL
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void* pdata, bool fLevelTriggered)
+{
+    if (hSocket == INVALID_SOCKET)
+        return false;
+
+    LOCK(cs);
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    event.events = fLevelTriggered ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    event.data.fd = hSocket;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) == -1)
+        return error("CSocketEvents::Add -- epoll_ctl failed: %s", NetworkErrorString(WSAGetLastError()));
+#endif
+    Entry& entry = mapSockets[hSocket];
+    entry.pdata = pdata;
+    entry.nInterest = fLevelTriggered ? SOCKET_EVENT_READ : 0;
+    return true;
+}
+
+void CSocketEvents::Remove(SOCKET hSocket)
+{
+    if (hSocket == INVALID_SOCKET)
+        return;
+
+    LOCK(cs);
+    if (!mapSockets.erase(hSocket))
+        return;
+#ifdef USE_EPOLL
+    // kernels before 2.6.9 want a non-NULL event even for EPOLL_CTL_DEL
+    struct epoll_event event;
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+#endif
+}
+
+void CSocketEvents::SetInterest(SOCKET hSocket, int nEvents)
+{
+    LOCK(cs);
+    std::map<SOCKET, Entry>::iterator it = mapSockets.find(hSocket);
+    if (it != mapSockets.end())
+        it->second.nInterest = nEvents;
+}
+
+bool CSocketEvents::Wait(std::vector<Event>& vEventsRet, int64_t nTimeoutMillis)
+{
+    vEventsRet.clear();
+
+#if defined(USE_EPOLL)
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nReady = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeoutMillis);
+    if (nReady == -1)
+        return WSAGetLastError() == WSAEINTR;
+
+    LOCK(cs);
+    for (int i = 0; i < nReady; i++) {
+        // the socket may have been removed (and even reused) since the kernel queued this
+        std::map<SOCKET, Entry>::const_iterator it = mapSockets.find(events[i].data.fd);
+        if (it == mapSockets.end())
+            continue;
+        Event event;
+        event.hSocket = it->first;
+        event.pdata = it->second.pdata;
+        event.nEvents = 0;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+            event.nEvents |= SOCKET_EVENT_READ;
+        if (events[i].events & EPOLLOUT)
+            event.nEvents |= SOCKET_EVENT_WRITE;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            event.nEvents |= SOCKET_EVENT_ERROR;
+        vEventsRet.push_back(event);
+    }
+    return true;
+#elif defined(USE_POLL)
+    std::vector<struct pollfd> vPollFds;
+    std::vector<void*> vData;
+    {
+        LOCK(cs);
+        vPollFds.reserve(mapSockets.size());
+        vData.reserve(mapSockets.size());
+        for (std::map<SOCKET, Entry>::const_iterator it = mapSockets.begin(); it != mapSockets.end(); ++it) {
+            struct pollfd pfd;
+            pfd.fd = it->first;
+            pfd.events = 0;
+            pfd.revents = 0;
+            if (it->second.nInterest & SOCKET_EVENT_READ)
+                pfd.events |= POLLIN;
+            if (it->second.nInterest & SOCKET_EVENT_WRITE)
+                pfd.events |= POLLOUT;
+            vPollFds.push_back(pfd);
+            vData.push_back(it->second.pdata);
+        }
+    }
+
+    int nReady = poll(vPollFds.empty() ? NULL : &vPollFds[0], vPollFds.size(), nTimeoutMillis);
+    if (nReady == SOCKET_ERROR)
+        return WSAGetLastError() == WSAEINTR;
+
+    for (size_t i = 0; i < vPollFds.size() && nReady > 0; i++) {
+        if (vPollFds[i].revents == 0)
+            continue;
+        nReady--;
+        Event event;
+        event.hSocket = vPollFds[i].fd;
+        event.pdata = vData[i];
+        event.nEvents = 0;
+        if (vPollFds[i].revents & POLLIN)
+            event.nEvents |= SOCKET_EVENT_READ;
+        if (vPollFds[i].revents & POLLOUT)
+            event.nEvents |= SOCKET_EVENT_WRITE;
+        if (vPollFds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            event.nEvents |= SOCKET_EVENT_ERROR;
+        vEventsRet.push_back(event);
+    }
+    return true;
+#else
+    struct timeval timeout = MillisToTimeval(nTimeoutMillis);
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    std::vector<std::pair<SOCKET, void*> > vSockets;
+    {
+        LOCK(cs);
+        for (std::map<SOCKET, Entry>::const_iterator it = mapSockets.begin(); it != mapSockets.end(); ++it) {
+            if (it->second.nInterest & SOCKET_EVENT_READ)
+                FD_SET(it->first, &fdsetRecv);
+            if (it->second.nInterest & SOCKET_EVENT_WRITE)
+                FD_SET(it->first, &fdsetSend);
+            FD_SET(it->first, &fdsetError);
+            hSocketMax = std::max(hSocketMax, it->first);
+            vSockets.push_back(std::make_pair(it->first, it->second.pdata));
+        }
+    }
+
+    if (vSockets.empty()) {
+        MilliSleep(nTimeoutMillis);
+        return true;
+    }
+
+    int nReady = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nReady == SOCKET_ERROR)
+        return false;
+
+    for (size_t i = 0; i < vSockets.size(); i++) {
+        Event event;
+        event.hSocket = vSockets[i].first;
+        event.pdata = vSockets[i].second;
+        event.nEvents = 0;
+        if (FD_ISSET(event.hSocket, &fdsetRecv))
+            event.nEvents |= SOCKET_EVENT_READ;
+        if (FD_ISSET(event.hSocket, &fdsetSend))
+            event.nEvents |= SOCKET_EVENT_WRITE;
+        if (FD_ISSET(event.hSocket, &fdsetError))
+            event.nEvents |= SOCKET_EVENT_ERROR;
+        if (event.nEvents)
+            vEventsRet.push_back(event);
+    }
+    return true;
+#endif
+}
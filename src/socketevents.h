@@ -0,0 +1,79 @@
+// Copyright (c) 2014-2018 The Growth Coin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SOCKETEVENTS_H
+#define SOCKETEVENTS_H
+
+#if defined(HAVE_CONFIG_H)
+#include "config/growth-config.h"
+#endif
+
+#include "compat.h"
+#include "sync.h"
+
+#include <map>
+#include <vector>
+
+/**
+ * Readiness notifications for the sockets serviced by ThreadSocketHandler.
+ *
+ * With epoll sockets are registered once, edge-triggered, and only sockets
+ * whose state changed are reported. The caller has to remember readiness
+ * itself until a read or write returns WSAEWOULDBLOCK.
+ *
+ * The poll() and select() fallbacks are level-triggered: the caller declares
+ * what it wants to wait for on every socket with SetInterest() before each
+ * Wait(). Neither the epoll nor the poll() backend is bound by FD_SETSIZE.
+ */
+class CSocketEvents
+{
+public:
+    enum {
+        SOCKET_EVENT_READ = (1 << 0),
+        SOCKET_EVENT_WRITE = (1 << 1),
+        SOCKET_EVENT_ERROR = (1 << 2),
+    };
+
+    struct Event {
+        SOCKET hSocket;
+        void* pdata;
+        int nEvents;
+    };
+
+private:
+    struct Entry {
+        void* pdata;
+        int nInterest;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<SOCKET, Entry> mapSockets;
+#ifdef USE_EPOLL
+    int hEpoll;
+#endif
+
+public:
+    CSocketEvents();
+    ~CSocketEvents();
+
+    /** Set up the backend, returns false if the OS refuses to */
+    bool Init();
+    const char* GetBackendName() const;
+    bool IsEdgeTriggered() const;
+
+    /**
+     * Start watching hSocket, pdata is handed back with its events.
+     * Level-triggered sockets (listening sockets) are always waited on for reading.
+     */
+    bool Add(SOCKET hSocket, void* pdata, bool fLevelTriggered = false);
+    /** Stop watching hSocket, must be called before the socket is closed */
+    void Remove(SOCKET hSocket);
+    /** Level-triggered backends only: what to wait for on hSocket, errors are always reported */
+    void SetInterest(SOCKET hSocket, int nEvents);
+
+    /** Wait up to nTimeoutMillis for events, returns false on error */
+    bool Wait(std::vector<Event>& vEventsRet, int64_t nTimeoutMillis);
+};
+
+#endif
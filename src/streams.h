@@ -297,6 +297,12 @@ public:
         clear();
     }
 
+    /** Exchange the underlying buffer with data, reading starts over at its beginning */
+    void SwapData(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
@@ -2,15 +2,92 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "addrman.h"
+#include "clientversion.h"
+#include "net.h"
+#include "streams.h"
 #include "test/test_growth.h"
+#include "util.h"
 #include <string>
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include "random.h"
 
 using namespace std;
 
-class CAddrManTest : public CAddrMan{};
+// Whether vSlots lists exactly the occupied positions of a bucket table, with pSlotPos pointing back at them
+static bool CheckSlotList(const int* pTable, const int* pSlotPos, const std::vector<int>& vSlots, int nPositions)
+{
+    int nOccupied = 0;
+    for (int nSlot = 0; nSlot < nPositions; nSlot++) {
+        if (pTable[nSlot] == -1) {
+            if (pSlotPos[nSlot] != -1)
+                return false;
+            continue;
+        }
+        nOccupied++;
+        if (pSlotPos[nSlot] < 0 || pSlotPos[nSlot] >= (int)vSlots.size() || vSlots[pSlotPos[nSlot]] != nSlot)
+            return false;
+    }
+    return nOccupied == (int)vSlots.size();
+}
+
+class CAddrManTest : public CAddrMan
+{
+public:
+    //! the id of addr, -1 if it is not known
+    int GetId(const CNetAddr& addr)
+    {
+        LOCK(cs);
+        int nId = -1;
+        Find(addr, &nId);
+        return nId;
+    }
+
+    //! the number of ids in use or free for reuse
+    size_t GetIdCount()
+    {
+        LOCK(cs);
+        return vInfo.size();
+    }
+
+    std::vector<int> GetFreeIds()
+    {
+        LOCK(cs);
+        return vFreeIds;
+    }
+
+    int GetTriedCount()
+    {
+        LOCK(cs);
+        return nTried;
+    }
+
+    //! drop addr from the "new" bucket its source put it in
+    void ClearNewSlot(const CNetAddr& addr)
+    {
+        LOCK(cs);
+        CAddrInfo* pinfo = Find(addr);
+        assert(pinfo);
+        int nUBucket = pinfo->GetNewBucket(nKey);
+        ClearNew(nUBucket, pinfo->GetBucketPosition(nKey, true, nUBucket));
+    }
+
+    //! whether the slot lists and the id bookkeeping agree with the tables
+    bool CheckSlots()
+    {
+        LOCK(cs);
+        if (!CheckSlotList(&vvTried[0][0], vTriedSlotPos, vTriedSlots, ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE))
+            return false;
+        if (!CheckSlotList(&vvNew[0][0], vNewSlotPos, vNewSlots, ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE))
+            return false;
+        if ((int)vTriedSlots.size() != nTried || vRandom.size() + vFreeIds.size() != vInfo.size())
+            return false;
+        std::set<int> setIds(vRandom.begin(), vRandom.end());
+        setIds.insert(vFreeIds.begin(), vFreeIds.end());
+        return setIds.size() == vInfo.size();
+    }
+};
 
 BOOST_FIXTURE_TEST_SUITE(addrman_tests, BasicTestingSetup)
 
@@ -176,5 +253,129 @@ BOOST_AUTO_TEST_CASE(addrman_tried_collisions)
     BOOST_CHECK(addrman.size() == 75);
 }
 
+BOOST_AUTO_TEST_CASE(addrman_id_reuse)
+{
+    CAddrManTest addrman;
+
+    CNetAddr source = CNetAddr("252.2.2.2");
+    CService addr1 = CService("250.1.1.1:8333");
+    CService addr2 = CService("250.1.1.2:8333");
+    CService addr3 = CService("250.1.1.3:8333");
+    addrman.Add(CAddress(addr1), source);
+    addrman.Add(CAddress(addr2), source);
+    int nId1 = addrman.GetId(addr1);
+    BOOST_CHECK(nId1 != -1);
+    BOOST_CHECK_EQUAL(addrman.GetIdCount(), 2U);
+
+    // Clearing its only "new" slot deletes the entry and frees its id
+    addrman.ClearNewSlot(addr1);
+    BOOST_CHECK_EQUAL(addrman.GetId(addr1), -1);
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.GetFreeIds() == std::vector<int>(1, nId1));
+    BOOST_CHECK(addrman.CheckSlots());
+
+    // The next entry takes the freed id instead of growing the table
+    addrman.Add(CAddress(addr3), source);
+    BOOST_CHECK_EQUAL(addrman.GetId(addr3), nId1);
+    BOOST_CHECK(addrman.GetFreeIds().empty());
+    BOOST_CHECK_EQUAL(addrman.GetIdCount(), 2U);
+    BOOST_CHECK_EQUAL(addrman.size(), 2);
+    BOOST_CHECK(addrman.CheckSlots());
+    BOOST_CHECK(addrman.Select().ToString() != "[::]:0");
+}
+
+BOOST_AUTO_TEST_CASE(addrman_slots)
+{
+    CAddrManTest addrman;
+
+    // One group and one source, so new entries keep colliding and are
+    // deleted, and moving them to tried evicts earlier tried entries.
+    CNetAddr source = CNetAddr("252.2.2.2");
+    std::vector<CService> vAddr;
+    for (int i = 0; i < 1000; i++) {
+        vAddr.push_back(CService(strprintf("250.1.%i.%i:8333", i / 256, i % 256)));
+        addrman.Add(CAddress(vAddr.back()), source);
+        if (i % 100 == 99)
+            BOOST_CHECK(addrman.CheckSlots());
+    }
+    BOOST_CHECK(addrman.size() < 1000);
+    BOOST_CHECK_EQUAL(addrman.GetIdCount(), addrman.size() + addrman.GetFreeIds().size());
+
+    int nGood = 0;
+    for (size_t i = 0; i < vAddr.size(); i++) {
+        if (addrman.GetId(vAddr[i]) == -1)
+            continue;
+        addrman.Good(CAddress(vAddr[i]));
+        nGood++;
+        if (nGood % 100 == 0)
+            BOOST_CHECK(addrman.CheckSlots());
+    }
+    BOOST_CHECK(addrman.CheckSlots());
+    // Only ADDRMAN_TRIED_BUCKETS_PER_GROUP buckets take the group, the rest went back to new
+    BOOST_CHECK(addrman.GetTriedCount() > 0);
+    BOOST_CHECK(addrman.GetTriedCount() <= ADDRMAN_TRIED_BUCKETS_PER_GROUP * ADDRMAN_BUCKET_SIZE);
+    BOOST_CHECK(addrman.GetTriedCount() < nGood);
+
+    // Selecting only reads the slot lists
+    for (int i = 0; i < 100; i++) {
+        BOOST_CHECK(addrman.Select().ToString() != "[::]:0");
+        BOOST_CHECK(addrman.Select(true).ToString() != "[::]:0");
+    }
+    BOOST_CHECK(addrman.CheckSlots());
+
+    addrman.Clear();
+    BOOST_CHECK(addrman.CheckSlots());
+    BOOST_CHECK_EQUAL(addrman.GetIdCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_change_count)
+{
+    CAddrManTest addrman;
+
+    CNetAddr source = CNetAddr("252.2.2.2");
+    CService addr1 = CService("250.1.1.1:8333");
+
+    uint64_t nChanges = addrman.GetChangeCount();
+    addrman.Add(CAddress(addr1), source);
+    BOOST_CHECK(addrman.GetChangeCount() > nChanges);
+
+    // Reading the table, including writing it out, changes nothing
+    nChanges = addrman.GetChangeCount();
+    addrman.Select();
+    addrman.GetAddr();
+    addrman.size();
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+    BOOST_CHECK_EQUAL(addrman.GetChangeCount(), nChanges);
+
+    // An address that is already known with the same information changes nothing either
+    addrman.Add(CAddress(addr1), source);
+    BOOST_CHECK_EQUAL(addrman.GetChangeCount(), nChanges);
+
+    addrman.Attempt(addr1);
+    BOOST_CHECK(addrman.GetChangeCount() > nChanges);
+    nChanges = addrman.GetChangeCount();
+    addrman.Good(addr1);
+    BOOST_CHECK(addrman.GetChangeCount() > nChanges);
+}
+
+BOOST_FIXTURE_TEST_CASE(addrman_dump_unchanged, TestingSetup)
+{
+    boost::filesystem::path pathPeers = GetDataDir() / "peers.dat";
+
+    DumpAddresses();
+    BOOST_CHECK(boost::filesystem::exists(pathPeers));
+
+    // Nothing changed since, so peers.dat is not written again
+    boost::filesystem::remove(pathPeers);
+    DumpAddresses();
+    BOOST_CHECK(!boost::filesystem::exists(pathPeers));
+
+    ::addrman.Add(CAddress(CService("250.1.1.1:8333")), CNetAddr("252.2.2.2"));
+    DumpAddresses();
+    BOOST_CHECK(boost::filesystem::exists(pathPeers));
+    ::addrman.Clear();
+}
+
 
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
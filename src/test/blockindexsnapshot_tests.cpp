@@ -0,0 +1,201 @@
+// Copyright (c) 2017-2018 The Growth Coin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "blockindexsnapshot.h"
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+#include "test/test_growth.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+//! A small block index with a fork, parents before their children
+struct SnapshotIndex
+{
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+    std::vector<CBlockIndex*> vSortedByHeight;
+
+    SnapshotIndex(size_t nCount)
+    {
+        const unsigned int nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+        vHashes.resize(nCount);
+        vIndex.resize(nCount);
+        for (size_t i = 0; i < nCount; i++) {
+            // small hashes so every entry passes CheckProofOfWork at nBits
+            vHashes[i] = ArithToUint256(arith_uint256(i + 1));
+            CBlockIndex& index = vIndex[i];
+            index.phashBlock = &vHashes[i];
+            // the last entry forks off the one before the tip
+            index.pprev = i == 0 ? NULL : &vIndex[i + 1 == nCount && i > 1 ? i - 2 : i - 1];
+            index.nHeight = index.pprev ? index.pprev->nHeight + 1 : 0;
+            index.nFile = i / 4;
+            index.nDataPos = 8 + 1000 * i;
+            index.nUndoPos = 8 + 100 * i;
+            index.nVersion = 0x20000000 | i;
+            index.hashMerkleRoot = ArithToUint256(arith_uint256(1000 + i) << 128);
+            index.nTime = 1500000000 + 150 * i;
+            index.nBits = nBits;
+            index.nNonce = 7 * i;
+            index.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA | (i % 2 ? BLOCK_HAVE_UNDO : 0);
+            index.nTx = 1 + i;
+            vSortedByHeight.push_back(&index);
+        }
+    }
+};
+
+struct SnapshotSetup : public BasicTestingSetup
+{
+    boost::filesystem::path path;
+
+    SnapshotSetup()
+    {
+        path = GetTempPath() / boost::filesystem::unique_path("index-%%%%%%%%.snapshot");
+    }
+
+    ~SnapshotSetup()
+    {
+        mapBlockIndex.clear();
+        blockindexarena.Clear();
+        boost::system::error_code ec;
+        boost::filesystem::remove(path, ec);
+    }
+
+    std::vector<unsigned char> ReadFile()
+    {
+        std::vector<unsigned char> vch(boost::filesystem::file_size(path));
+        FILE* file = fopen(path.string().c_str(), "rb");
+        BOOST_REQUIRE(file);
+        BOOST_REQUIRE_EQUAL(fread(&vch[0], 1, vch.size(), file), vch.size());
+        fclose(file);
+        return vch;
+    }
+
+    void WriteFile(const std::vector<unsigned char>& vch)
+    {
+        FILE* file = fopen(path.string().c_str(), "wb");
+        BOOST_REQUIRE(file);
+        BOOST_REQUIRE_EQUAL(fwrite(&vch[0], 1, vch.size(), file), vch.size());
+        fclose(file);
+    }
+
+    //! Reading the snapshot must fail before anything is put into mapBlockIndex
+    void CheckRejected(const uint256& hashChecksum, const uint256& hashBestChain)
+    {
+        std::vector<CBlockIndex*> vSortedByHeight;
+        BOOST_CHECK(!ReadBlockIndexSnapshot(path, hashChecksum, hashBestChain, vSortedByHeight));
+        BOOST_CHECK(mapBlockIndex.empty());
+        BOOST_CHECK(vSortedByHeight.empty());
+    }
+};
+
+} // anon namespace
+
+BOOST_FIXTURE_TEST_SUITE(blockindexsnapshot_tests, SnapshotSetup)
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip)
+{
+    SnapshotIndex index(10);
+    const uint256 hashBestChain = index.vHashes[8];
+    uint256 hashChecksum;
+    BOOST_REQUIRE(WriteBlockIndexSnapshot(path, index.vSortedByHeight, hashBestChain, hashChecksum));
+    BOOST_CHECK(!hashChecksum.IsNull());
+    BOOST_CHECK(!boost::filesystem::exists(path.string() + ".new"));
+
+    std::vector<CBlockIndex*> vSortedByHeight;
+    BOOST_REQUIRE(ReadBlockIndexSnapshot(path, hashChecksum, hashBestChain, vSortedByHeight));
+    BOOST_REQUIRE_EQUAL(vSortedByHeight.size(), index.vIndex.size());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), index.vIndex.size());
+
+    for (size_t i = 0; i < vSortedByHeight.size(); i++) {
+        const CBlockIndex& expected = index.vIndex[i];
+        const CBlockIndex* pindex = vSortedByHeight[i];
+        BOOST_CHECK(blockindexarena.Contains(pindex));
+        BOOST_CHECK(pindex->GetBlockHash() == expected.GetBlockHash());
+        BlockMap::const_iterator mi = mapBlockIndex.find(expected.GetBlockHash());
+        BOOST_CHECK(mi != mapBlockIndex.end() && mi->second == pindex);
+        BOOST_CHECK_EQUAL(pindex->pprev == NULL, expected.pprev == NULL);
+        if (pindex->pprev)
+            BOOST_CHECK(pindex->pprev->GetBlockHash() == expected.pprev->GetBlockHash());
+        BOOST_CHECK_EQUAL(pindex->nHeight, expected.nHeight);
+        BOOST_CHECK_EQUAL(pindex->nFile, expected.nFile);
+        BOOST_CHECK_EQUAL(pindex->nDataPos, expected.nDataPos);
+        BOOST_CHECK_EQUAL(pindex->nUndoPos, expected.nUndoPos);
+        BOOST_CHECK_EQUAL(pindex->nVersion, expected.nVersion);
+        BOOST_CHECK(pindex->hashMerkleRoot == expected.hashMerkleRoot);
+        BOOST_CHECK_EQUAL(pindex->nTime, expected.nTime);
+        BOOST_CHECK_EQUAL(pindex->nBits, expected.nBits);
+        BOOST_CHECK_EQUAL(pindex->nNonce, expected.nNonce);
+        BOOST_CHECK_EQUAL(pindex->nStatus, expected.nStatus);
+        BOOST_CHECK_EQUAL(pindex->nTx, expected.nTx);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_rejected)
+{
+    SnapshotIndex index(10);
+    const uint256 hashBestChain = index.vHashes[8];
+    uint256 hashChecksum;
+    BOOST_REQUIRE(WriteBlockIndexSnapshot(path, index.vSortedByHeight, hashBestChain, hashChecksum));
+    const std::vector<unsigned char> vchGood = ReadFile();
+
+    // the coins database has moved on since the snapshot was taken
+    CheckRejected(hashChecksum, index.vHashes[9]);
+
+    // the block tree database records another snapshot
+    uint256 hashOther = hashChecksum;
+    *hashOther.begin() ^= 0x01;
+    CheckRejected(hashOther, hashBestChain);
+
+    // a flipped byte in an entry
+    std::vector<unsigned char> vch = vchGood;
+    vch[64 + 108 * 3 + 40] ^= 0x01;
+    WriteFile(vch);
+    CheckRejected(hashChecksum, hashBestChain);
+
+    // a version this node does not know
+    vch = vchGood;
+    vch[4] = BLOCK_INDEX_SNAPSHOT_VERSION + 1;
+    WriteFile(vch);
+    CheckRejected(hashChecksum, hashBestChain);
+
+    // a truncated file, cut inside an entry and right after the header
+    vch.assign(vchGood.begin(), vchGood.end() - 50);
+    WriteFile(vch);
+    CheckRejected(hashChecksum, hashBestChain);
+    vch.assign(vchGood.begin(), vchGood.begin() + 64);
+    WriteFile(vch);
+    CheckRejected(hashChecksum, hashBestChain);
+
+    // no snapshot at all
+    boost::filesystem::remove(path);
+    CheckRejected(hashChecksum, hashBestChain);
+
+    // and the untouched file still loads
+    WriteFile(vchGood);
+    std::vector<CBlockIndex*> vSortedByHeight;
+    BOOST_CHECK(ReadBlockIndexSnapshot(path, hashChecksum, hashBestChain, vSortedByHeight));
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), index.vIndex.size());
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_parent_order)
+{
+    // a child listed before its parent cannot be written
+    SnapshotIndex index(3);
+    std::swap(index.vSortedByHeight[0], index.vSortedByHeight[1]);
+    uint256 hashChecksum;
+    BOOST_CHECK(!WriteBlockIndexSnapshot(path, index.vSortedByHeight, index.vHashes[2], hashChecksum));
+    BOOST_CHECK(!boost::filesystem::exists(path));
+    BOOST_CHECK(!boost::filesystem::exists(path.string() + ".new"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,8 +3,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "compressor.h"
+#include "key.h"
 #include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "undo.h"
 #include "test/test_growth.h"
 #include "main.h"
 #include "consensus/validation.h"
@@ -16,46 +22,58 @@
 
 namespace
 {
+//! equality test
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.nHeight == b.nHeight &&
+           a.out == b.out;
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
             }
-            mapCoins.erase(it++);
+            if (fErase)
+                mapCoins.erase(it++);
+            else
+                ++it;
         }
         if (!hashBlock.IsNull())
             hashBestBlock_ = hashBlock;
@@ -74,14 +92,81 @@ public:
     {
         // Manually recompute the dynamic usage of the whole data, and compare it.
         size_t ret = memusage::DynamicUsage(cacheCoins);
+        size_t count = 0;
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
+            ++count;
         }
+        BOOST_CHECK_EQUAL(GetCacheSize(), count);
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
 };
 
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    CDBWrapper& GetDB() { return db; }
+};
+
+/** Per-transaction chainstate record as older versions wrote it, see CCoins in txdb.cpp */
+struct LegacyCoins
+{
+    bool fCoinBase;
+    std::vector<CTxOut> vout; // spent outputs are IsNull()
+    int nHeight;
+
+    LegacyCoins() : fCoinBase(false), nHeight(0) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        // unspentness bitvector for vout[2] and further, least significant byte first
+        std::vector<unsigned char> vMask;
+        for (unsigned int i = 2; i < vout.size(); i++) {
+            if (vMask.size() <= (i - 2) / 8)
+                vMask.push_back(0);
+            if (!vout[i].IsNull())
+                vMask[(i - 2) / 8] |= 1 << ((i - 2) % 8);
+        }
+        while (!vMask.empty() && vMask.back() == 0)
+            vMask.pop_back();
+        unsigned int nMaskCode = 0;
+        for (unsigned int i = 0; i < vMask.size(); i++)
+            if (vMask[i] != 0)
+                nMaskCode++;
+        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
+        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
+        unsigned int nCode = 8 * (nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fFirst ? 2 : 0) + (fSecond ? 4 : 0);
+
+        int nTxVersion = 1;
+        ::Serialize(s, VARINT(nTxVersion), nType, nVersion);
+        ::Serialize(s, VARINT(nCode), nType, nVersion);
+        for (unsigned int i = 0; i < vMask.size(); i++)
+            ::Serialize(s, vMask[i], nType, nVersion);
+        for (unsigned int i = 0; i < vout.size(); i++)
+            if (!vout[i].IsNull())
+                ::Serialize(s, CTxOutCompressor(REF(vout[i])), nType, nVersion);
+        ::Serialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+CTxOut RandomTxOut()
+{
+    CKey key;
+    key.MakeNewKey(true);
+    return CTxOut(insecure_rand() % 1000000 + 1, GetScriptForDestination(key.GetPubKey().GetID()));
+}
+
 }
 
 BOOST_FIXTURE_TEST_SUITE(coins_tests, BasicTestingSetup)
@@ -91,7 +176,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -107,9 +192,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
+    bool synced_a_cache = false;
+    bool evicted_entries = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -127,36 +215,48 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
+            Coin& coin = result[COutPoint(txid, 0)];
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+            BOOST_CHECK(stack.back()->HaveCoin(COutPoint(txid, 0)) == !entry.IsSpent());
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                if (coin.IsSpent()) {
                     added_an_entry = true;
                 } else {
                     updated_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                coin.out.nValue = insecure_rand();
+                coin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0); // Random sizes so we can test memory usage accounting
+                coin.nHeight = 1;
+                stack.back()->AddCoin(COutPoint(txid, 0), coin, !entry.IsSpent() || (insecure_rand() & 1));
             } else {
-                coins.Clear();
-                entry->Clear();
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
                 removed_an_entry = true;
             }
         }
 
+        // Once every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint out(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(out);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(out);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -165,12 +265,24 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         }
 
         if (insecure_rand() % 100 == 0) {
-            // Every 100 iterations, flush an intermediate cache
+            // Every 100 iterations, flush or sync an intermediate cache
             if (stack.size() > 1 && insecure_rand() % 2 == 0) {
                 unsigned int flushIndex = insecure_rand() % (stack.size() - 1);
-                stack[flushIndex]->Flush();
+                if (insecure_rand() % 2 == 0) {
+                    stack[flushIndex]->Flush();
+                } else {
+                    stack[flushIndex]->Sync();
+                    synced_a_cache = true;
+                }
             }
         }
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, shrink a random cache to half its size
+            int cacheid = insecure_rand() % stack.size();
+            size_t nUsage = stack[cacheid]->DynamicMemoryUsage();
+            stack[cacheid]->Evict(nUsage / 2);
+            evicted_entries |= stack[cacheid]->DynamicMemoryUsage() < nUsage;
+        }
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
@@ -209,6 +321,9 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
+    BOOST_CHECK(synced_a_cache);
+    BOOST_CHECK(evicted_entries);
 }
 
 // This test is similar to the previous test
@@ -220,7 +335,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     bool spent_a_duplicate_coinbase = false;
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -238,7 +353,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             tx.vin.resize(1);
             tx.vout.resize(1);
             tx.vout[0].nValue = i; //Keep txs unique unless intended to duplicate
-            unsigned int height = insecure_rand();
+            unsigned int height = insecure_rand() & 0x7FFFFFFF;
 
             // 1/10 times create a coinbase
             if (insecure_rand() % 10 == 0 || coinbaseids.size() < 10) {
@@ -273,8 +388,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[tx.vin[0].prevout].Clear();
 
                 // It is of particular importance here that once we spend a coinbase tx hash
                 // it is no longer available to be duplicated (or spent again)
@@ -294,8 +408,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx.vout[0], height, CTransaction(tx).IsCoinBase());
 
             CValidationState dummy;
             UpdateCoins(tx, dummy, *(stack.back()), height);
@@ -303,13 +416,9 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -347,4 +456,140 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
+// Legacy per-transaction records are converted to one record per unspent output.
+BOOST_FIXTURE_TEST_CASE(coins_db_upgrade, TestingSetup)
+{
+    CCoinsViewDBTest view;
+
+    // A coinbase with its second output spent and an output past the first two
+    LegacyCoins coinbase;
+    coinbase.fCoinBase = true;
+    coinbase.nHeight = 10;
+    coinbase.vout.resize(11);
+    coinbase.vout[0] = RandomTxOut();
+    coinbase.vout[2] = RandomTxOut();
+    coinbase.vout[10] = RandomTxOut();
+    uint256 txidCoinbase = GetRandHash();
+
+    // A regular transaction with an unspendable output, which is not carried over
+    LegacyCoins regular;
+    regular.nHeight = 20;
+    regular.vout.push_back(CTxOut(5000, CScript() << OP_RETURN));
+    regular.vout.push_back(RandomTxOut());
+    uint256 txidRegular = GetRandHash();
+
+    BOOST_CHECK(view.GetDB().Write(std::make_pair('c', txidCoinbase), coinbase));
+    BOOST_CHECK(view.GetDB().Write(std::make_pair('c', txidRegular), regular));
+
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(!view.GetDB().Exists(std::make_pair('c', txidCoinbase)));
+    BOOST_CHECK(!view.GetDB().Exists(std::make_pair('c', txidRegular)));
+
+    for (unsigned int i = 0; i < coinbase.vout.size(); i++) {
+        Coin coin;
+        bool fHave = view.GetCoin(COutPoint(txidCoinbase, i), coin);
+        BOOST_CHECK_EQUAL(fHave, !coinbase.vout[i].IsNull());
+        if (fHave) {
+            BOOST_CHECK(coin.out == coinbase.vout[i]);
+            BOOST_CHECK_EQUAL(coin.nHeight, 10U);
+            BOOST_CHECK(coin.fCoinBase);
+        }
+    }
+
+    Coin coin;
+    BOOST_CHECK(!view.GetCoin(COutPoint(txidRegular, 0), coin));
+    BOOST_CHECK(view.GetCoin(COutPoint(txidRegular, 1), coin));
+    BOOST_CHECK(coin.out == regular.vout[1]);
+    BOOST_CHECK_EQUAL(coin.nHeight, 20U);
+    BOOST_CHECK(!coin.fCoinBase);
+
+    // Nothing left to convert
+    BOOST_CHECK(view.Upgrade());
+}
+
+// Undo records written by older versions only carry height and coinbase flag
+// for the last spent output of a transaction, and a transaction version with it.
+BOOST_AUTO_TEST_CASE(coins_old_undo_format)
+{
+    uint256 txid = GetRandHash();
+    CTxOut out0 = RandomTxOut();
+    CTxOut out1 = RandomTxOut();
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    WriteCompactSize(ss, 2);
+    // spend of output 0, not the last one: height 0 and no version
+    ss << VARINT(0u) << CTxOutCompressor(out0);
+    // spend of output 1, the last one: a coinbase at height 50, version 1
+    ss << VARINT(50u * 2 + 1) << VARINT(1) << CTxOutCompressor(out1);
+
+    CTxUndo txundo;
+    ss >> txundo;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(txundo.vprevout.size(), 2U);
+    BOOST_CHECK_EQUAL(txundo.vprevout[0].nHeight, 0U);
+    BOOST_CHECK(txundo.vprevout[0].out == out0);
+    BOOST_CHECK_EQUAL(txundo.vprevout[1].nHeight, 50U);
+    BOOST_CHECK(txundo.vprevout[1].fCoinBase);
+    BOOST_CHECK(txundo.vprevout[1].out == out1);
+
+    // Inputs are undone last to first, as DisconnectBlock does
+    CCoinsViewTest base;
+    CCoinsViewCacheTest view(&base);
+    BOOST_CHECK(ApplyTxInUndo(txundo.vprevout[1], view, COutPoint(txid, 1)));
+    BOOST_CHECK(ApplyTxInUndo(txundo.vprevout[0], view, COutPoint(txid, 0)));
+    for (unsigned int i = 0; i < 2; i++) {
+        const Coin& coin = view.AccessCoin(COutPoint(txid, i));
+        BOOST_CHECK(coin.out == (i == 0 ? out0 : out1));
+        BOOST_CHECK_EQUAL(coin.nHeight, 50U);
+        BOOST_CHECK(coin.fCoinBase);
+    }
+
+    // Without another output of the transaction to take it from, the metadata is lost
+    BOOST_CHECK(!ApplyTxInUndo(txundo.vprevout[0], view, COutPoint(GetRandHash(), 0)));
+
+    // Restored outputs written back in the current format read the same
+    CTxUndo txundoNew;
+    txundoNew.vprevout.push_back(view.AccessCoin(COutPoint(txid, 0)));
+    txundoNew.vprevout.push_back(view.AccessCoin(COutPoint(txid, 1)));
+    CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+    ssNew << txundoNew;
+    CTxUndo txundoRead;
+    ssNew >> txundoRead;
+    BOOST_CHECK_EQUAL(txundoRead.vprevout.size(), 2U);
+    for (unsigned int i = 0; i < 2; i++)
+        BOOST_CHECK(txundoRead.vprevout[i] == txundoNew.vprevout[i]);
+}
+
+// Evict drops the least recently used clean entries first.
+BOOST_AUTO_TEST_CASE(coins_evict_oldest)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // scripts too large to be stored inline, so the coins dominate the usage
+    const CScript script = CScript() << std::vector<unsigned char>(200, 1);
+    std::vector<COutPoint> vOutpoints;
+    for (int i = 0; i < 1000; i++) {
+        vOutpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(vOutpoints.back(), Coin(CTxOut(1000, script), 1, false), false);
+    }
+    BOOST_CHECK(cache.Sync());
+    BOOST_FOREACH(const COutPoint& outpoint, vOutpoints)
+        cache.AccessCoin(outpoint);
+
+    size_t nUsage = cache.DynamicMemoryUsage();
+    size_t nTarget = nUsage - nUsage / 4;
+    cache.Evict(nTarget);
+    cache.SelfTest();
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nTarget);
+
+    // what is left is the most recently accessed part
+    size_t nFirstCached = 0;
+    while (nFirstCached < vOutpoints.size() && !cache.HaveCoinInCache(vOutpoints[nFirstCached]))
+        nFirstCached++;
+    BOOST_CHECK(nFirstCached > 0 && nFirstCached < vOutpoints.size());
+    for (size_t i = nFirstCached; i < vOutpoints.size(); i++)
+        BOOST_CHECK(cache.HaveCoinInCache(vOutpoints[i]));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
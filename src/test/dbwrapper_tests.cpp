@@ -204,6 +204,29 @@ BOOST_AUTO_TEST_CASE(existing_data_reindex)
     BOOST_CHECK_EQUAL(res3.ToString(), in2.ToString());
 }
 
+// Reopening with another profile keeps the data, but not while it is iterated.
+BOOST_AUTO_TEST_CASE(dbwrapper_set_profile)
+{
+    path ph = temp_directory_path() / unique_path();
+    create_directories(ph);
+    CDBWrapper dbw(ph, (1 << 20), false, false, true);
+    char key = 'k';
+    uint256 in = GetRandHash();
+    uint256 res;
+    BOOST_CHECK(dbw.Write(key, in));
+
+    CDBProfile profile(true, 16 * 1024, 32, 10);
+    CDBIterator* it = dbw.NewIterator();
+    BOOST_CHECK(!dbw.SetProfile(profile));
+    delete it;
+    BOOST_CHECK(dbw.SetProfile(profile));
+    BOOST_CHECK_EQUAL(dbw.GetProfile().ToString(), profile.ToString());
+
+    BOOST_CHECK(dbw.Read(key, res));
+    BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+    BOOST_CHECK(dbw.Write(key, res));
+}
+
 BOOST_AUTO_TEST_CASE(iterator_ordering)
 {
     path ph = temp_directory_path() / unique_path();
@@ -47,4 +47,20 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_lanes)
+{
+    // Every lane must match the scalar MurmurHash3, for all tail lengths
+    std::vector<unsigned char> vData;
+    for (unsigned int nSize = 0; nSize < 70; nSize++) {
+        uint32_t vSeeds[MURMURHASH3_LANES];
+        uint32_t vHashes[MURMURHASH3_LANES];
+        for (int j = 0; j < MURMURHASH3_LANES; j++)
+            vSeeds[j] = (nSize + j) * 0xFBA4C795 + 0x2a;
+        MurmurHash3Lanes(vSeeds, vData.empty() ? NULL : &vData[0], vData.size(), vHashes);
+        for (int j = 0; j < MURMURHASH3_LANES; j++)
+            BOOST_CHECK_EQUAL(vHashes[j], MurmurHash3(vSeeds[j], vData));
+        vData.push_back(nSize * 37 + 11);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -318,6 +319,60 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
 }
 
 
+BOOST_AUTO_TEST_CASE(MempoolSortForRelayTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // Low fee parent with a high fee child, and an unrelated transaction in between
+    CMutableTransaction txParent = CMutableTransaction();
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+
+    CMutableTransaction txChild = CMutableTransaction();
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(100000LL).FromTx(txChild));
+
+    CMutableTransaction txOther = CMutableTransaction();
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txOther.GetHash(), entry.Fee(10000LL).FromTx(txOther));
+
+    std::vector<uint256> vHashes;
+    vHashes.push_back(txChild.GetHash());
+    vHashes.push_back(GetRandHash()); // not in the pool
+    vHashes.push_back(txParent.GetHash());
+    vHashes.push_back(txOther.GetHash());
+    pool.SortForRelay(vHashes);
+
+    // the child still goes out last, whatever its fee rate
+    BOOST_CHECK_EQUAL(vHashes.size(), 3U);
+    BOOST_CHECK(vHashes[0] == txOther.GetHash());
+    BOOST_CHECK(vHashes[1] == txParent.GetHash());
+    BOOST_CHECK(vHashes[2] == txChild.GetHash());
+
+    // the ancestor counts it sorts by follow the parent out of the pool
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txChild.GetHash())->GetCountWithAncestors(), 2U);
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txChild.GetHash())->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txOther.GetHash())->GetCountWithAncestors(), 1U);
+}
+
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool(CFeeRate(1000));
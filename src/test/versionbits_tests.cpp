@@ -313,4 +313,114 @@ BOOST_AUTO_TEST_CASE(versionbits_computeblockversion)
 }
 
 
+/** Count the blocks of minVersion or above in the window ending at pindex the slow way */
+static unsigned int CountVersionsWalk(int minVersion, const CBlockIndex* pindex, int nWindow)
+{
+    unsigned int nFound = 0;
+    for (int i = 0; i < nWindow && pindex != NULL; i++, pindex = pindex->pprev) {
+        if (pindex->nVersion >= minVersion)
+            nFound++;
+    }
+    return nFound;
+}
+
+BOOST_AUTO_TEST_CASE(versionbits_supermajority_cache)
+{
+    Consensus::Params params = Params(CBaseChainParams::MAIN).GetConsensus();
+    params.nMajorityWindow = 100;
+
+    // A main chain and a branch off it at height 450, both spanning several windows
+    std::vector<CBlockIndex> vMain(1000);
+    for (unsigned int i = 0; i < vMain.size(); i++) {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = i ? &vMain[i - 1] : NULL;
+        vMain[i].nVersion = 1 + insecure_rand() % 5;
+        vMain[i].BuildSkip();
+    }
+    std::vector<CBlockIndex> vSide(400);
+    for (unsigned int i = 0; i < vSide.size(); i++) {
+        vSide[i].nHeight = 450 + i;
+        vSide[i].pprev = i ? &vSide[i - 1] : &vMain[449];
+        vSide[i].nVersion = 1 + insecure_rand() % 5;
+        vSide[i].BuildSkip();
+    }
+
+    LOCK(cs_main);
+    // Random queries first, so the counts get filled in out of order
+    for (int n = 0; n < 200; n++) {
+        const CBlockIndex* pindex = &vMain[insecure_rand() % vMain.size()];
+        for (int v = 1; v <= 5; v++)
+            BOOST_CHECK_EQUAL(CountSuperMajority(v, pindex, params), CountVersionsWalk(v, pindex, params.nMajorityWindow));
+    }
+    // Every block of the main chain, then of the branch as if we reorganized onto it
+    for (unsigned int i = 0; i < vMain.size(); i++) {
+        for (int v = 1; v <= 5; v++)
+            BOOST_CHECK_EQUAL(CountSuperMajority(v, &vMain[i], params), CountVersionsWalk(v, &vMain[i], params.nMajorityWindow));
+    }
+    for (unsigned int i = 0; i < vSide.size(); i++) {
+        for (int v = 1; v <= 5; v++)
+            BOOST_CHECK_EQUAL(CountSuperMajority(v, &vSide[i], params), CountVersionsWalk(v, &vSide[i], params.nMajorityWindow));
+    }
+    // and back onto the main chain
+    for (unsigned int i = 449; i < vMain.size(); i++) {
+        for (int v = 1; v <= 5; v++)
+            BOOST_CHECK_EQUAL(CountSuperMajority(v, &vMain[i], params), CountVersionsWalk(v, &vMain[i], params.nMajorityWindow));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(versionbits_state_cache)
+{
+    Consensus::Params params = Params(CBaseChainParams::MAIN).GetConsensus();
+    params.nMinerConfirmationWindow = 100;
+    params.nRuleChangeActivationThreshold = 75;
+    const Consensus::DeploymentPos pos = Consensus::DEPLOYMENT_TESTDUMMY;
+    params.vDeployments[pos].nStartTime = TestTime(150);
+    params.vDeployments[pos].nTimeout = TestTime(100000);
+    const int32_t nSignal = VERSIONBITS_TOP_BITS | VersionBitsMask(params, pos);
+
+    // The main chain signals from height 300 on, locks in and activates. The branch
+    // off it at height 250 never signals and stays started.
+    std::vector<CBlockIndex> vMain(800);
+    for (unsigned int i = 0; i < vMain.size(); i++) {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = i ? &vMain[i - 1] : NULL;
+        vMain[i].nTime = TestTime(i);
+        vMain[i].nVersion = i >= 300 ? nSignal : VERSIONBITS_TOP_BITS;
+        vMain[i].BuildSkip();
+    }
+    std::vector<CBlockIndex> vSide(500);
+    for (unsigned int i = 0; i < vSide.size(); i++) {
+        vSide[i].nHeight = 250 + i;
+        vSide[i].pprev = i ? &vSide[i - 1] : &vMain[249];
+        vSide[i].nTime = TestTime(250 + i);
+        vSide[i].nVersion = VERSIONBITS_TOP_BITS;
+        vSide[i].BuildSkip();
+    }
+
+    // Each answer from the long lived cache must match one computed from scratch
+    VersionBitsCache cache;
+    std::vector<const CBlockIndex*> vQueries;
+    // connecting the main chain block by block,
+    for (unsigned int i = 0; i < vMain.size(); i++)
+        vQueries.push_back(&vMain[i]);
+    // disconnecting back to the fork point,
+    for (int i = vMain.size() - 1; i >= 249; i--)
+        vQueries.push_back(&vMain[i]);
+    // connecting the branch,
+    for (unsigned int i = 0; i < vSide.size(); i++)
+        vQueries.push_back(&vSide[i]);
+    // and jumping between both.
+    for (int n = 0; n < 500; n++)
+        vQueries.push_back(insecure_rand() % 2 ? &vMain[insecure_rand() % vMain.size()] : &vSide[insecure_rand() % vSide.size()]);
+
+    for (unsigned int i = 0; i < vQueries.size(); i++) {
+        VersionBitsCache cacheFresh;
+        BOOST_CHECK_MESSAGE(VersionBitsState(vQueries[i], params, pos, cache) == VersionBitsState(vQueries[i], params, pos, cacheFresh),
+                            strprintf("query %u at height %d", i, vQueries[i]->nHeight));
+    }
+
+    BOOST_CHECK(VersionBitsState(&vMain.back(), params, pos, cache) == THRESHOLD_ACTIVE);
+    BOOST_CHECK(VersionBitsState(&vSide.back(), params, pos, cache) == THRESHOLD_STARTED);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
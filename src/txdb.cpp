@@ -8,16 +8,22 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "hash.h"
+#include "indexwriter.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
+#include <map>
+#include <set>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
 
 using namespace std;
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -25,24 +31,146 @@ static const char DB_ADDRESSINDEX = 'a';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_SPENTINDEX = 'p';
+static const char DB_ADDRESSBALANCE = 'A';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_BEST_INDEXED = 'I';
+static const char DB_INDEX_SNAPSHOT = 'S';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * Legacy per-transaction record of the chainstate database, only read while
+ * upgrading it. See the Coin class for the current per-output format.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 0: IsCoinBase()
+ * - bit 1: vout[0] is not spent
+ * - bit 2: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 1 and bit 2 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ */
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull()
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+}
+
+CDBProfile GetDBProfile(const std::string& strName, bool fInitialDownload)
+{
+    CDBProfile profile;
+    if (strName == "index") {
+        // block index records are small and similar, they compress well
+        profile.fCompression = true;
+        profile.nBlockSize = 16 * 1024;
+    }
+    profile.fCompression = GetBoolArg("-" + strName + "dbcompression", profile.fCompression);
+    profile.nBlockSize = std::max((int64_t)1, GetArg("-" + strName + "dbblocksize", profile.nBlockSize / 1024)) * 1024;
+    profile.nMaxOpenFiles = std::max((int64_t)16, GetArg("-" + strName + "dbmaxopenfiles", profile.nMaxOpenFiles));
+    profile.nBlockCachePercent = std::max((int64_t)1, std::min((int64_t)99, GetArg("-" + strName + "dbblockcache", profile.nBlockCachePercent)));
+    if (fInitialDownload) {
+        // almost every read during initial block download misses, and the coins
+        // cache above already holds what is hot; bigger write buffers mean fewer
+        // and larger compactions instead
+        profile.nBlockCachePercent = std::min(profile.nBlockCachePercent, DEFAULT_IBD_BLOCK_CACHE_PERCENT);
+    }
+    return profile;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) :
+    db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, GetDBProfile("chainstate", fWipe)), fInitialDownloadProfile(fWipe)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::SetInitialDownloadProfile(bool fInitialDownload)
+{
+    if (fInitialDownloadProfile == fInitialDownload)
+        return true;
+    if (!db.SetProfile(GetDBProfile("chainstate", fInitialDownload)))
+        return false;
+    fInitialDownloadProfile = fInitialDownload;
+    return true;
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -52,30 +180,104 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) {
     CDBBatch batch(&db.GetObfuscateKey());
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            ++it;
+        }
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    // every batch replaces whole transactions, so an interrupted upgrade simply resumes on the next start
+    const size_t nBatchRecords = 1 << 16;
+    size_t nRecords = 0;
+    CDBBatch batch(&db.GetObfuscateKey());
+    int reportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prevKey = make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins oldCoins;
+            if (!pcursor->GetValue(oldCoins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < oldCoins.vout.size(); ++i) {
+                if (!oldCoins.vout[i].IsNull() && !oldCoins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newCoin(oldCoins.vout[i], oldCoins.nHeight, oldCoins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newCoin);
+                    nRecords++;
+                }
+            }
+            batch.Erase(key);
+            nRecords++;
+            if (nRecords > nBatchRecords) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                nRecords = 0;
+                db.CompactRange(prevKey, key);
+                prevKey = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, GetDBProfile("index", false)) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -98,49 +300,63 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
-            } else {
+        COutPoint key;
+        Coin coin;
+        CoinEntry entry(&key);
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (!pcursor->GetValue(coin)) {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
+            // outputs of a transaction are adjacent in the database, hash them as one record
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
+            }
+            prevkey = key.hash;
+            outputs[key.n] = coin;
+            stats.nSerializedSize += 32 + pcursor->GetValueSize();
         } else {
             break;
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs);
+    }
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -221,6 +437,36 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
     return true;
 }
 
+bool CBlockTreeDB::ReadAddressUnspentIndexPage(uint160 addressHash, int type, const CAddressUnspentKey &keyStart, size_t nLimit,
+                                               std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs, CAddressUnspentKey &keyNext, bool &fMore) {
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, keyStart));
+
+    fMore = false;
+    size_t nRead = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressUnspentKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUNSPENTINDEX || key.second.type != (unsigned int)type || key.second.hashBytes != addressHash)
+            break;
+        if (nRead >= nLimit) {
+            keyNext = key.second;
+            fMore = true;
+            break;
+        }
+        CAddressUnspentValue nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("failed to get address unspent value");
+        unspentOutputs.push_back(make_pair(key.second, nValue));
+        nRead++;
+        pcursor->Next();
+    }
+
+    return true;
+}
+
 bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(&GetObfuscateKey());
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
@@ -269,12 +515,190 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
+bool CBlockTreeDB::ReadAddressIndexPage(uint160 addressHash, int type, const CAddressIndexKey &keyStart, int end, size_t nLimit, bool fWholeTransactions,
+                                        std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, CAddressIndexKey &keyNext, bool &fMore) {
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    pcursor->Seek(make_pair(DB_ADDRESSINDEX, keyStart));
+
+    fMore = false;
+    size_t nRead = 0;
+    uint256 txhashLast;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX || key.second.type != (unsigned int)type || key.second.hashBytes != addressHash)
+            break;
+        if (end > 0 && key.second.blockHeight > end)
+            break;
+        // entries of one transaction are adjacent, keep them on one page if asked to
+        if (nRead >= nLimit && !(fWholeTransactions && key.second.txhash == txhashLast)) {
+            keyNext = key.second;
+            fMore = true;
+            break;
+        }
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("failed to get address index value");
+        addressIndex.push_back(make_pair(key.second, nValue));
+        txhashLast = key.second.txhash;
+        nRead++;
+        pcursor->Next();
+    }
+
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressBalance(uint160 addressHash, int type, CAddressBalance &balance) {
+    // addresses without a record never had any activity
+    if (!Read(make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(type, addressHash)), balance))
+        balance.SetNull();
+    return true;
+}
+
+bool CBlockTreeDB::BuildAddressBalances() {
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(DB_ADDRESSINDEX);
+
+    LogPrintf("Building address balances...\n");
+    // the entries of one address are consecutive and ordered by height and
+    // transaction, so each total is complete before the next address starts
+    const size_t nBatchRecords = 1 << 16;
+    size_t nRecords = 0;
+    size_t nAddresses = 0;
+    CDBBatch batch(&GetObfuscateKey());
+    CAddressIndexIteratorKey addressLast;
+    uint256 txhashLast;
+    CAddressBalance balance;
+    bool fHaveAddress = false;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return false;
+        std::pair<char, CAddressIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX)
+            break;
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("%s: cannot parse address index record", __func__);
+
+        if (!fHaveAddress || key.second.type != addressLast.type || key.second.hashBytes != addressLast.hashBytes) {
+            if (fHaveAddress) {
+                batch.Write(make_pair(DB_ADDRESSBALANCE, addressLast), balance);
+                nAddresses++;
+                if (++nRecords > nBatchRecords) {
+                    WriteBatch(batch);
+                    batch.Clear();
+                    nRecords = 0;
+                }
+            }
+            addressLast = CAddressIndexIteratorKey(key.second.type, key.second.hashBytes);
+            balance.SetNull();
+            txhashLast.SetNull();
+            fHaveAddress = true;
+        }
+        balance.balance += nValue;
+        if (nValue > 0)
+            balance.received += nValue;
+        if (key.second.txhash != txhashLast) {
+            balance.txCount++;
+            txhashLast = key.second.txhash;
+        }
+        pcursor->Next();
+    }
+    if (fHaveAddress) {
+        batch.Write(make_pair(DB_ADDRESSBALANCE, addressLast), balance);
+        nAddresses++;
+    }
+    if (!WriteBatch(batch))
+        return false;
+    LogPrintf("Built balances of %u addresses\n", nAddresses);
+    return true;
+}
+
 bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
     CDBBatch batch(&GetObfuscateKey());
     batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteIndexUpdates(const std::vector<CIndexUpdate> &vUpdates, const uint256 &hashBestIndexed) {
+    CDBBatch batch(&GetObfuscateKey());
+    // changes to the per-address totals, applied once for the whole batch
+    std::map<std::pair<unsigned int, uint160>, CAddressBalance> mapBalanceDeltas;
+    for (std::vector<CIndexUpdate>::const_iterator it = vUpdates.begin(); it != vUpdates.end(); it++) {
+        const int64_t nSign = it->fConnect ? 1 : -1;
+        std::set<std::pair<std::pair<unsigned int, uint160>, uint256> > setAddressTxs;
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator ai = it->vAddressIndex.begin(); ai != it->vAddressIndex.end(); ai++) {
+            if (it->fConnect) {
+                batch.Write(make_pair(DB_ADDRESSINDEX, ai->first), ai->second);
+            } else {
+                batch.Erase(make_pair(DB_ADDRESSINDEX, ai->first));
+            }
+            std::pair<unsigned int, uint160> address = make_pair(ai->first.type, ai->first.hashBytes);
+            CAddressBalance& delta = mapBalanceDeltas[address];
+            delta.balance += nSign * ai->second;
+            if (ai->second > 0)
+                delta.received += nSign * ai->second;
+            // a transaction counts once per address however many of its inputs and outputs touch it
+            if (setAddressTxs.insert(make_pair(address, ai->first.txhash)).second)
+                delta.txCount += nSign;
+        }
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator ui = it->vAddressUnspentIndex.begin(); ui != it->vAddressUnspentIndex.end(); ui++) {
+            if (ui->second.IsNull()) {
+                batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, ui->first));
+            } else {
+                batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, ui->first), ui->second);
+            }
+        }
+        for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator si = it->vSpentIndex.begin(); si != it->vSpentIndex.end(); si++) {
+            if (si->second.IsNull()) {
+                batch.Erase(make_pair(DB_SPENTINDEX, si->first));
+            } else {
+                batch.Write(make_pair(DB_SPENTINDEX, si->first), si->second);
+            }
+        }
+        for (std::vector<CTimestampIndexKey>::const_iterator ti = it->vTimestampIndex.begin(); ti != it->vTimestampIndex.end(); ti++)
+            batch.Write(make_pair(DB_TIMESTAMPINDEX, *ti), 0);
+    }
+    // only this batch changes the totals, so reading them back before it is written is safe
+    for (std::map<std::pair<unsigned int, uint160>, CAddressBalance>::const_iterator it = mapBalanceDeltas.begin(); it != mapBalanceDeltas.end(); it++) {
+        CAddressBalance balance;
+        ReadAddressBalance(it->first.second, it->first.first, balance);
+        balance.balance += it->second.balance;
+        balance.received += it->second.received;
+        balance.txCount += it->second.txCount;
+        if (balance.IsNull()) {
+            batch.Erase(make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(it->first.first, it->first.second)));
+        } else {
+            batch.Write(make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(it->first.first, it->first.second)), balance);
+        }
+    }
+    batch.Write(DB_BEST_INDEXED, hashBestIndexed);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadBestIndexed(uint256 &hashBestIndexed) {
+    return Read(DB_BEST_INDEXED, hashBestIndexed);
+}
+
+bool CBlockTreeDB::WriteBestIndexed(const uint256 &hashBestIndexed) {
+    return Write(DB_BEST_INDEXED, hashBestIndexed);
+}
+
+bool CBlockTreeDB::ReadIndexSnapshot(uint256 &hashChecksum) {
+    return Read(DB_INDEX_SNAPSHOT, hashChecksum);
+}
+
+bool CBlockTreeDB::WriteIndexSnapshot(const uint256 &hashChecksum) {
+    return Write(DB_INDEX_SNAPSHOT, hashChecksum, true);
+}
+
+bool CBlockTreeDB::EraseIndexSnapshot() {
+    return Erase(DB_INDEX_SNAPSHOT, true);
+}
+
 bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes) {
 
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
@@ -19,6 +19,7 @@ class CBlockIndex;
 struct CDiskTxPos;
 struct CAddressUnspentKey;
 struct CAddressUnspentValue;
+struct CAddressBalance;
 struct CAddressIndexKey;
 struct CAddressIndexIteratorKey;
 struct CAddressIndexIteratorHeightKey;
@@ -26,6 +27,7 @@ struct CTimestampIndexKey;
 struct CTimestampIndexIteratorKey;
 struct CSpentIndexKey;
 struct CSpentIndexValue;
+struct CIndexUpdate;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -34,20 +36,38 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! largest share (%) of the chainstate cache given to the block cache during initial block download
+static const int DEFAULT_IBD_BLOCK_CACHE_PERCENT = 10;
+
+/**
+ * LevelDB tuning of the "chainstate" or "index" database, with -<name>dbcompression,
+ * -<name>dbblocksize (KiB), -<name>dbmaxopenfiles and -<name>dbblockcache (%) applied.
+ * The initial block download profile favours write buffers over the block cache.
+ */
+CDBProfile GetDBProfile(const std::string& strName, bool fInitialDownload);
 
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+    bool fInitialDownloadProfile;
 public:
+    //! Opens with the initial block download profile when wiping, with the regular one otherwise
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool IsInitialDownloadProfile() const { return fInitialDownloadProfile; }
+    //! Reopen the database with the initial block download or the regular profile. Returns false while it is being iterated.
+    bool SetInitialDownloadProfile(bool fInitialDownload);
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Convert per-transaction records left by older versions to per-output ones. Returns false on failure or shutdown.
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -71,13 +91,31 @@ public:
     bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
                                  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    bool ReadAddressUnspentIndexPage(uint160 addressHash, int type, const CAddressUnspentKey &keyStart, size_t nLimit,
+                                     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect, CAddressUnspentKey &keyNext, bool &fMore);
     bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                           int start = 0, int end = 0);
+    //! Read at most nLimit entries of one address from keyStart on (and the rest of the last transaction if fWholeTransactions); fMore tells whether keyNext starts another page
+    bool ReadAddressIndexPage(uint160 addressHash, int type, const CAddressIndexKey &keyStart, int end, size_t nLimit, bool fWholeTransactions,
+                              std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, CAddressIndexKey &keyNext, bool &fMore);
+    bool ReadAddressBalance(uint160 addressHash, int type, CAddressBalance &balance);
+    //! Derive the per-address totals from the address index, for databases written before they existed
+    bool BuildAddressBalances();
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &vect);
+    //! Apply the index changes of consecutive blocks in one batch and record the block they bring the indexes to
+    bool WriteIndexUpdates(const std::vector<CIndexUpdate> &vUpdates, const uint256 &hashBestIndexed);
+    bool ReadBestIndexed(uint256 &hashBestIndexed);
+    bool WriteBestIndexed(const uint256 &hashBestIndexed);
+    //! Checksum of the block index snapshot that matches this database, if there is one
+    bool ReadIndexSnapshot(uint256 &hashChecksum);
+    //! Synchronously record the checksum of a matching block index snapshot
+    bool WriteIndexSnapshot(const uint256 &hashChecksum);
+    //! Synchronously forget the block index snapshot, it no longer matches
+    bool EraseIndexSnapshot();
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -34,6 +34,7 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nCountWithDescendants = 1;
     nSizeWithDescendants = nTxSize;
     nModFeesWithDescendants = nFee;
+    nCountWithAncestors = 1;
     CAmount nValueIn = tx.GetValueOut()+nFee;
     assert(inChainInputValue <= nValueIn);
 
@@ -66,6 +67,12 @@ void CTxMemPoolEntry::UpdateLockPoints(const LockPoints& lp)
     lockPoints = lp;
 }
 
+void CTxMemPoolEntry::UpdateAncestorCount(uint64_t count)
+{
+    assert(count > 0);
+    nCountWithAncestors = count;
+}
+
 // Update the given tx for any in-mempool descendants.
 // Assumes that setMemPoolChildren is correct for the given tx and all
 // descendants.
@@ -145,6 +152,10 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // accounted for in the state of their ancestors)
     std::set<uint256> setAlreadyIncluded(vHashesToUpdate.begin(), vHashesToUpdate.end());
 
+    // Entries outside vHashesToUpdate that gained a parent from the block, so
+    // the ancestor counts of them and their descendants are stale.
+    setEntries setRelinked;
+
     // Iterate in reverse, so that whenever we are looking at at a transaction
     // we are sure that all in-mempool descendants have already been processed.
     // This maximizes the benefit of the descendant cache and guarantees that
@@ -170,6 +181,7 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
             if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
                 UpdateChild(it, childIter, true);
                 UpdateParent(childIter, it, true);
+                setRelinked.insert(childIter);
             }
         }
         if (!UpdateForDescendants(it, 100, mapMemPoolDescendantsToUpdate, setAlreadyIncluded)) {
@@ -177,6 +189,16 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
             mapTx.modify(it, set_dirty());
         }
     }
+
+    // Unlike the descendant state, ancestor counts are always recomputed; the
+    // links are complete now, so a single pass over the affected entries does.
+    setEntries setRecount;
+    BOOST_FOREACH(txiter relinkedIt, setRelinked) {
+        CalculateDescendants(relinkedIt, setRecount);
+    }
+    BOOST_FOREACH(txiter recountIt, setRecount) {
+        UpdateAncestorCount(recountIt);
+    }
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */)
@@ -269,6 +291,17 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove)
     // For each entry, walk back all ancestors and decrement size associated with this
     // transaction
     const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+
+    // Descendants that stay in the mempool lose ancestors; collect them while
+    // the child links are still intact. This is empty for recursive removals.
+    setEntries setRecount;
+    BOOST_FOREACH(txiter removeIt, entriesToRemove) {
+        BOOST_FOREACH(txiter childIt, GetMemPoolChildren(removeIt)) {
+            if (!entriesToRemove.count(childIt))
+                CalculateDescendants(childIt, setRecount);
+        }
+    }
+
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
         setEntries setAncestors;
         const CTxMemPoolEntry &entry = *removeIt;
@@ -304,6 +337,27 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove)
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
         UpdateChildrenForRemoval(removeIt);
     }
+    BOOST_FOREACH(txiter recountIt, setRecount) {
+        if (!entriesToRemove.count(recountIt))
+            UpdateAncestorCount(recountIt);
+    }
+}
+
+void CTxMemPool::UpdateAncestorCount(txiter entry)
+{
+    setEntries setAncestors;
+    setEntries stage = GetMemPoolParents(entry);
+    while (!stage.empty()) {
+        txiter it = *stage.begin();
+        stage.erase(it);
+        if (!setAncestors.insert(it).second)
+            continue;
+        BOOST_FOREACH(txiter parentIt, GetMemPoolParents(it)) {
+            if (!setAncestors.count(parentIt))
+                stage.insert(parentIt);
+        }
+    }
+    mapTx.modify(entry, update_ancestor_count(setAncestors.size() + 1));
 }
 
 void CTxMemPoolEntry::SetDirty()
@@ -343,17 +397,10 @@ CTxMemPool::~CTxMemPool()
     delete minerPolicyEstimator;
 }
 
-void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
+bool CTxMemPool::isSpent(const COutPoint& outpoint)
 {
     LOCK(cs);
-
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
-    }
+    return mapNextTx.count(outpoint);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -414,6 +461,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
         }
     }
     UpdateAncestorsOf(true, newit, setAncestors);
+    mapTx.modify(newit, update_ancestor_count(setAncestors.size() + 1));
 
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
@@ -663,9 +711,9 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
                 if (it2 != mapTx.end())
                     continue;
-                const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
-		if (nCheckFrequency != 0) assert(coins);
-                if (!coins || (coins->IsCoinBase() && ((signed long)nMemPoolHeight) - coins->nHeight < COINBASE_MATURITY)) {
+                const Coin &coin = pcoins->AccessCoin(txin.prevout);
+                if (nCheckFrequency != 0) assert(!coin.IsSpent());
+                if (coin.IsSpent() || (coin.IsCoinBase() && ((signed long)nMemPoolHeight) - coin.nHeight < COINBASE_MATURITY)) {
                     transactionsToRemove.push_back(tx);
                     break;
                 }
@@ -784,8 +832,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 fDependsWait = true;
                 setParentCheck.insert(it2);
             } else {
-                const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
-                assert(coins && coins->IsAvailable(txin.prevout.n));
+                assert(pcoins->HaveCoin(txin.prevout));
             }
             // Check whether its inputs are marked in mapNextTx.
             std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
@@ -795,6 +842,16 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             i++;
         }
         assert(setParentCheck == GetMemPoolParents(it));
+        // Check the cached ancestor count against a walk of the parent links
+        setEntries setAncestorCheck;
+        setEntries stageAncestors = setParentCheck;
+        while (!stageAncestors.empty()) {
+            txiter ait = *stageAncestors.begin();
+            stageAncestors.erase(ait);
+            if (setAncestorCheck.insert(ait).second)
+                stageAncestors.insert(GetMemPoolParents(ait).begin(), GetMemPoolParents(ait).end());
+        }
+        assert(it->GetCountWithAncestors() == setAncestorCheck.size() + 1);
         // Check children against mapNextTx
         CTxMemPool::setEntries setChildrenCheck;
         std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(it->GetTx().GetHash(), 0));
@@ -865,6 +922,38 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
         vtxid.push_back(mi->GetTx().GetHash());
 }
 
+namespace {
+/** Announcement order of mempool entries, each paired with its number of in-mempool ancestors */
+class CompareInvMempoolOrder
+{
+public:
+    bool operator()(const std::pair<uint64_t, CTxMemPool::txiter>& a, const std::pair<uint64_t, CTxMemPool::txiter>& b) const
+    {
+        if (a.first != b.first)
+            return a.first < b.first;
+        return CompareTxMemPoolEntryByScore()(*a.second, *b.second);
+    }
+};
+}
+
+void CTxMemPool::SortForRelay(std::vector<uint256>& vHashes)
+{
+    LOCK(cs);
+    std::vector<std::pair<uint64_t, txiter> > vEntries;
+    vEntries.reserve(vHashes.size());
+    BOOST_FOREACH(const uint256& hash, vHashes) {
+        txiter it = mapTx.find(hash);
+        if (it == mapTx.end())
+            continue;
+        vEntries.push_back(std::make_pair(it->GetCountWithAncestors(), it));
+    }
+    std::sort(vEntries.begin(), vEntries.end(), CompareInvMempoolOrder());
+
+    vHashes.clear();
+    for (size_t i = 0; i < vEntries.size(); i++)
+        vHashes.push_back(vEntries[i].second->GetTx().GetHash());
+}
+
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
@@ -874,6 +963,15 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+bool CTxMemPool::lookupOutput(const COutPoint& outpoint, CTxOut& result) const
+{
+    LOCK(cs);
+    indexed_transaction_set::const_iterator i = mapTx.find(outpoint.hash);
+    if (i == mapTx.end() || outpoint.n >= i->GetTx().vout.size()) return false;
+    result = i->GetTx().vout[outpoint.n];
+    return true;
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
@@ -980,20 +1078,21 @@ bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
 
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView *baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
-bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
+bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
+    CTxOut txout;
+    if (mempool.lookupOutput(outpoint, txout)) {
+        coin = Coin(txout, MEMPOOL_HEIGHT, false);
         return true;
     }
-    return (base->GetCoins(txid, coins) && !coins.IsPruned());
+    return base->GetCoin(outpoint, coin);
 }
 
-bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
-    return mempool.exists(txid) || base->HaveCoins(txid);
+bool CCoinsViewMemPool::HaveCoin(const COutPoint &outpoint) const {
+    CTxOut txout;
+    return mempool.lookupOutput(outpoint, txout) || base->HaveCoin(outpoint);
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
@@ -1104,7 +1203,7 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
-void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining) {
+void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
     LOCK(cs);
 
     unsigned nTxnRemoved = 0;
@@ -1137,9 +1236,8 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
                 BOOST_FOREACH(const CTxIn& txin, tx.vin) {
                     if (exists(txin.prevout.hash))
                         continue;
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(txin.prevout.hash, 0));
-                    if (it == mapNextTx.end() || it->first.hash != txin.prevout.hash)
-                        pvNoSpendsRemaining->push_back(txin.prevout.hash);
+                    if (!mapNextTx.count(txin.prevout))
+                        pvNoSpendsRemaining->push_back(txin.prevout);
                 }
             }
         }
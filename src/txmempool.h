@@ -36,7 +36,7 @@ inline bool AllowFree(double dPriority)
 }
 
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 struct LockPoints
@@ -100,6 +100,10 @@ private:
     uint64_t nSizeWithDescendants;  //! ... and size
     CAmount nModFeesWithDescendants;  //! ... and total fees (all including us)
 
+    // Number of in-mempool ancestors of this transaction, including itself.
+    // Unlike the descendant state this is never left dirty.
+    uint64_t nCountWithAncestors;
+
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
@@ -130,6 +134,8 @@ public:
     void UpdateFeeDelta(int64_t feeDelta);
     // Update the LockPoints after a reorg
     void UpdateLockPoints(const LockPoints& lp);
+    // Set the ancestor count after the in-mempool parents changed
+    void UpdateAncestorCount(uint64_t count);
 
     /** We can set the entry to be dirty if doing the full calculation of in-
      *  mempool descendants will be too expensive, which can potentially happen
@@ -142,6 +148,8 @@ public:
     uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
     CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
 
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+
     bool GetSpendsCoinbase() const { return spendsCoinbase; }
 };
 
@@ -187,6 +195,16 @@ private:
     const LockPoints& lp;
 };
 
+struct update_ancestor_count
+{
+    update_ancestor_count(uint64_t _count) : count(_count) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateAncestorCount(count); }
+
+private:
+    uint64_t count;
+};
+
 // extracts a TxMemPoolEntry's transaction hash
 struct mempoolentry_txid
 {
@@ -482,7 +500,14 @@ public:
     void clear();
     void _clear(); //lock free
     void queryHashes(std::vector<uint256>& vtxid);
-    void pruneSpent(const uint256& hash, CCoins &coins);
+    /**
+     * Sort vHashes in the order their transactions should be announced: fewest
+     * in-mempool ancestors first (using the count cached in each entry), so
+     * parents go out before their children, then by fee rate. Hashes no longer
+     * in the mempool are dropped.
+     */
+    void SortForRelay(std::vector<uint256>& vHashes);
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
     /**
@@ -539,10 +564,10 @@ public:
     CFeeRate GetMinFee(size_t sizelimit) const;
 
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
-      *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
+      *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
       */
-    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
+    void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining=NULL);
 
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
@@ -566,6 +591,8 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** Like lookup(), but only copies the requested output */
+    bool lookupOutput(const COutPoint& outpoint, CTxOut& result) const;
 
     /** Estimate fee rate needed to get into the next nBlocks
      *  If no answer can be given at nBlocks, return an estimate
@@ -618,6 +645,8 @@ private:
     void UpdateForRemoveFromMempool(const setEntries &entriesToRemove);
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry);
+    /** Recount the in-mempool ancestors of entry from its setMemPoolParents. */
+    void UpdateAncestorCount(txiter entry);
 
     /** Before calling removeUnchecked for a given transaction,
      *  UpdateForRemoveFromMempool must be called on the entire (dependent) set
@@ -641,8 +670,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView *baseIn, CTxMemPool &mempoolIn);
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
 };
 
 // We want to sort transactions by coin age priority
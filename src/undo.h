@@ -6,65 +6,104 @@
 #ifndef BITCOIN_UNDO_H
 #define BITCOIN_UNDO_H
 
-#include "compressor.h" 
+#include "coins.h"
+#include "compressor.h"
+#include "consensus/consensus.h"
 #include "primitives/transaction.h"
 #include "serialize.h"
+#include "version.h"
 
 /** Undo information for a CTxIn
  *
- *  Contains the prevout's CTxOut being spent, and if this was the
- *  last output of the affected transaction, its metadata as well
- *  (coinbase or not, height, transaction version)
+ *  Contains the prevout's CTxOut being spent, and its metadata as well
+ *  (coinbase or not, height). Earlier versions also stored the transaction
+ *  version, and only recorded the metadata for the last spent output of a
+ *  transaction; a height of 0 marks such records.
  */
-class CTxInUndo
+class TxInUndoSerializer
 {
-public:
-    CTxOut txout;         // the txout data before being spent
-    bool fCoinBase;       // if the outpoint was the last unspent: whether it belonged to a coinbase
-    unsigned int nHeight; // if the outpoint was the last unspent: its height
-    int nVersion;         // if the outpoint was the last unspent: its version
+    const Coin* txout;
 
-    CTxInUndo() : txout(), fCoinBase(false), nHeight(0), nVersion(0) {}
-    CTxInUndo(const CTxOut &txoutIn, bool fCoinBaseIn = false, unsigned int nHeightIn = 0, int nVersionIn = 0) : txout(txoutIn), fCoinBase(fCoinBaseIn), nHeight(nHeightIn), nVersion(nVersionIn) { }
+public:
+    TxInUndoSerializer(const Coin* coin) : txout(coin) {}
 
     unsigned int GetSerializeSize(int nType, int nVersion) const {
-        return ::GetSerializeSize(VARINT(nHeight*2+(fCoinBase ? 1 : 0)), nType, nVersion) +
-               (nHeight > 0 ? ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion) : 0) +
-               ::GetSerializeSize(CTxOutCompressor(REF(txout)), nType, nVersion);
+        return ::GetSerializeSize(VARINT(txout->nHeight * 2 + (txout->fCoinBase ? 1 : 0)), nType, nVersion) +
+               (txout->nHeight > 0 ? 1 : 0) +
+               ::GetSerializeSize(CTxOutCompressor(REF(txout->out)), nType, nVersion);
     }
 
     template<typename Stream>
     void Serialize(Stream &s, int nType, int nVersion) const {
-        ::Serialize(s, VARINT(nHeight*2+(fCoinBase ? 1 : 0)), nType, nVersion);
-        if (nHeight > 0)
-            ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Serialize(s, CTxOutCompressor(REF(txout)), nType, nVersion);
+        ::Serialize(s, VARINT(txout->nHeight * 2 + (txout->fCoinBase ? 1 : 0)), nType, nVersion);
+        if (txout->nHeight > 0) {
+            // Required to maintain compatibility with older undo format.
+            ::Serialize(s, (unsigned char)0, nType, nVersion);
+        }
+        ::Serialize(s, CTxOutCompressor(REF(txout->out)), nType, nVersion);
     }
+};
+
+class TxInUndoDeserializer
+{
+    Coin* txout;
+
+public:
+    TxInUndoDeserializer(Coin* coin) : txout(coin) {}
 
     template<typename Stream>
     void Unserialize(Stream &s, int nType, int nVersion) {
         unsigned int nCode = 0;
         ::Unserialize(s, VARINT(nCode), nType, nVersion);
-        nHeight = nCode / 2;
-        fCoinBase = nCode & 1;
-        if (nHeight > 0)
-            ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Unserialize(s, REF(CTxOutCompressor(REF(txout))), nType, nVersion);
+        txout->nHeight = nCode / 2;
+        txout->fCoinBase = nCode & 1;
+        if (txout->nHeight > 0) {
+            // Old versions stored the version number for the last spend of
+            // a transaction's outputs. Non-final spends were indicated with
+            // height = 0.
+            int nVersionDummy;
+            ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        }
+        ::Unserialize(s, REF(CTxOutCompressor(REF(txout->out))), nType, nVersion);
     }
 };
 
+static const size_t MIN_TRANSACTION_INPUT_SIZE = ::GetSerializeSize(CTxIn(), SER_NETWORK, PROTOCOL_VERSION);
+static const size_t MAX_INPUTS_PER_BLOCK = MAX_BLOCK_SIZE / MIN_TRANSACTION_INPUT_SIZE;
+
 /** Undo information for a CTransaction */
 class CTxUndo
 {
 public:
     // undo information for all txins
-    std::vector<CTxInUndo> vprevout;
+    std::vector<Coin> vprevout;
 
-    ADD_SERIALIZE_METHODS;
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        unsigned int nSize = GetSizeOfCompactSize(vprevout.size());
+        for (size_t i = 0; i < vprevout.size(); i++)
+            nSize += TxInUndoSerializer(&vprevout[i]).GetSerializeSize(nType, nVersion);
+        return nSize;
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
-        READWRITE(vprevout);
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        // same layout as a vector of records, each Coin goes through TxInUndoSerializer
+        WriteCompactSize(s, vprevout.size());
+        for (size_t i = 0; i < vprevout.size(); i++)
+            ::Serialize(s, TxInUndoSerializer(&vprevout[i]), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        uint64_t count = ReadCompactSize(s);
+        if (count > MAX_INPUTS_PER_BLOCK) {
+            throw std::ios_base::failure("Too many input undo records");
+        }
+        vprevout.resize(count);
+        for (size_t i = 0; i < vprevout.size(); i++) {
+            TxInUndoDeserializer deserializer(&vprevout[i]);
+            ::Unserialize(s, deserializer, nType, nVersion);
+        }
     }
 };
 
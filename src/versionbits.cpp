@@ -117,7 +117,21 @@ public:
 
 ThresholdState VersionBitsState(const CBlockIndex* pindexPrev, const Consensus::Params& params, Consensus::DeploymentPos pos, VersionBitsCache& cache)
 {
-    return VersionBitsConditionChecker(pos).GetStateFor(pindexPrev, params, cache.caches[pos]);
+    const CBlockIndex* plast = cache.plastPrev[pos];
+    if (pindexPrev != NULL && plast != NULL) {
+        // A parent and child share their state unless the child starts a new period.
+        int nPeriod = params.nMinerConfirmationWindow;
+        if (pindexPrev == plast ||
+            (pindexPrev->pprev == plast && (pindexPrev->nHeight + 1) % nPeriod != 0) ||
+            (plast->pprev == pindexPrev && (plast->nHeight + 1) % nPeriod != 0)) {
+            cache.plastPrev[pos] = pindexPrev;
+            return cache.lastState[pos];
+        }
+    }
+    ThresholdState state = VersionBitsConditionChecker(pos).GetStateFor(pindexPrev, params, cache.caches[pos]);
+    cache.plastPrev[pos] = pindexPrev;
+    cache.lastState[pos] = state;
+    return state;
 }
 
 uint32_t VersionBitsMask(const Consensus::Params& params, Consensus::DeploymentPos pos)
@@ -129,5 +143,7 @@ void VersionBitsCache::Clear()
 {
     for (unsigned int d = 0; d < Consensus::MAX_VERSION_BITS_DEPLOYMENTS; d++) {
         caches[d].clear();
+        plastPrev[d] = NULL;
+        lastState[d] = THRESHOLD_DEFINED;
     }
 }
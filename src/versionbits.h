@@ -50,6 +50,12 @@ struct VersionBitsCache
 {
     ThresholdConditionCache caches[Consensus::MAX_VERSION_BITS_DEPLOYMENTS];
 
+    // The last answer per deployment. Neighbouring blocks in the same period share it,
+    // which covers connecting blocks one after another without a lookup in caches.
+    const CBlockIndex* plastPrev[Consensus::MAX_VERSION_BITS_DEPLOYMENTS];
+    ThresholdState lastState[Consensus::MAX_VERSION_BITS_DEPLOYMENTS];
+
+    VersionBitsCache() { Clear(); }
     void Clear();
 };
 
@@ -284,6 +284,16 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn, bool fForMixin
     return true;
 }
 
+bool CCryptoKeyStore::EncryptKey(const CKey& key, const CPubKey& pubkey, std::vector<unsigned char>& vchCryptedSecret) const
+{
+    LOCK(cs_KeyStore);
+    if (IsLocked(true))
+        return false;
+
+    CKeyingMaterial vchSecret(key.begin(), key.end());
+    return EncryptSecret(vMasterKey, vchSecret, pubkey.GetHash(), vchCryptedSecret);
+}
+
 bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     {
@@ -291,12 +301,8 @@ bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
         if (!IsCrypted())
             return CBasicKeyStore::AddKeyPubKey(key, pubkey);
 
-        if (IsLocked(true))
-            return false;
-
         std::vector<unsigned char> vchCryptedSecret;
-        CKeyingMaterial vchSecret(key.begin(), key.end());
-        if (!EncryptSecret(vMasterKey, vchSecret, pubkey.GetHash(), vchCryptedSecret))
+        if (!EncryptKey(key, pubkey, vchCryptedSecret))
             return false;
 
         if (!AddCryptedKey(pubkey, vchCryptedSecret))
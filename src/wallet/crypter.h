@@ -139,6 +139,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn, bool fForMixingOnly = false);
 
+    //! Encrypt key with the master key without storing it, fails while locked
+    bool EncryptKey(const CKey& key, const CPubKey& pubkey, std::vector<unsigned char>& vchCryptedSecret) const;
+
 public:
     CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false), fOnlyMixingAllowed(false)
     {
@@ -34,6 +34,8 @@
 #include "spork.h"
 
 #include <assert.h>
+#include <atomic>
+#include <limits>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -133,14 +135,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
 
-    // check if we need to remove from watch-only
-    CScript script;
-    script = GetScriptForDestination(pubkey.GetID());
-    if (HaveWatchOnly(script))
-        RemoveWatchOnly(script);
-    script = GetScriptForRawPubKey(pubkey);
-    if (HaveWatchOnly(script))
-        RemoveWatchOnly(script);
+    RemoveWatchOnlyKey(pubkey);
 
     if (!fFileBacked)
         return true;
@@ -152,6 +147,18 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     return true;
 }
 
+void CWallet::RemoveWatchOnlyKey(const CPubKey &pubkey)
+{
+    // check if we need to remove from watch-only
+    CScript script;
+    script = GetScriptForDestination(pubkey.GetID());
+    if (HaveWatchOnly(script))
+        RemoveWatchOnly(script);
+    script = GetScriptForRawPubKey(pubkey);
+    if (HaveWatchOnly(script))
+        RemoveWatchOnly(script);
+}
+
 bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
                             const vector<unsigned char> &vchCryptedSecret)
 {
@@ -686,6 +693,7 @@ void CWallet::MarkDirty()
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fDenomLedgerBuilt = false;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
@@ -699,6 +707,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        // rounds can't be resolved until every transaction is loaded
+        fDenomLedgerBuilt = false;
         BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
             if (mapWallet.count(txin.prevout.hash)) {
                 CWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -769,6 +779,17 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
             AddToSpends(hash);
         }
 
+        // an update may follow a rescan that made more of its outputs ours, or
+        // a disconnect that made the outputs it spends spendable again
+        AddToDenomLedger(wtx);
+        if (fDenomLedgerBuilt && !wtx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+                if (mi != mapWallet.end() && txin.prevout.n < mi->second.vout.size())
+                    AddOutputToDenomLedger(mi->second, txin.prevout.n);
+            }
+        }
+
         bool fUpdated = false;
         if (!fInsertedNew)
         {
@@ -1154,6 +1175,80 @@ bool CWallet::IsDenominatedAmount(CAmount nInputAmount) const
     return false;
 }
 
+void CWallet::AddToDenomLedger(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_wallet);
+    if (!fDenomLedgerBuilt)
+        return;
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        AddOutputToDenomLedger(wtx, i);
+}
+
+void CWallet::AddOutputToDenomLedger(const CWalletTx& wtx, unsigned int n) const
+{
+    AssertLockHeld(cs_wallet);
+    if (!fDenomLedgerBuilt)
+        return;
+
+    const uint256& hash = wtx.GetHash();
+    if (!IsDenominatedAmount(wtx.vout[n].nValue) || IsMine(wtx.vout[n]) != ISMINE_SPENDABLE) return;
+    if (IsSpentInChain(hash, n)) return;
+    int nRounds = GetRealInputPrivateSendRounds(CTxIn(hash, n), 0);
+    mapDenomLedger[wtx.vout[n].nValue][nRounds].insert(COutPoint(hash, n));
+}
+
+bool CWallet::IsSpentInChain(const uint256& hash, unsigned int n) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, n));
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            return true;
+    }
+    return false;
+}
+
+void CWallet::GetDenomLedgerOutputs(std::vector<std::pair<const CWalletTx*, unsigned int> >& vOutputsRet, CAmount nAmount, int nRoundsMin, int nRoundsMax) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    vOutputsRet.clear();
+
+    if (!fDenomLedgerBuilt) {
+        mapDenomLedger.clear();
+        fDenomLedgerBuilt = true;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            AddToDenomLedger(it->second);
+        LogPrint("privatesend", "CWallet::GetDenomLedgerOutputs -- built denomination ledger from %u transactions\n", mapWallet.size());
+    }
+
+    for (std::map<CAmount, DenomRoundsMap>::iterator itDenom = mapDenomLedger.begin(); itDenom != mapDenomLedger.end(); ++itDenom) {
+        if (nAmount != 0 && itDenom->first != nAmount) continue;
+        for (DenomRoundsMap::iterator itRounds = itDenom->second.begin(); itRounds != itDenom->second.end(); ++itRounds) {
+            int nRounds = std::min(itRounds->first, nPrivateSendRounds);
+            if (nRounds < nRoundsMin || nRounds >= nRoundsMax) continue;
+            std::set<COutPoint>& setOutpoints = itRounds->second;
+            for (std::set<COutPoint>::iterator itOut = setOutpoints.begin(); itOut != setOutpoints.end(); ) {
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(itOut->hash);
+                if (mi == mapWallet.end()) {
+                    // zapped from the wallet
+                    setOutpoints.erase(itOut++);
+                    continue;
+                }
+                if (IsSpentInChain(itOut->hash, itOut->n)) {
+                    // spent for good unless its block is disconnected, see AddToWallet
+                    setOutpoints.erase(itOut++);
+                    continue;
+                }
+                if (!IsSpent(itOut->hash, itOut->n))
+                    vOutputsRet.push_back(std::make_pair(&mi->second, itOut->n));
+                ++itOut;
+            }
+        }
+    }
+}
+
 isminetype CWallet::IsMine(const CTxOut& txout) const
 {
     return ::IsMine(*this, txout.scriptPubKey);
@@ -1386,6 +1481,118 @@ bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
     return pwalletdb->WriteTx(GetHash(), *this);
 }
 
+/**
+ * Read-ahead pipeline used by ScanForWalletTransactions. Reader threads load
+ * and deserialize blocks from disk and check their outputs against the
+ * wallet's keys, while the scanning thread applies the blocks strictly in
+ * chain order. At most vSlots.size() blocks are held in memory at once.
+ */
+class CWalletRescanPipeline
+{
+public:
+    struct CSlot {
+        CBlock block;
+        //! Per transaction: does any of its outputs belong to the wallet
+        std::vector<bool> vfMine;
+        unsigned int nSize;
+        bool fReady;
+
+        CSlot() : nSize(0), fReady(false) {}
+    };
+
+private:
+    const CWallet& wallet;
+    const std::vector<CBlockIndex*>& vIndex;
+    const Consensus::Params& consensusParams;
+    std::vector<CSlot> vSlots;
+
+    boost::mutex mutex;
+    //! Signalled when a reader has finished a slot
+    boost::condition_variable condReady;
+    //! Signalled when the scanner has released a slot
+    boost::condition_variable condFree;
+    //! Next block to be claimed by a reader
+    size_t nNext;
+    //! Number of blocks the scanner has released
+    size_t nReleased;
+    bool fStop;
+
+    boost::thread_group threads;
+
+    void ThreadRead()
+    {
+        RenameThread("growth-rescan");
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNext < vIndex.size() && nNext >= nReleased + vSlots.size())
+                    condFree.wait(lock);
+                if (fStop || nNext >= vIndex.size())
+                    return;
+                i = nNext++;
+            }
+
+            // The slot is ours alone until it is marked ready: the block that
+            // previously occupied it has already been released by the scanner.
+            CSlot& slot = vSlots[i % vSlots.size()];
+            slot.block.SetNull();
+            slot.vfMine.clear();
+            if (!ReadBlockFromDisk(slot.block, vIndex[i], consensusParams))
+                slot.block.SetNull();
+            slot.nSize = ::GetSerializeSize(slot.block, SER_NETWORK, PROTOCOL_VERSION);
+            slot.vfMine.reserve(slot.block.vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, slot.block.vtx)
+                slot.vfMine.push_back(wallet.IsMine(tx));
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                slot.fReady = true;
+            }
+            condReady.notify_all();
+        }
+    }
+
+public:
+    CWalletRescanPipeline(const CWallet& walletIn, const std::vector<CBlockIndex*>& vIndexIn, const Consensus::Params& consensusParamsIn, int nThreads, int nReadAhead) :
+        wallet(walletIn), vIndex(vIndexIn), consensusParams(consensusParamsIn), vSlots(std::max(nReadAhead, nThreads)), nNext(0), nReleased(0), fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CWalletRescanPipeline::ThreadRead, this));
+    }
+
+    ~CWalletRescanPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condFree.notify_all();
+        threads.join_all();
+    }
+
+    /** Wait for block i to be read; the slot stays valid until Release(i) */
+    CSlot& Get(size_t i)
+    {
+        CSlot& slot = vSlots[i % vSlots.size()];
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!slot.fReady)
+            condReady.wait(lock);
+        return slot;
+    }
+
+    /** Hand the slot of block i back to the readers */
+    void Release(size_t i)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vSlots[i % vSlots.size()].fReady = false;
+            nReleased = i + 1;
+        }
+        condFree.notify_all();
+    }
+};
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
@@ -1397,6 +1604,12 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    // -rescanthreads=0 means autodetect
+    int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+
     CBlockIndex* pindex = pindexStart;
     {
         LOCK2(cs_main, cs_wallet);
@@ -1406,27 +1619,56 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        // cs_main is held for the whole scan, so the chain cannot move under the readers
+        std::vector<CBlockIndex*> vIndex;
+        for (CBlockIndex* pindexScan = pindex; pindexScan; pindexScan = chainActive.Next(pindexScan))
+            vIndex.push_back(pindexScan);
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
+
+        int64_t nTimeStart = GetTimeMicros();
+        uint64_t nTxCount = 0;
+        uint64_t nBytes = 0;
+        if (!vIndex.empty())
+            LogPrintf("Rescanning %u blocks from height %d using %d reader threads\n", vIndex.size(), pindex->nHeight, nThreads);
+
+        CWalletRescanPipeline pipeline(*this, vIndex, chainParams.GetConsensus(), nThreads, RESCAN_READAHEAD_BLOCKS);
+        for (size_t i = 0; i < vIndex.size(); i++)
         {
+            pindex = vIndex[i];
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            const CWalletRescanPipeline::CSlot& slot = pipeline.Get(i);
+            for (size_t j = 0; j < slot.block.vtx.size(); j++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                const CTransaction& tx = slot.block.vtx[j];
+                // Transactions that neither pay us nor touch anything the wallet
+                // already knows about cannot be added, so skip them cheaply.
+                bool fRelevant = slot.vfMine[j] || mapWallet.count(tx.GetHash());
+                for (size_t k = 0; !fRelevant && k < tx.vin.size(); k++)
+                    fRelevant = mapWallet.count(tx.vin[k].prevout.hash) || mapTxSpends.count(tx.vin[k].prevout);
+                if (fRelevant && AddToWalletIfInvolvingMe(tx, &slot.block, fUpdate))
                     ret++;
             }
-            pindex = chainActive.Next(pindex);
+            nTxCount += slot.block.vtx.size();
+            nBytes += slot.nSize;
+            pipeline.Release(i);
+
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                double dElapsed = std::max((int64_t)1, GetTimeMicros() - nTimeStart) * 0.000001;
+                LogPrintf("Still rescanning. At block %d. Progress=%f (%.1f blocks/s, %.1f tx/s, %.2f MB/s)\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex),
+                    (i + 1) / dElapsed, nTxCount / dElapsed, nBytes / dElapsed / 1000000);
             }
         }
+        if (!vIndex.empty()) {
+            double dElapsed = std::max((int64_t)1, GetTimeMicros() - nTimeStart) * 0.000001;
+            LogPrintf("Rescan completed: %u blocks, %u transactions, %.2f MB in %.2fs (%.1f blocks/s, %.1f tx/s), %d wallet transactions found\n",
+                vIndex.size(), nTxCount, nBytes / 1000000.0, dElapsed, vIndex.size() / dElapsed, nTxCount / dElapsed, ret);
+        }
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
     return ret;
@@ -1884,12 +2126,18 @@ CAmount CWallet::GetAnonymizedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<std::pair<const CWalletTx*, unsigned int> > vOutputs;
+        GetDenomLedgerOutputs(vOutputs, 0, nPrivateSendRounds, std::numeric_limits<int>::max());
+        for (unsigned int i = 0; i < vOutputs.size(); i++)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = vOutputs[i].first;
+
+            // Must wait until coinbase is safely deep enough in the chain before valuing it
+            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+                continue;
 
             if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
+                nTotal += pcoin->vout[vOutputs[i].second].nValue;
         }
     }
 
@@ -1994,11 +2242,23 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<std::pair<const CWalletTx*, unsigned int> > vOutputs;
+        GetDenomLedgerOutputs(vOutputs, 0, std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+        for (unsigned int i = 0; i < vOutputs.size(); i++)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = vOutputs[i].first;
 
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
+            // Must wait until coinbase is safely deep enough in the chain before valuing it
+            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+                continue;
+
+            int nDepth = pcoin->GetDepthInMainChain(false);
+            if (nDepth < 0) continue;
+
+            bool isUnconfirmed = pcoin->IsTrusted() && nDepth == 0;
+            if (unconfirmed != isUnconfirmed) continue;
+
+            nTotal += pcoin->vout[vOutputs[i].second].nValue;
         }
     }
 
@@ -2489,11 +2749,6 @@ bool CWallet::SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount
     vCoinsRet.clear();
     nValueRet = 0;
 
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, ONLY_DENOMINATED);
-
-    std::random_shuffle(vCoins.rbegin(), vCoins.rend(), GetRandInt);
-
     // ( bit on if present )
     // bit 0 - 100GRW+1
     // bit 1 - 10GRW+1
@@ -2505,6 +2760,37 @@ bool CWallet::SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount
         return false;
     }
 
+    // Only look at the ledger entries of the requested denominations and
+    // rounds, applying the same checks AvailableCoins(ONLY_DENOMINATED) does
+    vector<COutput> vCoins;
+    {
+        LOCK2(cs_main, cs_wallet);
+        std::vector<std::pair<const CWalletTx*, unsigned int> > vOutputs;
+        BOOST_FOREACH(int nBit, vecBits) {
+            GetDenomLedgerOutputs(vOutputs, vecPrivateSendDenominations[nBit], nPrivateSendRoundsMin, nPrivateSendRoundsMax);
+            for (unsigned int i = 0; i < vOutputs.size(); i++) {
+                const CWalletTx* pcoin = vOutputs[i].first;
+                unsigned int n = vOutputs[i].second;
+
+                if (!CheckFinalTx(*pcoin) || !pcoin->IsTrusted())
+                    continue;
+                if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+                    continue;
+
+                int nDepth = pcoin->GetDepthInMainChain(false);
+                // We should not consider coins which aren't at least in our mempool
+                if (nDepth == 0 && !pcoin->InMempool())
+                    continue;
+                if (IsLockedCoin(pcoin->GetHash(), n))
+                    continue;
+
+                vCoins.push_back(COutput(pcoin, n, nDepth, true));
+            }
+        }
+    }
+
+    std::random_shuffle(vCoins.rbegin(), vCoins.rend(), GetRandInt);
+
     int nDenomResult = 0;
 
     InsecureRand insecureRand;
@@ -2516,10 +2802,6 @@ bool CWallet::SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount
 
             CTxIn txin = CTxIn(out.tx->GetHash(), out.i);
 
-            int nRounds = GetInputPrivateSendRounds(txin);
-            if(nRounds >= nPrivateSendRoundsMax) continue;
-            if(nRounds < nPrivateSendRoundsMin) continue;
-
             BOOST_FOREACH(int nBit, vecBits) {
                 if(out.tx->vout[out.i].nValue == vecPrivateSendDenominations[nBit]) {
                     if(nValueRet >= nValueMin) {
@@ -2754,27 +3036,16 @@ bool CWallet::GetVinAndKeysFromOutput(COutput out, CTxIn& txinRet, CPubKey& pubK
 
 int CWallet::CountInputsWithAmount(CAmount nInputAmount)
 {
-    CAmount nTotal = 0;
+    if (!IsDenominatedAmount(nInputAmount)) return 0;
+
+    int nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted()){
-                int nDepth = pcoin->GetDepthInMainChain(false);
-
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                    COutput out = COutput(pcoin, i, nDepth, true);
-                    CTxIn txin = CTxIn(out.tx->GetHash(), out.i);
-
-                    if(out.tx->vout[out.i].nValue != nInputAmount) continue;
-                    if(!IsDenominatedAmount(pcoin->vout[i].nValue)) continue;
-                    if(IsSpent(out.tx->GetHash(), i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(txin)) continue;
-
-                    nTotal++;
-                }
-            }
-        }
+        std::vector<std::pair<const CWalletTx*, unsigned int> > vOutputs;
+        GetDenomLedgerOutputs(vOutputs, nInputAmount, std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+        for (unsigned int i = 0; i < vOutputs.size(); i++)
+            if (vOutputs[i].first->IsTrusted())
+                nTotal++;
     }
 
     return nTotal;
@@ -3454,12 +3725,7 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        AddKeyPoolBatch(walletdb, 1, nKeys);
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -3473,8 +3739,6 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked(true))
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         if (kpSize > 0)
@@ -3482,23 +3746,116 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+        if (setKeyPool.size() < (nTargetSize + 1))
         {
+            CWalletDB walletdb(strWalletFile);
+
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool(): writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
-            std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
-            uiInterface.InitMessage(strMsg);
+            unsigned int nMissing = nTargetSize + 1 - setKeyPool.size();
+            AddKeyPoolBatch(walletdb, nEnd, nMissing, nTargetSize + 1);
+            LogPrintf("keypool added keys %d to %d, size=%u\n", nEnd, nEnd + nMissing - 1, setKeyPool.size());
         }
     }
     return true;
 }
 
+static void DeriveNewKey(CKey& key, CPubKey& pubkey, bool fCompressed)
+{
+    key.MakeNewKey(fCompressed);
+    pubkey = key.GetPubKey();
+    assert(key.VerifyPubKey(pubkey));
+}
+
+/** Derive every nStride-th key of vKeys, starting at nStart */
+static void DeriveNewKeys(std::vector<CKey>& vKeys, std::vector<CPubKey>& vPubKeys, size_t nStart, size_t nStride, bool fCompressed, std::atomic<unsigned int>& nDerived)
+{
+    for (size_t i = nStart; i < vKeys.size(); i += nStride) {
+        DeriveNewKey(vKeys[i], vPubKeys[i], fCompressed);
+        nDerived++;
+    }
+}
+
+void CWallet::AddKeyPoolBatch(CWalletDB& walletdb, int64_t nIndexStart, unsigned int nKeys, unsigned int nProgressTotal)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata, setKeyPool
+    if (nKeys == 0)
+        return;
+
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+
+    // Compressed public keys were introduced in version 0.6.0
+    // (written before the transaction starts, SetMinVersion uses its own handle)
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    // Derive all keys first: the workers are started once, and this thread
+    // takes the first share and reports progress meanwhile
+    int nThreads = std::max(1, std::min(GetNumCores(), (int)(nKeys / KEYPOOL_KEYS_PER_THREAD)));
+    std::vector<CKey> vKeys(nKeys);
+    std::vector<CPubKey> vPubKeys(nKeys);
+    std::atomic<unsigned int> nDerived(0);
+    {
+        boost::thread_group threads;
+        for (int i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(&DeriveNewKeys, boost::ref(vKeys), boost::ref(vPubKeys), i, nThreads, fCompressed, boost::ref(nDerived)));
+        for (size_t i = 0; i < nKeys; i += nThreads) {
+            DeriveNewKey(vKeys[i], vPubKeys[i], fCompressed);
+            unsigned int nDone = ++nDerived;
+            if (nProgressTotal > 0 && (i / nThreads) % KEYPOOL_PROGRESS_STEP == 0) {
+                double dProgress = 100.f * (nIndexStart + nDone - 1) / nProgressTotal;
+                std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
+                uiInterface.InitMessage(strMsg);
+            }
+        }
+        threads.join_all();
+    }
+
+    // Write everything in one transaction; the keystore and key pool only
+    // learn about the keys once it has committed
+    int64_t nCreationTime = GetTime();
+    CKeyMetadata metadata(nCreationTime);
+    std::vector<std::vector<unsigned char> > vCryptedSecrets(IsCrypted() ? nKeys : 0);
+    for (unsigned int i = 0; i < vCryptedSecrets.size(); i++) {
+        if (!EncryptKey(vKeys[i], vPubKeys[i], vCryptedSecrets[i]))
+            throw std::runtime_error("CWallet::AddKeyPoolBatch(): encrypting generated key failed");
+    }
+
+    // A wallet that isn't file backed has no database to run a transaction on
+    bool fTxn = walletdb.TxnBegin();
+    for (unsigned int i = 0; i < nKeys; i++)
+    {
+        bool fWritten = true;
+        if (fFileBacked) {
+            if (IsCrypted())
+                fWritten = walletdb.WriteCryptedKey(vPubKeys[i], vCryptedSecrets[i], metadata);
+            else
+                fWritten = walletdb.WriteKey(vPubKeys[i], vKeys[i].GetPrivKey(), metadata);
+        }
+        if (!fWritten || !walletdb.WritePool(nIndexStart + i, CKeyPool(vPubKeys[i]))) {
+            if (fTxn)
+                walletdb.TxnAbort();
+            throw std::runtime_error("CWallet::AddKeyPoolBatch(): writing generated key failed");
+        }
+    }
+    if (fTxn && !walletdb.TxnCommit())
+        throw std::runtime_error("CWallet::AddKeyPoolBatch(): committing generated keys failed");
+
+    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+        nTimeFirstKey = nCreationTime;
+    for (unsigned int i = 0; i < nKeys; i++)
+    {
+        mapKeyMetadata[vPubKeys[i].GetID()] = metadata;
+        bool fAdded = IsCrypted() ? CCryptoKeyStore::AddCryptedKey(vPubKeys[i], vCryptedSecrets[i])
+                                  : CCryptoKeyStore::AddKeyPubKey(vKeys[i], vPubKeys[i]);
+        if (!fAdded)
+            throw std::runtime_error("CWallet::AddKeyPoolBatch(): AddKey failed");
+        RemoveWatchOnlyKey(vPubKeys[i]);
+        setKeyPool.insert(nIndexStart + i);
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -44,6 +44,10 @@ extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
 
 static const unsigned int DEFAULT_KEYPOOL_SIZE = 1000;
+//! Minimum number of new keys per thread before key pool derivation is spread across threads
+static const unsigned int KEYPOOL_KEYS_PER_THREAD = 64;
+//! Number of keys this thread derives between key pool progress updates
+static const unsigned int KEYPOOL_PROGRESS_STEP = 100;
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
 //! -paytxfee will warn if called with a higher fee than this amount (in satoshis) per KB
@@ -71,6 +75,12 @@ static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWa
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 static const bool DEFAULT_WALLETBROADCAST = true;
+//! -rescanthreads default (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of rescan reader threads
+static const int MAX_RESCAN_THREADS = 16;
+//! Number of blocks the rescan readers may run ahead of the wallet
+static const int RESCAN_READAHEAD_BLOCKS = 128;
 
 class CAccountingEntry;
 class CBlockIndex;
@@ -540,6 +550,29 @@ private:
     mutable bool fAnonymizableTallyCachedNonDenom;
     mutable std::vector<CompactTallyItem> vecAnonymizableTallyCachedNonDenom;
 
+    /**
+     * Ledger of the wallet's spendable denominated outputs, keyed by
+     * denomination and then by (uncapped) PrivateSend rounds, so mixing can
+     * pick and count inputs without walking mapWallet. It is built on first
+     * use after the wallet is loaded or marked dirty, and kept current by
+     * AddToWallet. Whether an entry is spent is only checked when it is read;
+     * entries whose spend is in a block are dropped then, and put back by
+     * AddToWallet if that spend is disconnected again.
+     */
+    typedef std::map<int, std::set<COutPoint> > DenomRoundsMap;
+    mutable std::map<CAmount, DenomRoundsMap> mapDenomLedger;
+    mutable bool fDenomLedgerBuilt;
+    void AddToDenomLedger(const CWalletTx& wtx) const;
+    void AddOutputToDenomLedger(const CWalletTx& wtx, unsigned int n) const;
+    //! Whether a wallet transaction in the main chain spends the output
+    bool IsSpentInChain(const uint256& hash, unsigned int n) const;
+    /**
+     * Unspent ledger entries for nAmount (every denomination if 0) with
+     * nRoundsMin <= rounds < nRoundsMax, where rounds are capped at
+     * nPrivateSendRounds just like GetInputPrivateSendRounds does.
+     */
+    void GetDenomLedgerOutputs(std::vector<std::pair<const CWalletTx*, unsigned int> >& vOutputsRet, CAmount nAmount, int nRoundsMin, int nRoundsMax) const;
+
     /**
      * Used to keep track of spent outpoints, and
      * detect and report conflicts (double-spends or
@@ -555,6 +588,15 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Generate nKeys new keys and add them to the key pool at indexes
+     * nIndexStart and up. Keys are derived in parallel and all of them,
+     * together with their key pool entries, are written in a single
+     * database transaction through walletdb. They are added to the keystore
+     * and key pool only once that transaction has committed.
+     */
+    void AddKeyPoolBatch(CWalletDB& walletdb, int64_t nIndexStart, unsigned int nKeys, unsigned int nProgressTotal = 0);
+
 public:
     /*
      * Main wallet lock.
@@ -610,6 +652,8 @@ public:
         fAnonymizableTallyCachedNonDenom = false;
         vecAnonymizableTallyCached.clear();
         vecAnonymizableTallyCachedNonDenom.clear();
+        mapDenomLedger.clear();
+        fDenomLedgerBuilt = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -686,6 +730,8 @@ public:
     CPubKey GenerateNewKey();
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
+    //! Stop watching the scripts of a key that is now in the store
+    void RemoveWatchOnlyKey(const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
     //! Load metadata (used by LoadWallet)